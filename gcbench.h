@@ -0,0 +1,712 @@
+#ifndef gcbench_h
+#define gcbench_h
+
+// The benchmark suite. Each workload only uses the VM API that lisp2.c and
+// lisp2-reallocate.c have in common, so both include this after defining it,
+// and each gets its own copy compiled against its own VM and Object.
+//
+// Every workload has a fixed seed and fixed sizes, and returns a checksum
+// computed from the objects it built, so runs are repeatable and any
+// collector that loses or corrupts an object shows up as a different
+// checksum. The sizes keep the live set well under half of lisp2.c's fixed
+// heap, so the semi-space collector can run them too.
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef struct {
+  const char* name;
+  long (*run)(VM* vm, int size, int iterations, uint64_t seed);
+
+  // What [size] and [iterations] mean varies by workload.
+  int size;
+  int iterations;
+  uint64_t seed;
+} Benchmark;
+
+// Returns a number from 0 to [n] - 1 from a xorshift generator.
+static uint32_t benchRandom(uint64_t* state, uint32_t n) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return (uint32_t)(x % n);
+}
+
+// Removes the object below the top of the stack, keeping the top.
+static void benchDropUnder(VM* vm) {
+  setStack(vm, vm->stackSize - 2, getStack(vm, vm->stackSize - 1));
+  pop(vm);
+}
+
+// Lists are chained through their pairs' heads, with an int in each tail,
+// and end at an int. This pushes one of [length] with values from [first].
+static void benchPushList(VM* vm, int length, int first) {
+  pushInt(vm, -1);
+  for (int i = 0; i < length; i++) {
+    pushInt(vm, first + i);
+    pushPair(vm);
+  }
+}
+
+// Returns the sum of the values in [list].
+static long benchSumList(Object* list) {
+  long sum = 0;
+  while (objectType(list) == OBJ_PAIR) {
+    sum += list->tail->value;
+    list = list->head;
+  }
+  return sum;
+}
+
+// Pushes a complete binary tree of pairs [depth] levels deep.
+static void benchPushTree(VM* vm, int depth) {
+  if (depth == 0) {
+    pushInt(vm, 1);
+    return;
+  }
+
+  benchPushTree(vm, depth - 1);
+  benchPushTree(vm, depth - 1);
+  pushPair(vm);
+}
+
+static long benchCountTree(Object* tree) {
+  if (objectType(tree) == OBJ_INT) return tree->value;
+  return 1 + benchCountTree(tree->head) + benchCountTree(tree->tail);
+}
+
+// The binary-trees benchmark: a long-lived tree [size] levels deep, and many
+// short-lived ones of every other depth up to it.
+static long benchBinaryTrees(VM* vm, int size, int iterations, uint64_t seed) {
+  long checksum = 0;
+
+  // One tree deeper than the rest, to stretch the heap.
+  benchPushTree(vm, size + 1);
+  checksum += benchCountTree(pop(vm));
+
+  benchPushTree(vm, size);
+
+  for (int depth = 4; depth <= size; depth += 2) {
+    int trees = iterations << (size - depth);
+    for (int i = 0; i < trees; i++) {
+      benchPushTree(vm, depth);
+      checksum += benchCountTree(pop(vm));
+    }
+  }
+
+  checksum += benchCountTree(pop(vm));
+  return checksum;
+}
+
+// Builds lists of [size] nodes one after another, keeping the previous one
+// alive while the next is built.
+static long benchListChurn(VM* vm, int size, int iterations, uint64_t seed) {
+  long checksum = 0;
+
+  benchPushList(vm, size, 0);
+  for (int i = 0; i < iterations; i++) {
+    benchPushList(vm, size, i);
+    checksum += benchSumList(getStack(vm, vm->stackSize - 2));
+    benchDropUnder(vm);
+  }
+
+  checksum += benchSumList(pop(vm));
+  return checksum;
+}
+
+// Walks [steps] random fields from [root], adding up the ints it reaches and
+// starting over from the root after each one.
+static long benchWalkGraph(Object* root, int steps, uint64_t* random) {
+  long sum = 0;
+  Object* node = root;
+  for (int i = 0; i < steps; i++) {
+    if (objectType(node) == OBJ_INT) {
+      sum += node->value;
+      node = root;
+    } else {
+      node = benchRandom(random, 2) ? node->head : node->tail;
+    }
+  }
+  return sum;
+}
+
+// Builds graphs of [size] nodes and rewires them at random into cycles. Each
+// graph is walked after the next one has been built, which collects while it
+// is still reachable, so the collector has to trace and move the cycles.
+static long benchRandomGraphs(VM* vm, int size, int iterations,
+                              uint64_t seed) {
+  uint64_t random = seed;
+  long checksum = 0;
+  Object** nodes = malloc(size * sizeof(Object*));
+
+  pushInt(vm, 0);
+  for (int i = 0; i < iterations; i++) {
+    benchPushList(vm, size, 0);
+
+    // Nothing is allocated until the rewiring is done, so these pointers stay
+    // valid until then.
+    Object* node = getStack(vm, vm->stackSize - 1);
+    for (int j = 0; j < size; j++) {
+      nodes[j] = node;
+      node = node->head;
+    }
+
+    // Point tails at other nodes, making cycles, and cut some of the head
+    // links so parts of the graph are only reachable through those.
+    for (int j = 0; j < size * 2; j++) {
+      Object* from = nodes[benchRandom(&random, size)];
+      Object* to = nodes[benchRandom(&random, size)];
+      if (j % 8 == 0) {
+        setField(vm, from, 0, from->tail);
+      } else if (objectType(from->tail) == OBJ_INT) {
+        setField(vm, from, 1, to);
+      }
+    }
+
+    checksum += benchWalkGraph(getStack(vm, vm->stackSize - 2),
+                               size * 4, &random);
+    benchDropUnder(vm);
+  }
+
+  checksum += benchWalkGraph(pop(vm), size * 4, &random);
+  free(nodes);
+  return checksum;
+}
+
+// Keeps a list of [size] nodes alive for the whole run while allocating lots
+// of short-lived pairs, and now and then stores a new object into the
+// long-lived list.
+static long benchLongLived(VM* vm, int size, int iterations, uint64_t seed) {
+  uint64_t random = seed;
+
+  benchPushList(vm, size, 0);
+  for (int i = 0; i < iterations; i++) {
+    pushInt(vm, i);
+    pushInt(vm, i);
+    pushPair(vm);
+    pop(vm);
+
+    if (i % 256 == 0) {
+      pushInt(vm, i);
+      Object* value = pop(vm);
+
+      Object* node = getStack(vm, vm->stackSize - 1);
+      for (int skip = benchRandom(&random, size); skip > 0; skip--) {
+        node = node->head;
+      }
+      setField(vm, node, 1, value);
+    }
+  }
+
+  return benchSumList(pop(vm));
+}
+
+// A hash table of [size] entries in 64 buckets, with a least recently added
+// entry evicted from a bucket when it's full. Looks up keys from a range four
+// times the table's size, adding an entry on a miss, so the live set holds
+// steady while the entries in it keep turning over.
+#define BENCH_BUCKETS 64
+
+static long benchCache(VM* vm, int size, int iterations, uint64_t seed) {
+  uint64_t random = seed;
+  int perBucket = size / BENCH_BUCKETS;
+  long hits = 0;
+
+  size_t buckets = vm->stackSize;
+  for (int i = 0; i < BENCH_BUCKETS; i++) pushInt(vm, -1);
+
+  for (int i = 0; i < iterations; i++) {
+    int key = (int)benchRandom(&random, size * 4);
+    size_t bucket = buckets + key % BENCH_BUCKETS;
+
+    int found = 0;
+    for (Object* entry = getStack(vm, bucket);
+         objectType(entry) == OBJ_PAIR; entry = entry->head) {
+      if (entry->tail->value == key) {
+        found = 1;
+        break;
+      }
+    }
+
+    if (found) {
+      hits++;
+      continue;
+    }
+
+    push(vm, getStack(vm, bucket));
+    pushInt(vm, key);
+    pushPair(vm);
+    setStack(vm, bucket, getStack(vm, vm->stackSize - 1));
+    pop(vm);
+
+    // Cut off the oldest entry if the bucket is over its share.
+    Object* entry = getStack(vm, bucket);
+    for (int j = 1; j < perBucket && objectType(entry->head) == OBJ_PAIR; j++) {
+      entry = entry->head;
+    }
+    setField(vm, entry, 0, entry->tail);
+  }
+
+  for (int i = 0; i < BENCH_BUCKETS; i++) pop(vm);
+  return hits;
+}
+
+static const Benchmark benchmarks[] = {
+  { "binary-trees", benchBinaryTrees, 12, 4, 0 },
+  { "list-churn", benchListChurn, 3000, 300, 0 },
+  { "random-graphs", benchRandomGraphs, 2000, 200, 0x2545f4914f6cdd1dull },
+  { "long-lived", benchLongLived, 4000, 500000, 0x9e3779b97f4a7c15ull },
+  { "cache", benchCache, 2048, 500000, 0xd1b54a32d192ed03ull },
+};
+
+// Runs every benchmark on a VM from [create], each in its own process so the
+// peak RSS is its own, and writes a line of JSON for each to stdout. The
+// results are tagged with [target] and [collector].
+static void runBenchmarks(const char* target, const char* collector,
+                          VM* (*create)(void)) {
+  for (size_t i = 0; i < sizeof(benchmarks) / sizeof(Benchmark); i++) {
+    const Benchmark* benchmark = &benchmarks[i];
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      VM* vm = create();
+      uint64_t start = gcNow();
+      long checksum = benchmark->run(vm, benchmark->size,
+                                     benchmark->iterations, benchmark->seed);
+      uint64_t elapsed = gcNow() - start;
+
+      GCStats stats;
+      getGCStats(vm, &stats);
+      struct rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+
+      printf("{\"target\":\"%s\",\"collector\":\"%s\",\"benchmark\":\"%s\","
+             "\"size\":%d,\"iterations\":%d,\"seed\":%llu,\"checksum\":%ld,"
+             "\"elapsed_ns\":%llu,\"allocated_bytes\":%llu,"
+             "\"alloc_mb_per_s\":%.1f,\"collections\":%llu,"
+             "\"total_pause_ns\":%llu,\"max_pause_ns\":%llu,"
+             "\"peak_rss_kb\":%ld}\n",
+             target, collector, benchmark->name, benchmark->size,
+             benchmark->iterations, (unsigned long long)benchmark->seed,
+             checksum, (unsigned long long)elapsed,
+             (unsigned long long)stats.bytesAllocated,
+             stats.bytesAllocated / 1e6 / (elapsed / 1e9),
+             (unsigned long long)stats.collections,
+             (unsigned long long)stats.totalPauseNs,
+             (unsigned long long)stats.maxPauseNs, usage.ru_maxrss);
+
+      freeVM(vm);
+      exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "Benchmark %s failed.\n", benchmark->name);
+      exit(1);
+    }
+  }
+}
+
+// How many objects the allocation microbenchmark allocates.
+#define BENCH_ALLOCATIONS 20000000
+
+// How long the lists listBenchmark() builds are, and how many it builds.
+#define BENCH_LIST_LENGTH 10000
+#define BENCH_LISTS 500
+
+// Builds BENCH_LISTS lists of BENCH_LIST_LENGTH ints on a VM from [create],
+// one pushInt() and pushPair() at a time and then all at once with
+// pushList(), and writes a line of JSON with how many nanoseconds each element
+// took both ways.
+static void listBenchmark(const char* target, const char* collector,
+                          VM* (*create)(void)) {
+  int* values = malloc(BENCH_LIST_LENGTH * sizeof(int));
+  for (int i = 0; i < BENCH_LIST_LENGTH; i++) values[i] = i;
+
+  VM* vm = create();
+  uint64_t start = gcNow();
+  for (int i = 0; i < BENCH_LISTS; i++) {
+    benchPushList(vm, BENCH_LIST_LENGTH, 0);
+    pop(vm);
+  }
+  uint64_t pushNs = gcNow() - start;
+  freeVM(vm);
+
+  vm = create();
+  start = gcNow();
+  for (int i = 0; i < BENCH_LISTS; i++) {
+    pushList(vm, values, BENCH_LIST_LENGTH);
+    pop(vm);
+  }
+  uint64_t bulkNs = gcNow() - start;
+  freeVM(vm);
+  free(values);
+
+  double elements = (double)BENCH_LISTS * BENCH_LIST_LENGTH;
+  printf("{\"target\":\"%s\",\"collector\":\"%s\",\"benchmark\":\"list\","
+         "\"elements\":%.0f,\"push_ns_per_element\":%.2f,"
+         "\"bulk_ns_per_element\":%.2f}\n",
+         target, collector, elements, pushNs / elements, bulkNs / elements);
+}
+
+// Allocates BENCH_ALLOCATIONS ints on a VM from [create] without keeping any
+// of them, and writes a line of JSON with how many nanoseconds each took, with
+// and without the time spent collecting. Without it, what's left is mostly
+// the allocation fast path.
+//
+// A small list stays live throughout, since lisp2-reallocate.c would shrink
+// an empty heap to nothing and collect on every allocation.
+static void allocBenchmark(const char* target, const char* collector,
+                           VM* (*create)(void)) {
+  VM* vm = create();
+  benchPushList(vm, 1000, 0);
+
+  uint64_t start = gcNow();
+  for (long i = 0; i < BENCH_ALLOCATIONS; i++) newObject(vm, OBJ_INT);
+  uint64_t elapsed = gcNow() - start;
+
+  GCStats stats;
+  getGCStats(vm, &stats);
+  freeVM(vm);
+
+  printf("{\"target\":\"%s\",\"collector\":\"%s\",\"benchmark\":\"alloc\","
+         "\"allocations\":%d,\"elapsed_ns\":%llu,\"collections\":%llu,"
+         "\"ns_per_alloc\":%.2f,\"mutator_ns_per_alloc\":%.2f}\n",
+         target, collector, BENCH_ALLOCATIONS, (unsigned long long)elapsed,
+         (unsigned long long)stats.collections,
+         (double)elapsed / BENCH_ALLOCATIONS,
+         (double)(elapsed - stats.totalPauseNs) / BENCH_ALLOCATIONS);
+}
+
+// How many requests idleBenchmark() serves, and how long it idles after each.
+#define BENCH_REQUESTS 500
+#define BENCH_IDLE_NS 1000000
+
+// Serves BENCH_REQUESTS requests that each build and drop some short-lived
+// lists next to a long-lived one, idling for BENCH_IDLE_NS after each. If
+// [notify] is set, the VM is told about each idle period with
+// vmIdleNotification(). Writes a line of JSON with the request latencies and
+// how many collections happened during requests and while idle.
+static void idleRun(const char* target, const char* collector,
+                    VM* (*create)(void), int notify) {
+  VM* vm = create();
+  benchPushList(vm, 5000, 0);
+
+  GCHistogram latencies;
+  memset(&latencies, 0, sizeof(latencies));
+  uint64_t maxLatency = 0;
+  uint64_t requestCollections = 0;
+  uint64_t idleCollections = 0;
+
+  for (int i = 0; i < BENCH_REQUESTS; i++) {
+    uint64_t collections = vm->collections;
+    uint64_t start = gcNow();
+    for (int j = 0; j < 20; j++) {
+      benchPushList(vm, 100, i);
+      pop(vm);
+    }
+    uint64_t latency = gcNow() - start;
+    gcHistogramRecord(&latencies, latency);
+    if (latency > maxLatency) maxLatency = latency;
+    requestCollections += vm->collections - collections;
+
+    uint64_t deadline = gcNow() + BENCH_IDLE_NS;
+    if (notify && vmIdleNotification(vm, deadline) != GC_IDLE_NONE) {
+      idleCollections++;
+    }
+    while (gcNow() < deadline) {}
+  }
+  freeVM(vm);
+
+  printf("{\"target\":\"%s\",\"collector\":\"%s\",\"benchmark\":\"idle\","
+         "\"notify\":%s,\"requests\":%d,\"request_collections\":%llu,"
+         "\"idle_collections\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu,"
+         "\"max_ns\":%llu}\n",
+         target, collector, notify ? "true" : "false", BENCH_REQUESTS,
+         (unsigned long long)requestCollections,
+         (unsigned long long)idleCollections,
+         (unsigned long long)gcHistogramPercentile(&latencies, 50),
+         (unsigned long long)gcHistogramPercentile(&latencies, 99),
+         (unsigned long long)maxLatency);
+}
+
+// Runs idleRun() without and then with idle notifications.
+static void idleBenchmark(const char* target, const char* collector,
+                          VM* (*create)(void)) {
+  idleRun(target, collector, create, 0);
+  idleRun(target, collector, create, 1);
+}
+
+// How deep the long-lived tree hugePageBenchmark() scrambles is, how many
+// short-lived trees of depth 10 it then allocates, and how many times the
+// tree's size the heap is.
+#define BENCH_HUGE_DEPTH 20
+#define BENCH_HUGE_CHURN 20000
+#define BENCH_HUGE_MULTIPLE 4
+
+// Builds a tree BENCH_HUGE_DEPTH levels deep and swaps subtrees between random
+// nodes on the same level, so that every level is scattered across the heap
+// and tracing it jumps between pages. Then collects over and over while
+// allocating BENCH_HUGE_CHURN trees of garbage, on a VM from [createSized]
+// sized for the tree. If [hugePages] is set, the VM's heap is moved into huge
+// pages first. Runs in its own process, so the
+// huge pages and peak RSS are its own, and writes a line of JSON with the GC
+// time and the dTLB misses counted during collections, which are null if the
+// counter isn't available.
+static void hugePageRun(const char* target, const char* collector,
+                        VM* (*createSized)(uint64_t liveBytes,
+                                           double multiple),
+                        int hugePages) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    uint64_t treeBytes = (((uint64_t)2 << BENCH_HUGE_DEPTH) - 1) *
+                         sizeof(Object);
+    VM* vm = createSized(treeBytes, BENCH_HUGE_MULTIPLE);
+    if (hugePages && !enableHugePages(vm)) {
+      fprintf(stderr, "Could not map the heap in huge pages.\n");
+      exit(1);
+    }
+    uint32_t available = enableGCCounters(vm);
+
+    uint64_t start = gcNow();
+    benchPushTree(vm, BENCH_HUGE_DEPTH);
+
+    // Nothing is allocated while scrambling, so these pointers stay valid.
+    // The pairs on level L are at [(1 << L) - 1, (1 << (L + 1)) - 1).
+    size_t pairs = ((size_t)1 << BENCH_HUGE_DEPTH) - 1;
+    Object** nodes = malloc(pairs * sizeof(Object*));
+    nodes[0] = getStack(vm, vm->stackSize - 1);
+    for (size_t i = 0; 2 * i + 2 < pairs; i++) {
+      nodes[2 * i + 1] = nodes[i]->head;
+      nodes[2 * i + 2] = nodes[i]->tail;
+    }
+
+    uint64_t random = 0x853c49e6748fea9bull;
+    for (int level = 0; level < BENCH_HUGE_DEPTH; level++) {
+      Object** row = nodes + ((size_t)1 << level) - 1;
+      uint32_t width = 1u << level;
+      for (uint32_t i = 0; i < width; i++) {
+        Object* other = row[benchRandom(&random, width)];
+        Object* head = row[i]->head;
+        setField(vm, row[i], 0, other->head);
+        setField(vm, other, 0, head);
+      }
+    }
+    free(nodes);
+
+    for (int i = 0; i < BENCH_HUGE_CHURN; i++) {
+      benchPushTree(vm, 10);
+      pop(vm);
+    }
+    long checksum = benchCountTree(getStack(vm, vm->stackSize - 1));
+    uint64_t elapsed = gcNow() - start;
+
+    GCStats stats;
+    getGCStats(vm, &stats);
+    // The log holds the last GC_LOG_CAPACITY collections, which is all of
+    // them at these sizes.
+    uint64_t dtlbMisses = 0;
+    GCEvent event;
+    for (int back = 0; gcLogRecent(&vm->events, back, &event); back++) {
+      for (int phase = 0; phase < GC_PHASE_COUNT; phase++) {
+        dtlbMisses += event.phaseCounters[phase][GC_COUNTER_DTLB_MISSES];
+      }
+    }
+    uint64_t hugeBytes = gcPagesHugeBytes();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("{\"target\":\"%s\",\"collector\":\"%s\","
+           "\"benchmark\":\"huge-pages\",\"huge_pages\":%s,"
+           "\"checksum\":%ld,\"elapsed_ns\":%llu,\"collections\":%llu,"
+           "\"total_pause_ns\":%llu,\"max_pause_ns\":%llu,",
+           target, collector, hugePages ? "true" : "false", checksum,
+           (unsigned long long)elapsed,
+           (unsigned long long)stats.collections,
+           (unsigned long long)stats.totalPauseNs,
+           (unsigned long long)stats.maxPauseNs);
+    if (available & (1u << GC_COUNTER_DTLB_MISSES)) {
+      printf("\"gc_dtlb_misses\":%llu,", (unsigned long long)dtlbMisses);
+    } else {
+      printf("\"gc_dtlb_misses\":null,");
+    }
+    printf("\"anon_huge_bytes\":%llu,\"peak_rss_kb\":%ld}\n",
+           (unsigned long long)hugeBytes, usage.ru_maxrss);
+
+    freeVM(vm);
+    exit(0);
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "Huge page run failed.\n");
+    exit(1);
+  }
+}
+
+// Runs hugePageRun() without and then with huge pages.
+static void hugePageBenchmark(const char* target, const char* collector,
+                              VM* (*createSized)(uint64_t liveBytes,
+                                                 double multiple)) {
+  hugePageRun(target, collector, createSized, 0);
+  hugePageRun(target, collector, createSized, 1);
+}
+
+// Runs the benchmark named [name] on a VM from [create] while recording a
+// trace of it to [path]. Returns zero if there's no such benchmark or the
+// trace can't be written.
+static int recordBenchmark(const char* name, const char* path,
+                           VM* (*create)(void)) {
+  for (size_t i = 0; i < sizeof(benchmarks) / sizeof(Benchmark); i++) {
+    const Benchmark* benchmark = &benchmarks[i];
+    if (strcmp(benchmark->name, name) != 0) continue;
+
+    VM* vm = create();
+    if (!startTraceRecording(vm, path)) {
+      freeVM(vm);
+      return 0;
+    }
+
+    benchmark->run(vm, benchmark->size, benchmark->iterations,
+                   benchmark->seed);
+    freeVM(vm);
+    return 1;
+  }
+
+  return 0;
+}
+
+// Replays the trace at [path] on a VM from [create] and writes a line of JSON
+// with how it went. Returns zero if the trace couldn't be replayed.
+static int replayBenchmark(const char* target, const char* collector,
+                           const char* path, VM* (*create)(void)) {
+  VM* vm = create();
+  uint64_t start = gcNow();
+  long ops = replayTrace(vm, path);
+  uint64_t elapsed = gcNow() - start;
+
+  GCStats stats;
+  getGCStats(vm, &stats);
+  freeVM(vm);
+  if (ops < 0) return 0;
+
+  printf("{\"target\":\"%s\",\"collector\":\"%s\",\"trace\":\"%s\","
+         "\"ops\":%ld,\"elapsed_ns\":%llu,\"allocated_bytes\":%llu,"
+         "\"collections\":%llu,\"total_pause_ns\":%llu,"
+         "\"max_pause_ns\":%llu}\n",
+         target, collector, path, ops, (unsigned long long)elapsed,
+         (unsigned long long)stats.bytesAllocated,
+         (unsigned long long)stats.collections,
+         (unsigned long long)stats.totalPauseNs,
+         (unsigned long long)stats.maxPauseNs);
+  return 1;
+}
+
+
+// The heap sizes the sweep runs a benchmark at, as multiples of its minimum
+// live size.
+static const double sweepMultiples[] = {
+  1.1, 1.25, 1.5, 1.75, 2, 2.5, 3, 4, 5, 6
+};
+
+// The workloads don't check for failed allocations, so a heap too small for
+// one ends its run instead.
+static void benchOutOfMemory(VM* vm, size_t size) {
+  fprintf(stderr, "Out of memory allocating %zu bytes.\n", size);
+  exit(1);
+}
+
+// Returns the pause time that [percentile] of the pauses in [stats] were no
+// longer than. The histogram only knows which bucket a pause fell in, so this
+// is capped at the longest pause actually seen.
+static uint64_t sweepPercentile(const GCStats* stats, double percentile) {
+  uint64_t pause = gcHistogramPercentile(&stats->pauses, percentile);
+  return pause < stats->maxPauseNs ? pause : stats->maxPauseNs;
+}
+
+// Writes the header line for the CSV that sweepBenchmark() writes.
+static void writeSweepHeader() {
+  printf("target,collector,benchmark,live_bytes,multiple,heap_bytes,"
+         "collections,gc_ns,mutator_ns,pause_p50_ns,pause_p90_ns,"
+         "pause_p99_ns,pause_max_ns,peak_rss_kb,status\n");
+}
+
+// Runs the benchmark named [name] across a range of heap sizes, each in its
+// own process, and writes a line of CSV for each to stdout.
+//
+// The minimum live size is the most bytes live after any collection in a run
+// on a VM from [create]. Each run in the sweep then gets a VM from
+// [createSized], which is passed that size and the multiple of it to give the
+// heap. A heap too small for the benchmark shows up as a row with a status
+// other than "ok" and no timings, instead of ending the sweep. Returns zero if
+// there's no such benchmark.
+static int sweepBenchmark(const char* target, const char* collector,
+                          const char* name, VM* (*create)(void),
+                          VM* (*createSized)(uint64_t liveBytes,
+                                             double multiple)) {
+  const Benchmark* benchmark = NULL;
+  for (size_t i = 0; i < sizeof(benchmarks) / sizeof(Benchmark); i++) {
+    if (strcmp(benchmarks[i].name, name) == 0) benchmark = &benchmarks[i];
+  }
+  if (benchmark == NULL) return 0;
+
+  VM* vm = create();
+  benchmark->run(vm, benchmark->size, benchmark->iterations, benchmark->seed);
+  GCStats stats;
+  getGCStats(vm, &stats);
+  freeVM(vm);
+  uint64_t liveBytes = stats.peakLiveBytes;
+
+  for (size_t i = 0; i < sizeof(sweepMultiples) / sizeof(double); i++) {
+    double multiple = sweepMultiples[i];
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      vm = createSized(liveBytes, multiple);
+      setOutOfMemoryHandler(vm, benchOutOfMemory);
+      uint64_t start = gcNow();
+      benchmark->run(vm, benchmark->size, benchmark->iterations,
+                     benchmark->seed);
+      uint64_t elapsed = gcNow() - start;
+
+      getGCStats(vm, &stats);
+      struct rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+
+      printf("%s,%s,%s,%llu,%.2f,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,"
+             "%ld,ok\n",
+             target, collector, benchmark->name,
+             (unsigned long long)liveBytes, multiple,
+             (unsigned long long)stats.peakHeapBytes,
+             (unsigned long long)stats.collections,
+             (unsigned long long)stats.totalPauseNs,
+             (unsigned long long)(elapsed - stats.totalPauseNs),
+             (unsigned long long)sweepPercentile(&stats, 50),
+             (unsigned long long)sweepPercentile(&stats, 90),
+             (unsigned long long)sweepPercentile(&stats, 99),
+             (unsigned long long)stats.maxPauseNs, usage.ru_maxrss);
+
+      freeVM(vm);
+      exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      printf("%s,%s,%s,%llu,%.2f,,,,,,,,,,failed\n", target, collector,
+             benchmark->name, (unsigned long long)liveBytes, multiple);
+    }
+  }
+
+  return 1;
+}
+
+#endif
@@ -0,0 +1,69 @@
+#include <string.h>
+
+#include "gccensus.h"
+
+void gcCensusReset(GCCensus* census, size_t heapSize) {
+  memset(census, 0, sizeof(GCCensus));
+  census->heapSize = heapSize;
+  census->regionSize = (heapSize + GC_CENSUS_REGIONS - 1) / GC_CENSUS_REGIONS;
+  if (census->regionSize == 0) census->regionSize = 1;
+}
+
+void gcCensusSpan(GCCensus* census, size_t size) {
+  int bucket = size == 0 ? 0 : 63 - __builtin_clzll(size);
+  if (bucket >= GC_CENSUS_SPAN_BUCKETS) bucket = GC_CENSUS_SPAN_BUCKETS - 1;
+
+  census->spans[bucket]++;
+  census->spanCount++;
+  if (size > census->largestSpan) census->largestSpan = size;
+}
+
+double gcCensusFragmentation(const GCCensus* census) {
+  uint64_t live = 0;
+  uint64_t dead = 0;
+  for (int i = 0; i < GC_CENSUS_REGIONS; i++) {
+    live += census->regionLive[i];
+    dead += census->regionDead[i];
+  }
+
+  return live + dead == 0 ? 0 : (double)dead / (live + dead);
+}
+
+void gcCensusWriteJSON(FILE* file, const GCCensus* census,
+                       const char** typeNames, int typeCount) {
+  fprintf(file, "{\"types\":{");
+  for (int i = 0; i < typeCount && i < GC_CENSUS_TYPES; i++) {
+    fprintf(file, "%s\"%s\":{\"objects\":%llu,\"bytes\":%llu}",
+            i > 0 ? "," : "", typeNames[i],
+            (unsigned long long)census->objects[i],
+            (unsigned long long)census->bytes[i]);
+  }
+
+  fprintf(file, "},\"region_size\":%llu,\"regions\":[",
+          (unsigned long long)census->regionSize);
+  for (int i = 0; i < GC_CENSUS_REGIONS; i++) {
+    fprintf(file, "%s{\"live\":%llu,\"dead\":%llu}", i > 0 ? "," : "",
+            (unsigned long long)census->regionLive[i],
+            (unsigned long long)census->regionDead[i]);
+  }
+
+  // Only the buckets that have spans, keyed by their smallest length.
+  fprintf(file, "],\"fragmentation\":%.4f,\"dead_spans\":{",
+          gcCensusFragmentation(census));
+  int first = 1;
+  for (int i = 0; i < GC_CENSUS_SPAN_BUCKETS; i++) {
+    if (census->spans[i] == 0) continue;
+    fprintf(file, "%s\"%llu\":%llu", first ? "" : ",", 1ull << i,
+            (unsigned long long)census->spans[i]);
+    first = 0;
+  }
+
+  fprintf(file, "},\"largest_dead_span\":%llu,\"moved_objects\":%llu,"
+          "\"moved_bytes\":%llu,\"mean_distance\":%.1f,\"max_distance\":%llu}\n",
+          (unsigned long long)census->largestSpan,
+          (unsigned long long)census->movedObjects,
+          (unsigned long long)census->movedBytes,
+          census->movedObjects == 0 ? 0.0 :
+              (double)census->totalDistance / census->movedObjects,
+          (unsigned long long)census->maxDistance);
+}
@@ -0,0 +1,91 @@
+#ifndef gccensus_h
+#define gccensus_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// The most object types a census tells apart.
+#define GC_CENSUS_TYPES 8
+
+// The heap is split into this many equal regions for counting live and dead
+// bytes, so it shows where garbage is concentrated.
+#define GC_CENSUS_REGIONS 16
+
+// Dead spans are counted in power-of-two buckets of their length in bytes.
+// Bucket i holds spans from 2^i up to 2^(i+1) - 1 bytes, and the last one
+// holds everything longer.
+#define GC_CENSUS_SPAN_BUCKETS 24
+
+// What a single collection found in the heap. Every count is gathered while
+// the collector walks objects anyway, so taking one costs no extra pass.
+typedef struct {
+  // Live objects and bytes by type, including large objects.
+  uint64_t objects[GC_CENSUS_TYPES];
+  uint64_t bytes[GC_CENSUS_TYPES];
+
+  // The size of the heap being walked and of each region of it.
+  uint64_t heapSize;
+  uint64_t regionSize;
+
+  // Live and dead bytes whose objects start in each region.
+  uint64_t regionLive[GC_CENSUS_REGIONS];
+  uint64_t regionDead[GC_CENSUS_REGIONS];
+
+  // Runs of adjacent dead objects.
+  uint64_t spans[GC_CENSUS_SPAN_BUCKETS];
+  uint64_t spanCount;
+  uint64_t largestSpan;
+
+  // How many objects compaction moved, and how far in total and at most.
+  uint64_t movedObjects;
+  uint64_t movedBytes;
+  uint64_t totalDistance;
+  uint64_t maxDistance;
+} GCCensus;
+
+// Clears [census] for a collection of a heap of [heapSize] bytes.
+void gcCensusReset(GCCensus* census, size_t heapSize);
+
+// Counts a live object of [type] and [size] bytes.
+static inline void gcCensusLive(GCCensus* census, int type, size_t size) {
+  if (type >= GC_CENSUS_TYPES) return;
+  census->objects[type]++;
+  census->bytes[type] += size;
+}
+
+// Counts the [size] bytes at [offset] in the heap as being live or dead.
+static inline void gcCensusRegion(GCCensus* census, size_t offset, size_t size,
+                                  int live) {
+  size_t region = offset / census->regionSize;
+  if (region >= GC_CENSUS_REGIONS) region = GC_CENSUS_REGIONS - 1;
+
+  if (live) {
+    census->regionLive[region] += size;
+  } else {
+    census->regionDead[region] += size;
+  }
+}
+
+// Counts a run of [size] bytes of adjacent dead objects.
+void gcCensusSpan(GCCensus* census, size_t size);
+
+// Counts an object of [size] bytes that compaction moves [distance] bytes.
+static inline void gcCensusMoved(GCCensus* census, size_t size,
+                                 size_t distance) {
+  if (distance == 0) return;
+  census->movedObjects++;
+  census->movedBytes += size;
+  census->totalDistance += distance;
+  if (distance > census->maxDistance) census->maxDistance = distance;
+}
+
+// Returns the fraction of the walked heap's bytes that were dead.
+double gcCensusFragmentation(const GCCensus* census);
+
+// Writes [census] to [file] as a single line of JSON, naming the first
+// [typeCount] types with [typeNames].
+void gcCensusWriteJSON(FILE* file, const GCCensus* census,
+                       const char** typeNames, int typeCount);
+
+#endif
@@ -0,0 +1,60 @@
+#include <string.h>
+
+#include "gcidle.h"
+
+static const char* actionNames[] = { "none", "partial", "full" };
+
+// Returns non-zero if [phase] only visits live objects, so that its cost
+// scales with the live bytes rather than the used ones.
+static int scalesWithLive(GCPhase phase) {
+  return phase == GC_PHASE_MARK || phase == GC_PHASE_COPY ||
+         phase == GC_PHASE_COMPACT;
+}
+
+void gcPredictorInit(GCPausePredictor* predictor) {
+  memset(predictor, 0, sizeof(GCPausePredictor));
+}
+
+void gcPredictorRecord(GCPausePredictor* predictor, const GCEvent* event) {
+  double* nsPerByte = predictor->nsPerByte[event->kind];
+  int first = predictor->collections[event->kind]++ == 0;
+
+  for (int phase = 0; phase < GC_PHASE_COUNT; phase++) {
+    // Phases that didn't run have zero timestamps.
+    if (event->phaseEndNs[phase] == 0) continue;
+
+    uint64_t bytes = scalesWithLive((GCPhase)phase) ? event->liveBytes
+                                                    : event->usedBytesBefore;
+    if (bytes == 0) continue;
+
+    // Weight the latest collection as much as all of the earlier ones, so the
+    // prediction follows the heap's shape as it changes.
+    double sample = (double)gcPhaseNs(event, (GCPhase)phase) / bytes;
+    nsPerByte[phase] = first ? sample : (nsPerByte[phase] + sample) / 2;
+  }
+}
+
+uint64_t gcPredictPause(const GCPausePredictor* predictor, GCKind kind,
+                        uint64_t liveBytes, uint64_t usedBytes) {
+  if (predictor->collections[kind] == 0) {
+    return (uint64_t)(usedBytes * GC_IDLE_DEFAULT_NS_PER_BYTE);
+  }
+
+  double pauseNs = 0;
+  for (int phase = 0; phase < GC_PHASE_COUNT; phase++) {
+    uint64_t bytes = scalesWithLive((GCPhase)phase) ? liveBytes : usedBytes;
+    pauseNs += predictor->nsPerByte[kind][phase] * bytes;
+  }
+  return (uint64_t)pauseNs;
+}
+
+int gcIdleShouldCollect(uint64_t liveBytes, uint64_t usedBytes,
+                        uint64_t capacity) {
+  if (usedBytes <= liveBytes || capacity <= liveBytes) return 0;
+  return usedBytes - liveBytes >=
+         (capacity - liveBytes) * GC_IDLE_MIN_OCCUPANCY;
+}
+
+const char* gcIdleActionName(GCIdleAction action) {
+  return actionNames[action];
+}
@@ -0,0 +1,60 @@
+#ifndef gcidle_h
+#define gcidle_h
+
+#include <stdint.h>
+
+#include "gclog.h"
+
+// How much of the room left free by the last collection has to be used up
+// before an idle notification collects. Below it, the next collection is far
+// enough off that it may well happen during a later idle period anyway.
+#define GC_IDLE_MIN_OCCUPANCY 0.5
+
+// The cost assumed for a kind of collection that hasn't run yet, in
+// nanoseconds per byte in use.
+#define GC_IDLE_DEFAULT_NS_PER_BYTE 1.0
+
+// What an idle notification did.
+typedef enum {
+  // Nothing, because the heap wasn't full enough or no collection would have
+  // finished before the deadline.
+  GC_IDLE_NONE,
+
+  // A cheaper collection that frees garbage without moving anything.
+  GC_IDLE_PARTIAL,
+
+  // A full collection.
+  GC_IDLE_FULL
+} GCIdleAction;
+
+// Learns how long each phase of each kind of collection takes from past
+// collections, so the pause of the next one can be predicted. Phases that
+// only visit live objects are costed per live byte, and phases that walk the
+// whole used heap per used byte.
+typedef struct {
+  // A moving average of each phase's nanoseconds per byte.
+  double nsPerByte[GC_KIND_COUNT][GC_PHASE_COUNT];
+
+  // How many collections of each kind have been recorded.
+  uint64_t collections[GC_KIND_COUNT];
+} GCPausePredictor;
+
+void gcPredictorInit(GCPausePredictor* predictor);
+
+// Learns from the timings in [event].
+void gcPredictorRecord(GCPausePredictor* predictor, const GCEvent* event);
+
+// Returns how many nanoseconds a collection of [kind] is expected to take with
+// [liveBytes] live out of [usedBytes] in use.
+uint64_t gcPredictPause(const GCPausePredictor* predictor, GCKind kind,
+                        uint64_t liveBytes, uint64_t usedBytes);
+
+// Returns non-zero if a heap of [capacity] bytes, with [usedBytes] in use and
+// [liveBytes] live after the last collection, is full enough for an idle
+// notification to collect.
+int gcIdleShouldCollect(uint64_t liveBytes, uint64_t usedBytes,
+                        uint64_t capacity);
+
+const char* gcIdleActionName(GCIdleAction action);
+
+#endif
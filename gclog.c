@@ -0,0 +1,208 @@
+#include <string.h>
+
+#include "gclog.h"
+
+#define GC_LOG_MAGIC "GCEV"
+#define GC_LOG_VERSION 2
+
+static const char* phaseNames[GC_PHASE_COUNT] = {
+  "mark", "calculate", "update", "compact", "sweep", "copy"
+};
+
+static const char* kindNames[] = {
+  "compact", "sweep", "mark-region", "semispace"
+};
+
+const char* gcPhaseName(GCPhase phase) {
+  return phaseNames[phase];
+}
+
+const char* gcKindName(GCKind kind) {
+  return kindNames[kind];
+}
+
+void gcLogInit(GCLog* log) {
+  log->head = 0;
+  log->tail = 0;
+  log->dropped = 0;
+  log->writing = 0;
+  log->stopWriting = 0;
+  log->file = NULL;
+  log->format = GC_LOG_JSON;
+}
+
+void gcLogPush(GCLog* log, const GCEvent* event) {
+  uint64_t head = log->head;
+  uint64_t tail = __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE);
+
+  if (head - tail == GC_LOG_CAPACITY) {
+    if (__atomic_load_n(&log->writing, __ATOMIC_ACQUIRE)) {
+      log->dropped++;
+      return;
+    }
+
+    // Nobody is reading, so make room by forgetting the oldest event.
+    __atomic_store_n(&log->tail, tail + 1, __ATOMIC_RELEASE);
+  }
+
+  log->events[head & (GC_LOG_CAPACITY - 1)] = *event;
+
+  // Publish the event only once it's completely written.
+  __atomic_store_n(&log->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int gcLogRecent(GCLog* log, int back, GCEvent* event) {
+  uint64_t head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+  uint64_t tail = __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE);
+  if ((uint64_t)back >= head - tail) return 0;
+
+  *event = log->events[(head - 1 - back) & (GC_LOG_CAPACITY - 1)];
+  return 1;
+}
+
+// Removes the oldest event from the log into [event]. Returns zero if the log
+// is empty.
+static int gcLogPop(GCLog* log, GCEvent* event) {
+  uint64_t tail = log->tail;
+  uint64_t head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+  if (tail == head) return 0;
+
+  *event = log->events[tail & (GC_LOG_CAPACITY - 1)];
+  __atomic_store_n(&log->tail, tail + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+static void writeU64(FILE* file, uint64_t value) {
+  uint8_t bytes[8];
+  for (int i = 0; i < 8; i++) bytes[i] = (uint8_t)(value >> (i * 8));
+  fwrite(bytes, 1, sizeof(bytes), file);
+}
+
+void gcLogWriteEvent(FILE* file, GCLogFormat format, const GCEvent* event) {
+  if (format == GC_LOG_BINARY) {
+    writeU64(file, event->sequence);
+    writeU64(file, event->kind);
+    writeU64(file, event->startNs);
+    writeU64(file, event->endNs);
+    for (int i = 0; i < GC_PHASE_COUNT; i++) {
+      writeU64(file, event->phaseStartNs[i]);
+      writeU64(file, event->phaseEndNs[i]);
+    }
+    writeU64(file, event->heapSizeBefore);
+    writeU64(file, event->heapSizeAfter);
+    writeU64(file, event->usedBytesBefore);
+    writeU64(file, event->liveBytes);
+    writeU64(file, event->freedBytes);
+    writeU64(file, event->objectsBefore);
+    writeU64(file, event->liveObjects);
+    writeU64(file, event->freedObjects);
+    writeU64(file, event->countersAvailable);
+    for (int i = 0; i < GC_PHASE_COUNT; i++) {
+      for (int counter = 0; counter < GC_COUNTER_COUNT; counter++) {
+        writeU64(file, event->phaseCounters[i][counter]);
+      }
+    }
+    return;
+  }
+
+  fprintf(file, "{\"seq\":%llu,\"kind\":\"%s\",\"start_ns\":%llu,"
+          "\"end_ns\":%llu,\"phases\":{",
+          (unsigned long long)event->sequence, gcKindName(event->kind),
+          (unsigned long long)event->startNs,
+          (unsigned long long)event->endNs);
+
+  int first = 1;
+  for (int i = 0; i < GC_PHASE_COUNT; i++) {
+    if (event->phaseStartNs[i] == 0) continue;
+    fprintf(file, "%s\"%s\":{\"start_ns\":%llu,\"end_ns\":%llu",
+            first ? "" : ",", gcPhaseName(i),
+            (unsigned long long)event->phaseStartNs[i],
+            (unsigned long long)event->phaseEndNs[i]);
+    first = 0;
+
+    for (int counter = 0; counter < GC_COUNTER_COUNT; counter++) {
+      if (!(event->countersAvailable & (1u << counter))) continue;
+      fprintf(file, ",\"%s\":%llu", gcCounterName(counter),
+              (unsigned long long)event->phaseCounters[i][counter]);
+    }
+
+    fprintf(file, "}");
+  }
+
+  fprintf(file, "},\"heap_size_before\":%llu,\"heap_size_after\":%llu,"
+          "\"used_bytes_before\":%llu,\"live_bytes\":%llu,"
+          "\"freed_bytes\":%llu,\"objects_before\":%llu,"
+          "\"live_objects\":%llu,\"freed_objects\":%llu}\n",
+          (unsigned long long)event->heapSizeBefore,
+          (unsigned long long)event->heapSizeAfter,
+          (unsigned long long)event->usedBytesBefore,
+          (unsigned long long)event->liveBytes,
+          (unsigned long long)event->freedBytes,
+          (unsigned long long)event->objectsBefore,
+          (unsigned long long)event->liveObjects,
+          (unsigned long long)event->freedObjects);
+}
+
+static void* runWriter(void* argument) {
+  GCLog* log = argument;
+  GCEvent event;
+
+  for (;;) {
+    int stopping = __atomic_load_n(&log->stopWriting, __ATOMIC_ACQUIRE);
+
+    int wrote = 0;
+    while (gcLogPop(log, &event)) {
+      gcLogWriteEvent(log->file, log->format, &event);
+      wrote = 1;
+    }
+
+    // Only stop once the log was found empty after being asked to, so that
+    // nothing added before then is lost.
+    if (stopping) break;
+
+    if (wrote) {
+      fflush(log->file);
+    } else {
+      struct timespec delay = {0, 1000000};
+      nanosleep(&delay, NULL);
+    }
+  }
+
+  return NULL;
+}
+
+int gcLogStartWriter(GCLog* log, const char* path, GCLogFormat format) {
+  if (log->writing) return 0;
+
+  log->file = fopen(path, format == GC_LOG_BINARY ? "wb" : "w");
+  if (log->file == NULL) return 0;
+
+  if (format == GC_LOG_BINARY) {
+    fwrite(GC_LOG_MAGIC, 1, strlen(GC_LOG_MAGIC), log->file);
+    writeU64(log->file, GC_LOG_VERSION);
+  }
+
+  log->format = format;
+  log->stopWriting = 0;
+  __atomic_store_n(&log->writing, 1, __ATOMIC_RELEASE);
+
+  if (pthread_create(&log->writer, NULL, runWriter, log) != 0) {
+    __atomic_store_n(&log->writing, 0, __ATOMIC_RELEASE);
+    fclose(log->file);
+    log->file = NULL;
+    return 0;
+  }
+
+  return 1;
+}
+
+void gcLogStopWriter(GCLog* log) {
+  if (!log->writing) return;
+
+  __atomic_store_n(&log->stopWriting, 1, __ATOMIC_RELEASE);
+  pthread_join(log->writer, NULL);
+
+  fclose(log->file);
+  log->file = NULL;
+  __atomic_store_n(&log->writing, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,167 @@
+#ifndef gclog_h
+#define gclog_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "gcperf.h"
+#include "gcprobes.h"
+
+// The number of events the in-memory log holds. Must be a power of two.
+#define GC_LOG_CAPACITY 256
+
+// The phases of a collection that get timed. Not every collector runs every
+// phase. The ones that didn't run have zero timestamps.
+typedef enum {
+  GC_PHASE_MARK,
+  GC_PHASE_CALCULATE,
+  GC_PHASE_UPDATE,
+  GC_PHASE_COMPACT,
+  GC_PHASE_SWEEP,
+  GC_PHASE_COPY,
+  GC_PHASE_COUNT
+} GCPhase;
+
+// What a collection ended up doing.
+typedef enum {
+  GC_KIND_COMPACT,
+  GC_KIND_SWEEP,
+  GC_KIND_MARK_REGION,
+  GC_KIND_SEMISPACE,
+  GC_KIND_COUNT
+} GCKind;
+
+// Everything recorded about a single collection. Timestamps are nanoseconds
+// from CLOCK_MONOTONIC. Byte and object counts include the large object space.
+typedef struct {
+  // The number of this collection, starting at 1.
+  uint64_t sequence;
+
+  GCKind kind;
+
+  uint64_t startNs;
+  uint64_t endNs;
+  uint64_t phaseStartNs[GC_PHASE_COUNT];
+  uint64_t phaseEndNs[GC_PHASE_COUNT];
+
+  // The bytes reserved for the heap.
+  uint64_t heapSizeBefore;
+  uint64_t heapSizeAfter;
+
+  uint64_t usedBytesBefore;
+  uint64_t liveBytes;
+  uint64_t freedBytes;
+
+  uint64_t objectsBefore;
+  uint64_t liveObjects;
+  uint64_t freedObjects;
+
+  // If hardware counters are attached, how much each one counted during each
+  // phase. [countersAvailable] has a bit for each GCCounter that was captured.
+  uint32_t countersAvailable;
+  uint64_t phaseCounters[GC_PHASE_COUNT][GC_COUNTER_COUNT];
+} GCEvent;
+
+// The formats the log writer can stream events in.
+typedef enum {
+  // One JSON object per line.
+  GC_LOG_JSON,
+
+  // A "GCEV" magic number and version, followed by each event as a fixed-size
+  // record of little-endian 64-bit fields, in the order they appear in
+  // GCEvent.
+  GC_LOG_BINARY
+} GCLogFormat;
+
+// A ring buffer of recent events. A single thread (the one collecting) adds
+// events, and at most one writer thread removes them, so the two only need to
+// agree on [head] and [tail].
+//
+// With no writer, the oldest event is overwritten when the ring is full, so it
+// always holds the latest ones. With a writer, events that don't fit are
+// dropped and counted instead, since the writer may be reading the oldest.
+typedef struct {
+  GCEvent events[GC_LOG_CAPACITY];
+
+  // The number of events ever added. The next one goes in slot
+  // [head % GC_LOG_CAPACITY].
+  uint64_t head;
+
+  // The number of events ever removed.
+  uint64_t tail;
+
+  uint64_t dropped;
+
+  // The asynchronous writer, if there is one.
+  int writing;
+  int stopWriting;
+  pthread_t writer;
+  FILE* file;
+  GCLogFormat format;
+} GCLog;
+
+// Returns the current time from a monotonic clock, in nanoseconds.
+static inline uint64_t gcNow() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// Records the start of [phase] in [event], and the starting values of
+// [counters] if there are any.
+static inline void gcPhaseBegin(GCEvent* event, GCPhase phase,
+                                GCPerfCounters* counters) {
+  GC_PROBE2(phase__start, event->sequence, phase);
+  if (counters) gcPerfRead(counters, event->phaseCounters[phase]);
+  event->phaseStartNs[phase] = gcNow();
+}
+
+// Records the end of [phase] in [event], and how much [counters] counted
+// during it.
+static inline void gcPhaseEnd(GCEvent* event, GCPhase phase,
+                              GCPerfCounters* counters) {
+  event->phaseEndNs[phase] = gcNow();
+  GC_PROBE2(phase__end, event->sequence, phase);
+  if (!counters) return;
+
+  uint64_t end[GC_COUNTER_COUNT];
+  gcPerfRead(counters, end);
+  for (int i = 0; i < GC_COUNTER_COUNT; i++) {
+    event->phaseCounters[phase][i] = end[i] - event->phaseCounters[phase][i];
+  }
+  event->countersAvailable = counters->available;
+}
+
+// Returns how long [phase] took in [event], in nanoseconds.
+static inline uint64_t gcPhaseNs(const GCEvent* event, GCPhase phase) {
+  return event->phaseEndNs[phase] - event->phaseStartNs[phase];
+}
+
+void gcLogInit(GCLog* log);
+
+// Adds [event] to the log. Never blocks.
+void gcLogPush(GCLog* log, const GCEvent* event);
+
+// Copies the event [back] events before the most recent one into [event].
+// Returns zero if the log doesn't hold that many. Only call this when there is
+// no writer running.
+int gcLogRecent(GCLog* log, int back, GCEvent* event);
+
+// Starts a thread that streams events from the log to the file at [path] as
+// they arrive. Returns zero if the file couldn't be opened.
+int gcLogStartWriter(GCLog* log, const char* path, GCLogFormat format);
+
+// Writes any events still in the log, then stops the writer thread and closes
+// its file.
+void gcLogStopWriter(GCLog* log);
+
+// Writes [event] to [file] in [format].
+void gcLogWriteEvent(FILE* file, GCLogFormat format, const GCEvent* event);
+
+// Returns the name of [phase] or [kind], as used in the JSON format.
+const char* gcPhaseName(GCPhase phase);
+const char* gcKindName(GCKind kind);
+
+#endif
@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "gcmmu.h"
+
+const uint64_t gcMMUWindowsNs[GC_MMU_WINDOWS] = {
+  1000000, 2000000, 5000000, 10000000, 20000000, 50000000,
+  100000000, 200000000, 500000000, 1000000000
+};
+
+// The largest of gcMMUWindowsNs.
+#define MAX_WINDOW_NS 1000000000
+
+void gcTimelineInit(GCTimeline* timeline, uint64_t startNs) {
+  timeline->startNs = startNs;
+  timeline->pauses = NULL;
+  timeline->count = 0;
+  timeline->capacity = 0;
+  timeline->pausedNs = malloc(sizeof(uint64_t));
+  timeline->pausedNs[0] = 0;
+  timeline->settled = 0;
+  for (int i = 0; i < GC_MMU_WINDOWS; i++) timeline->worstPausedNs[i] = 0;
+}
+
+void gcTimelineFree(GCTimeline* timeline) {
+  free(timeline->pauses);
+  free(timeline->pausedNs);
+}
+
+// Returns the index of the first pause that ends after [time].
+static size_t firstPauseEndingAfter(const GCTimeline* timeline,
+                                    uint64_t time) {
+  size_t low = 0;
+  size_t high = timeline->count;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (timeline->pauses[middle].endNs <= time) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
+// Returns how much of [from, to) was spent paused.
+static uint64_t pausedBetween(const GCTimeline* timeline, uint64_t from,
+                              uint64_t to) {
+  size_t first = firstPauseEndingAfter(timeline, from);
+  size_t last = firstPauseEndingAfter(timeline, to);
+
+  // Pauses [first, last) end inside the window. Count them whole, then trim
+  // the part of the first one that started before the window.
+  uint64_t paused = timeline->pausedNs[last] - timeline->pausedNs[first];
+  if (first < last && timeline->pauses[first].startNs < from) {
+    paused -= from - timeline->pauses[first].startNs;
+  }
+
+  // The pause after those may have started inside the window, but end after
+  // it.
+  if (last < timeline->count && timeline->pauses[last].startNs < to) {
+    uint64_t start = timeline->pauses[last].startNs;
+    paused += to - (start > from ? start : from);
+  }
+
+  return paused;
+}
+
+// Returns the most time paused in the window of [windowNs] that starts at
+// pause [index], or the one that ends at its end, keeping both between the
+// start of the timeline and [endNs].
+static uint64_t worstWindowAt(const GCTimeline* timeline, size_t index,
+                              uint64_t windowNs, uint64_t endNs) {
+  const GCPause* pause = &timeline->pauses[index];
+  uint64_t starts[2] = {
+    pause->startNs,
+    pause->endNs > windowNs ? pause->endNs - windowNs : 0
+  };
+
+  uint64_t worst = 0;
+  for (int i = 0; i < 2; i++) {
+    uint64_t start = starts[i];
+    if (start < timeline->startNs) start = timeline->startNs;
+    if (start > endNs - windowNs) start = endNs - windowNs;
+
+    uint64_t paused = pausedBetween(timeline, start, start + windowNs);
+    if (paused > worst) worst = paused;
+  }
+
+  return worst;
+}
+
+void gcTimelineRecord(GCTimeline* timeline, uint64_t startNs, uint64_t endNs) {
+  if (timeline->count == timeline->capacity) {
+    timeline->capacity = timeline->capacity == 0 ? 64 : timeline->capacity * 2;
+    timeline->pauses = realloc(timeline->pauses,
+                               timeline->capacity * sizeof(GCPause));
+    timeline->pausedNs = realloc(timeline->pausedNs,
+                                 (timeline->capacity + 1) * sizeof(uint64_t));
+  }
+
+  timeline->pauses[timeline->count].startNs = startNs;
+  timeline->pauses[timeline->count].endNs = endNs;
+  timeline->pausedNs[timeline->count + 1] =
+      timeline->pausedNs[timeline->count] + (endNs - startNs);
+  timeline->count++;
+
+  // A pause that ended a whole window before this one started is settled:
+  // every window starting or ending at it lies before this pause, and every
+  // pause those windows cover is still kept.
+  while (timeline->settled < timeline->count &&
+         timeline->pauses[timeline->settled].endNs + MAX_WINDOW_NS <=
+             startNs) {
+    for (int i = 0; i < GC_MMU_WINDOWS; i++) {
+      uint64_t paused = worstWindowAt(timeline, timeline->settled,
+                                      gcMMUWindowsNs[i], startNs);
+      if (paused > timeline->worstPausedNs[i]) {
+        timeline->worstPausedNs[i] = paused;
+      }
+    }
+    timeline->settled++;
+  }
+
+  // Settled pauses two windows back can't be reached by the windows of any
+  // pause still to be settled, so drop them. Only do it once they're half of
+  // what's kept, so the moves add up to a constant cost per pause.
+  size_t dropped = 0;
+  while (dropped < timeline->settled &&
+         timeline->pauses[dropped].endNs + 2 * MAX_WINDOW_NS <= startNs) {
+    dropped++;
+  }
+
+  if (dropped > 0 && dropped >= timeline->count / 2) {
+    timeline->count -= dropped;
+    timeline->settled -= dropped;
+    memmove(timeline->pauses, timeline->pauses + dropped,
+            timeline->count * sizeof(GCPause));
+    memmove(timeline->pausedNs, timeline->pausedNs + dropped,
+            (timeline->count + 1) * sizeof(uint64_t));
+  }
+}
+
+double gcTimelineMMU(const GCTimeline* timeline, uint64_t windowNs,
+                     uint64_t endNs) {
+  uint64_t length = endNs - timeline->startNs;
+  if (length == 0) return 1.0;
+  if (windowNs > length) windowNs = length;
+
+  // The worst window always starts at the beginning of a pause or ends at the
+  // end of one, so those are the only positions that need checking. The
+  // settled ones have already been checked for the usual window sizes.
+  uint64_t worst = 0;
+  size_t first = 0;
+  for (int i = 0; i < GC_MMU_WINDOWS; i++) {
+    if (gcMMUWindowsNs[i] != windowNs) continue;
+    worst = timeline->worstPausedNs[i];
+    first = timeline->settled;
+  }
+
+  for (size_t i = first; i < timeline->count; i++) {
+    uint64_t paused = worstWindowAt(timeline, i, windowNs, endNs);
+    if (paused > worst) worst = paused;
+  }
+
+  return (double)(windowNs - worst) / windowNs;
+}
+
+void gcWriteReport(FILE* file, const GCTimeline* timeline,
+                   const GCStats* stats, uint64_t endNs) {
+  static const double percentiles[] = {50, 90, 99, 99.9};
+  static const char* names[] = {"p50", "p90", "p99", "p999"};
+
+  fprintf(file, "{\"elapsed_ns\":%llu,\"collections\":%llu,"
+          "\"total_pause_ns\":%llu,\"pause_ns\":{",
+          (unsigned long long)(endNs - timeline->startNs),
+          (unsigned long long)stats->collections,
+          (unsigned long long)stats->totalPauseNs);
+
+  for (int i = 0; i < 4; i++) {
+    // The histogram only knows which bucket a pause fell in, so don't report
+    // more than the longest one actually was.
+    uint64_t pause = gcHistogramPercentile(&stats->pauses, percentiles[i]);
+    if (pause > stats->maxPauseNs) pause = stats->maxPauseNs;
+    fprintf(file, "\"%s\":%llu,", names[i], (unsigned long long)pause);
+  }
+
+  fprintf(file, "\"max\":%llu},\"mmu\":[",
+          (unsigned long long)stats->maxPauseNs);
+
+  for (int i = 0; i < GC_MMU_WINDOWS; i++) {
+    fprintf(file, "%s{\"window_ns\":%llu,\"mmu\":%.4f}", i > 0 ? "," : "",
+            (unsigned long long)gcMMUWindowsNs[i],
+            gcTimelineMMU(timeline, gcMMUWindowsNs[i], endNs));
+  }
+
+  fprintf(file, "]}\n");
+}
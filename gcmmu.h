@@ -0,0 +1,68 @@
+#ifndef gcmmu_h
+#define gcmmu_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "gcstats.h"
+
+// The window sizes that minimum mutator utilization is reported for, from 1ms
+// to 1s.
+#define GC_MMU_WINDOWS 10
+extern const uint64_t gcMMUWindowsNs[GC_MMU_WINDOWS];
+
+// A single collection pause, in CLOCK_MONOTONIC nanoseconds.
+typedef struct {
+  uint64_t startNs;
+  uint64_t endNs;
+} GCPause;
+
+// The wall-clock timeline of pauses since [startNs]. Pauses are recorded in
+// order and never overlap.
+//
+// So that a long-running process doesn't keep every pause forever, only the
+// ones from about the last two of the largest MMU windows are kept. Before a
+// pause is dropped, the worst windows of each size in gcMMUWindowsNs that
+// start or end at it are folded into [worstPausedNs].
+typedef struct {
+  uint64_t startNs;
+
+  GCPause* pauses;
+  size_t count;
+  size_t capacity;
+
+  // [pausedNs[i]] is the total length of every pause recorded before
+  // [pauses[i]], including dropped ones, so the time paused between any two
+  // of them can be found without summing.
+  uint64_t* pausedNs;
+
+  // The first [settled] pauses are far enough in the past that no window
+  // starting or ending at them can reach a pause yet to be recorded. Their
+  // windows are counted in [worstPausedNs].
+  size_t settled;
+
+  // The most time paused in any window of each of the gcMMUWindowsNs sizes
+  // that starts or ends at a settled pause.
+  uint64_t worstPausedNs[GC_MMU_WINDOWS];
+} GCTimeline;
+
+void gcTimelineInit(GCTimeline* timeline, uint64_t startNs);
+void gcTimelineFree(GCTimeline* timeline);
+
+void gcTimelineRecord(GCTimeline* timeline, uint64_t startNs, uint64_t endNs);
+
+// Returns the minimum mutator utilization for windows of [windowNs]: the
+// smallest fraction of any window of that length, between the start of the
+// timeline and [endNs], that wasn't spent paused. If the timeline is shorter
+// than the window, the whole timeline is used as the window. Window sizes
+// that aren't in gcMMUWindowsNs only see the pauses that are still kept.
+double gcTimelineMMU(const GCTimeline* timeline, uint64_t windowNs,
+                     uint64_t endNs);
+
+// Writes a JSON report of the pause distribution in [stats] and the MMU curve
+// of [timeline] up to [endNs] to [file].
+void gcWriteReport(FILE* file, const GCTimeline* timeline,
+                   const GCStats* stats, uint64_t endNs);
+
+#endif
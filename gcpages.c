@@ -0,0 +1,88 @@
+// mremap() is Linux-only.
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "gcpages.h"
+
+// Returns [size] rounded up to whole huge pages.
+static size_t hugeRound(size_t size) {
+  if (size == 0) size = 1;
+  return (size + GC_HUGE_PAGE_SIZE - 1) / GC_HUGE_PAGE_SIZE *
+         GC_HUGE_PAGE_SIZE;
+}
+
+// Asks for huge pages in [size] bytes at [pages]. The kernel only uses them
+// for whole aligned 2MB ranges, which is why the mappings are aligned.
+static void adviseHuge(void* pages, size_t size) {
+#ifdef MADV_HUGEPAGE
+  madvise(pages, size, MADV_HUGEPAGE);
+#endif
+}
+
+void* gcPagesMap(size_t size) {
+  size_t mappedSize = hugeRound(size);
+
+  // mmap() only promises page alignment, so map an extra huge page and trim
+  // whatever falls outside the aligned range.
+  size_t reserved = mappedSize + GC_HUGE_PAGE_SIZE;
+  char* start = mmap(NULL, reserved, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (start == MAP_FAILED) return NULL;
+
+  char* aligned = (char*)(((uintptr_t)start + GC_HUGE_PAGE_SIZE - 1) &
+                          ~(uintptr_t)(GC_HUGE_PAGE_SIZE - 1));
+  if (aligned > start) munmap(start, aligned - start);
+  char* end = start + reserved;
+  if (end > aligned + mappedSize) {
+    munmap(aligned + mappedSize, end - (aligned + mappedSize));
+  }
+
+  adviseHuge(aligned, mappedSize);
+  return aligned;
+}
+
+void* gcPagesResize(void* pages, size_t oldSize, size_t newSize) {
+  size_t oldMapped = hugeRound(oldSize);
+  size_t newMapped = hugeRound(newSize);
+  if (newMapped == oldMapped) return pages;
+
+  if (newMapped < oldMapped) {
+    munmap((char*)pages + newMapped, oldMapped - newMapped);
+    return pages;
+  }
+
+  // Without MREMAP_MAYMOVE this only succeeds if the pages right after the
+  // mapping are free, so the address and its alignment are kept.
+  if (mremap(pages, oldMapped, newMapped, 0) != MAP_FAILED) {
+    adviseHuge(pages, newMapped);
+    return pages;
+  }
+
+  void* moved = gcPagesMap(newSize);
+  if (!moved) return NULL;
+  memcpy(moved, pages, oldSize);
+  munmap(pages, oldMapped);
+  return moved;
+}
+
+void gcPagesUnmap(void* pages, size_t size) {
+  munmap(pages, hugeRound(size));
+}
+
+uint64_t gcPagesHugeBytes() {
+  FILE* file = fopen("/proc/self/smaps_rollup", "r");
+  if (!file) return 0;
+
+  char line[256];
+  unsigned long long kilobytes = 0;
+  int found = 0;
+  while (!found && fgets(line, sizeof(line), file)) {
+    found = sscanf(line, "AnonHugePages: %llu kB", &kilobytes) == 1;
+  }
+
+  fclose(file);
+  return (uint64_t)kilobytes * 1024;
+}
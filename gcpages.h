@@ -0,0 +1,33 @@
+#ifndef gcpages_h
+#define gcpages_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The size of a transparent huge page on x86-64 and most arm64 kernels.
+#define GC_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Maps [size] bytes of zeroed memory, rounded up to whole huge pages, at an
+// address that's a multiple of GC_HUGE_PAGE_SIZE, and asks the kernel to back
+// it with transparent huge pages. Returns NULL if it can't be mapped.
+//
+// The request is only a hint. If the kernel has transparent huge pages turned
+// off, or can't find a free 2MB frame, the memory is still there and usable,
+// just in ordinary pages.
+void* gcPagesMap(size_t size);
+
+// Resizes a mapping from gcPagesMap() of [oldSize] bytes to [newSize], like
+// realloc(), keeping the first [newSize] or [oldSize] bytes, whichever is
+// less. Shrinking and growing in place keep the address. Otherwise the
+// contents are copied to a new aligned mapping. Returns NULL, leaving the old
+// mapping alone, if it can't be resized.
+void* gcPagesResize(void* pages, size_t oldSize, size_t newSize);
+
+// Unmaps a mapping from gcPagesMap() of [size] bytes.
+void gcPagesUnmap(void* pages, size_t size);
+
+// Returns how many bytes of the calling process's anonymous memory are backed
+// by transparent huge pages, or zero if the kernel doesn't say.
+uint64_t gcPagesHugeBytes();
+
+#endif
@@ -0,0 +1,129 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "gcperf.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+static const char* counterNames[GC_COUNTER_COUNT] = {
+  "cycles", "instructions", "llc_misses", "dtlb_misses"
+};
+
+const char* gcCounterName(GCCounter counter) {
+  return counterNames[counter];
+}
+
+#ifdef __linux__
+
+static int openCounter(uint32_t type, uint64_t config, int group) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+
+  // Only count the collector itself, which also keeps this usable at the
+  // default perf_event_paranoid level.
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  // The leader starts disabled so the whole group is enabled at once.
+  attr.disabled = group == -1;
+
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+uint32_t gcPerfOpen(GCPerfCounters* counters) {
+  static const struct {
+    uint32_t type;
+    uint64_t config;
+  } events[GC_COUNTER_COUNT] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                         (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)}
+  };
+
+  counters->leader = -1;
+  counters->available = 0;
+
+  for (int i = 0; i < GC_COUNTER_COUNT; i++) {
+    counters->fds[i] = openCounter(events[i].type, events[i].config,
+                                   counters->leader);
+    counters->ids[i] = 0;
+    if (counters->fds[i] == -1) continue;
+
+    if (ioctl(counters->fds[i], PERF_EVENT_IOC_ID, &counters->ids[i]) == -1) {
+      close(counters->fds[i]);
+      counters->fds[i] = -1;
+      continue;
+    }
+
+    if (counters->leader == -1) counters->leader = counters->fds[i];
+    counters->available |= 1u << i;
+  }
+
+  if (counters->leader != -1) {
+    ioctl(counters->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counters->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+
+  return counters->available;
+}
+
+void gcPerfClose(GCPerfCounters* counters) {
+  for (int i = 0; i < GC_COUNTER_COUNT; i++) {
+    if (counters->fds[i] != -1) close(counters->fds[i]);
+    counters->fds[i] = -1;
+  }
+
+  counters->leader = -1;
+  counters->available = 0;
+}
+
+void gcPerfRead(GCPerfCounters* counters, uint64_t values[GC_COUNTER_COUNT]) {
+  memset(values, 0, GC_COUNTER_COUNT * sizeof(uint64_t));
+  if (counters->leader == -1) return;
+
+  // A group read returns the number of counters, then a value and ID for
+  // each.
+  uint64_t buffer[1 + 2 * GC_COUNTER_COUNT];
+  if (read(counters->leader, buffer, sizeof(buffer)) <= 0) return;
+
+  for (uint64_t i = 0; i < buffer[0] && i < GC_COUNTER_COUNT; i++) {
+    uint64_t value = buffer[1 + 2 * i];
+    uint64_t id = buffer[2 + 2 * i];
+    for (int counter = 0; counter < GC_COUNTER_COUNT; counter++) {
+      if ((counters->available & (1u << counter)) &&
+          counters->ids[counter] == id) {
+        values[counter] = value;
+      }
+    }
+  }
+}
+
+#else
+
+// Without perf events, nothing is ever available.
+uint32_t gcPerfOpen(GCPerfCounters* counters) {
+  for (int i = 0; i < GC_COUNTER_COUNT; i++) counters->fds[i] = -1;
+  counters->leader = -1;
+  counters->available = 0;
+  return 0;
+}
+
+void gcPerfClose(GCPerfCounters* counters) {
+}
+
+void gcPerfRead(GCPerfCounters* counters, uint64_t values[GC_COUNTER_COUNT]) {
+  memset(values, 0, GC_COUNTER_COUNT * sizeof(uint64_t));
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef gcperf_h
+#define gcperf_h
+
+#include <stdint.h>
+
+// The hardware counters that can be captured around each collection phase.
+typedef enum {
+  GC_COUNTER_CYCLES,
+  GC_COUNTER_INSTRUCTIONS,
+  GC_COUNTER_LLC_MISSES,
+  GC_COUNTER_DTLB_MISSES,
+  GC_COUNTER_COUNT
+} GCCounter;
+
+// A set of perf_event_open() counters for the calling thread. Counters the
+// kernel or hardware don't support are left closed, and read as zero.
+typedef struct {
+  // The file descriptor for each counter, or -1 if it isn't available.
+  int fds[GC_COUNTER_COUNT];
+
+  // The kernel's ID for each counter, used to pick values out of a group read.
+  uint64_t ids[GC_COUNTER_COUNT];
+
+  // The counter all of the others are grouped under, so they can be read
+  // together with a single system call, or -1 if none are open.
+  int leader;
+
+  // A bit for each GCCounter that is available.
+  uint32_t available;
+} GCPerfCounters;
+
+// Opens whichever counters are available. Returns the bitmask of available
+// counters, which is zero if perf events aren't supported or allowed at all.
+uint32_t gcPerfOpen(GCPerfCounters* counters);
+
+void gcPerfClose(GCPerfCounters* counters);
+
+// Reads the current value of every counter into [values]. Unavailable
+// counters read as zero.
+void gcPerfRead(GCPerfCounters* counters, uint64_t values[GC_COUNTER_COUNT]);
+
+// Returns the name of [counter], as used in the JSON event log.
+const char* gcCounterName(GCCounter counter);
+
+#endif
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gcpressure.h"
+
+static const char* levelNames[] = { "low", "normal", "moderate", "high" };
+
+// Writes [dir] followed by [name] to [path]. Returns zero if it doesn't fit,
+// since a truncated path would name some other file.
+static int joinPath(char* path, size_t size, const char* dir,
+                    const char* name) {
+  int length = snprintf(path, size, "%s%s", dir, name);
+  return length >= 0 && (size_t)length < size;
+}
+
+// Reads the cgroup v2 path of the calling process from /proc/self/cgroup into
+// [path]. Returns zero if it isn't in a v2 hierarchy, and -1 if the path is
+// too long.
+static int findCgroup(char* path, size_t size) {
+  FILE* file = fopen("/proc/self/cgroup", "r");
+  if (!file) return 0;
+
+  // The v2 hierarchy is the one with ID 0 and no controllers.
+  char line[GC_PRESSURE_PATH_MAX];
+  int found = 0;
+  while (!found && fgets(line, sizeof(line), file)) {
+    if (strncmp(line, "0::", 3) != 0) continue;
+
+    // A line without a newline didn't fit in [line].
+    size_t end = strcspn(line, "\n");
+    found = line[end] == '\n' || feof(file) ? 1 : -1;
+    line[end] = '\0';
+    if (found == 1 &&
+        !joinPath(path, size, GC_PRESSURE_CGROUP_ROOT, line + 3)) {
+      found = -1;
+    }
+  }
+
+  fclose(file);
+  return found;
+}
+
+// Reads the number in the file at [path] into [value]. A file that says "max"
+// reads as zero. Returns zero if it can't be read.
+static int readNumber(const char* path, uint64_t* value) {
+  FILE* file = fopen(path, "r");
+  if (!file) return 0;
+
+  char text[64];
+  int ok = fgets(text, sizeof(text), file) != NULL;
+  fclose(file);
+  if (!ok) return 0;
+
+  unsigned long long number;
+  if (strncmp(text, "max", 3) == 0) *value = 0;
+  else if (sscanf(text, "%llu", &number) == 1) *value = number;
+  else return 0;
+  return 1;
+}
+
+// Reads the "some avg10" percentage from the PSI file at [path] into
+// [stall]. Returns zero if it can't be read.
+static int readStall(const char* path, double* stall) {
+  FILE* file = fopen(path, "r");
+  if (!file) return 0;
+
+  char line[256];
+  int found = 0;
+  while (!found && fgets(line, sizeof(line), file)) {
+    found = sscanf(line, "some avg10=%lf", stall) == 1;
+  }
+
+  fclose(file);
+  return found;
+}
+
+int gcPressureInit(GCPressure* pressure, const char* cgroupDir,
+                   const char* stallPath) {
+  memset(pressure, 0, sizeof(GCPressure));
+  pressure->intervalNs = GC_PRESSURE_INTERVAL_NS;
+
+  // Paths too long to hold would be read truncated, and a limit that can't
+  // be read counts as no limit, so refuse them instead.
+  char dir[GC_PRESSURE_PATH_MAX] = "";
+  if (cgroupDir) {
+    if (!joinPath(dir, sizeof(dir), cgroupDir, "")) return 0;
+  } else if (findCgroup(dir, sizeof(dir)) < 0) {
+    return 0;
+  }
+
+  if (dir[0] != '\0' &&
+      (!joinPath(pressure->maxPath, GC_PRESSURE_PATH_MAX, dir,
+                 "/memory.max") ||
+       !joinPath(pressure->currentPath, GC_PRESSURE_PATH_MAX, dir,
+                 "/memory.current"))) {
+    return 0;
+  }
+
+  if (stallPath) {
+    if (!joinPath(pressure->stallPath, GC_PRESSURE_PATH_MAX, stallPath, "")) {
+      return 0;
+    }
+  } else {
+    if (dir[0] == '\0' ||
+        !joinPath(pressure->stallPath, GC_PRESSURE_PATH_MAX, dir,
+                  "/memory.pressure") ||
+        access(pressure->stallPath, R_OK) != 0) {
+      joinPath(pressure->stallPath, GC_PRESSURE_PATH_MAX,
+               GC_PRESSURE_SYSTEM_PSI, "");
+    }
+  }
+
+  uint64_t number;
+  double stall;
+  return readNumber(pressure->maxPath, &number) ||
+         readNumber(pressure->currentPath, &number) ||
+         readStall(pressure->stallPath, &stall);
+}
+
+void gcPressureRead(GCPressure* pressure, uint64_t nowNs) {
+  if (pressure->readNs != 0 &&
+      nowNs - pressure->readNs < pressure->intervalNs) {
+    return;
+  }
+  pressure->readNs = nowNs;
+
+  if (!readNumber(pressure->maxPath, &pressure->limit)) pressure->limit = 0;
+  if (!readNumber(pressure->currentPath, &pressure->current)) {
+    pressure->current = 0;
+  }
+  if (!readStall(pressure->stallPath, &pressure->stall)) pressure->stall = 0;
+}
+
+GCPressureLevel gcPressureLevel(const GCPressure* pressure) {
+  double usage = pressure->limit == 0 ? 0 :
+      (double)pressure->current / pressure->limit;
+
+  if (pressure->stall >= GC_PRESSURE_STALL_HIGH ||
+      usage >= GC_PRESSURE_USAGE_HIGH) {
+    return GC_PRESSURE_HIGH;
+  }
+  if (pressure->stall >= GC_PRESSURE_STALL_MODERATE ||
+      usage >= GC_PRESSURE_USAGE_MODERATE) {
+    return GC_PRESSURE_MODERATE;
+  }
+
+  // Without a limit, there's no telling how much memory is left.
+  if (pressure->limit != 0 && pressure->stall == 0 &&
+      usage < GC_PRESSURE_USAGE_LOW) {
+    return GC_PRESSURE_LOW;
+  }
+  return GC_PRESSURE_NORMAL;
+}
+
+double gcPressureHeadroom(const GCPressure* pressure, double headroom) {
+  switch (gcPressureLevel(pressure)) {
+    case GC_PRESSURE_LOW: return 1 + (headroom - 1) * 2;
+    case GC_PRESSURE_MODERATE: return 1 + (headroom - 1) / 2;
+    case GC_PRESSURE_HIGH: return 1 + (headroom - 1) / 4;
+    default: return headroom;
+  }
+}
+
+uint64_t gcPressureRoom(const GCPressure* pressure) {
+  if (pressure->limit == 0) return UINT64_MAX;
+  if (pressure->current >= pressure->limit) return 0;
+  return pressure->limit - pressure->current;
+}
+
+const char* gcPressureLevelName(GCPressureLevel level) {
+  return levelNames[level];
+}
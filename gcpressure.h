@@ -0,0 +1,83 @@
+#ifndef gcpressure_h
+#define gcpressure_h
+
+#include <stdint.h>
+
+// Where the process's cgroup v2 hierarchy is mounted, and where the kernel
+// reports memory pressure for the whole system when a cgroup doesn't.
+#define GC_PRESSURE_CGROUP_ROOT "/sys/fs/cgroup"
+#define GC_PRESSURE_SYSTEM_PSI "/proc/pressure/memory"
+
+#define GC_PRESSURE_PATH_MAX 512
+
+// How long a reading is reused before the files are read again.
+#define GC_PRESSURE_INTERVAL_NS 100000000
+
+// The percentage of the last ten seconds that some task spent stalled on
+// memory, from PSI, at which pressure counts as moderate or high.
+#define GC_PRESSURE_STALL_MODERATE 1.0
+#define GC_PRESSURE_STALL_HIGH 10.0
+
+// The fraction of memory.max in use below which memory is ample, and above
+// which pressure counts as moderate or high.
+#define GC_PRESSURE_USAGE_LOW 0.5
+#define GC_PRESSURE_USAGE_MODERATE 0.75
+#define GC_PRESSURE_USAGE_HIGH 0.9
+
+typedef enum {
+  // There's a limit, it's far off, and nothing is stalling.
+  GC_PRESSURE_LOW,
+
+  // Nothing to go on, or nothing worth reacting to.
+  GC_PRESSURE_NORMAL,
+
+  GC_PRESSURE_MODERATE,
+  GC_PRESSURE_HIGH
+} GCPressureLevel;
+
+// Reads how close the process's cgroup is to its memory limit, and how much
+// tasks are stalling on memory, from cgroup v2's memory.max and memory.current
+// and from a PSI file like memory.pressure. Any of them may be missing, in
+// which case it's as if there were no limit or no stalls.
+typedef struct {
+  char maxPath[GC_PRESSURE_PATH_MAX];
+  char currentPath[GC_PRESSURE_PATH_MAX];
+  char stallPath[GC_PRESSURE_PATH_MAX];
+
+  // How long a reading is reused for. GC_PRESSURE_INTERVAL_NS by default.
+  uint64_t intervalNs;
+
+  // The latest reading, taken at [readNs], or zero if there hasn't been one.
+  // [limit] is zero if there's no limit.
+  uint64_t readNs;
+  uint64_t limit;
+  uint64_t current;
+  double stall;
+} GCPressure;
+
+// Finds the files to read in [cgroupDir], or the process's own cgroup if it's
+// NULL. Stalls are read from [stallPath], or else from the cgroup's
+// memory.pressure if there is one, or else GC_PRESSURE_SYSTEM_PSI. Returns
+// zero if none of the files can be read, or if any of their paths are longer
+// than GC_PRESSURE_PATH_MAX.
+int gcPressureInit(GCPressure* pressure, const char* cgroupDir,
+                   const char* stallPath);
+
+// Reads the files again if the last reading is older than [intervalNs] at
+// [nowNs].
+void gcPressureRead(GCPressure* pressure, uint64_t nowNs);
+
+GCPressureLevel gcPressureLevel(const GCPressure* pressure);
+
+// Returns [headroom], a multiple of the live bytes to size a heap to, adjusted
+// for the latest reading: doubled above 1 when memory is ample, and cut to a
+// half or a quarter above 1 under moderate or high pressure.
+double gcPressureHeadroom(const GCPressure* pressure, double headroom);
+
+// Returns how many more bytes the cgroup can use before hitting its limit, or
+// UINT64_MAX if there's no limit.
+uint64_t gcPressureRoom(const GCPressure* pressure);
+
+const char* gcPressureLevelName(GCPressureLevel level);
+
+#endif
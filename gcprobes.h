@@ -0,0 +1,82 @@
+#ifndef gcprobes_h
+#define gcprobes_h
+
+#include <stdint.h>
+
+// Static tracepoints in the format SystemTap and bpftrace read, under the
+// provider "lisp2". For example:
+//
+//     bpftrace -e 'usdt:./lisp2:lisp2:gc__end { @pause = hist(arg3); }'
+//
+// Each probe is a single nop in the code, plus a note in a section that is
+// never loaded, describing where the nop is and where to find its arguments.
+// A tracer attaching to the process patches the nop into a breakpoint. Until
+// then, the only cost is making sure the arguments are somewhere the note can
+// point to, and they're all values the surrounding code has at hand anyway.
+//
+// This writes the notes itself in the same layout as <sys/sdt.h>, so it
+// doesn't need SystemTap's headers to build. Every argument is passed as a
+// 64-bit integer. Define GC_NO_PROBES to compile the probes out entirely.
+//
+// The probes are:
+//
+//     gc__start(sequence, collector, usedBytes)
+//     gc__end(sequence, liveBytes, freedBytes, pauseNs)
+//     phase__start(sequence, phase)
+//     phase__end(sequence, phase)
+//     alloc__slow(type, size)
+//     heap__resize(oldSize, newSize)
+
+#if !defined(GC_NO_PROBES) && (defined(__x86_64__) || defined(__aarch64__))
+
+// The note for a probe named [name] with the argument descriptions in
+// [args], each one "8@" followed by an operand.
+#define GC_PROBE_NOTE_(name, args)                                           \
+  "990: nop\n"                                                               \
+  ".pushsection .note.stapsdt,\"?\",\"note\"\n"                              \
+  ".balign 4\n"                                                              \
+  ".4byte 992f-991f, 994f-993f, 3\n"                                         \
+  "991: .asciz \"stapsdt\"\n"                                                \
+  "992: .balign 4\n"                                                         \
+  "993: .8byte 990b\n"                                                       \
+  ".8byte _.stapsdt.base\n"                                                  \
+  ".8byte 0\n"                                                               \
+  ".asciz \"lisp2\"\n"                                                       \
+  ".asciz \"" #name "\"\n"                                                   \
+  ".asciz \"" args "\"\n"                                                    \
+  "994: .balign 4\n"                                                         \
+  ".popsection\n"                                                            \
+  ".ifndef _.stapsdt.base\n"                                                 \
+  ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"    \
+  ".weak _.stapsdt.base\n"                                                   \
+  ".hidden _.stapsdt.base\n"                                                 \
+  "_.stapsdt.base: .space 1\n"                                               \
+  ".size _.stapsdt.base, 1\n"                                                \
+  ".popsection\n"                                                            \
+  ".endif\n"
+
+#define GC_PROBE_ARG_(value) "nor"((uint64_t)(value))
+
+#define GC_PROBE2(name, a, b)                                                \
+  __asm__ __volatile__(GC_PROBE_NOTE_(name, "8@%0 8@%1")                     \
+                       :: GC_PROBE_ARG_(a), GC_PROBE_ARG_(b))
+
+#define GC_PROBE3(name, a, b, c)                                             \
+  __asm__ __volatile__(GC_PROBE_NOTE_(name, "8@%0 8@%1 8@%2")                \
+                       :: GC_PROBE_ARG_(a), GC_PROBE_ARG_(b),                \
+                          GC_PROBE_ARG_(c))
+
+#define GC_PROBE4(name, a, b, c, d)                                          \
+  __asm__ __volatile__(GC_PROBE_NOTE_(name, "8@%0 8@%1 8@%2 8@%3")           \
+                       :: GC_PROBE_ARG_(a), GC_PROBE_ARG_(b),                \
+                          GC_PROBE_ARG_(c), GC_PROBE_ARG_(d))
+
+#else
+
+#define GC_PROBE2(name, a, b) do {} while (0)
+#define GC_PROBE3(name, a, b, c) do {} while (0)
+#define GC_PROBE4(name, a, b, c, d) do {} while (0)
+
+#endif
+
+#endif
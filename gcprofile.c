@@ -0,0 +1,196 @@
+#include <execinfo.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gcprofile.h"
+
+// The frames for gcProfileSample() and the allocator that called it, which are
+// left off of captured stacks.
+#define PROFILER_FRAMES 2
+
+// Returns a random number between 0 and 1, exclusive, from a xorshift
+// generator.
+static double nextRandom(GCProfile* profile) {
+  uint64_t x = profile->random;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  profile->random = x;
+  return ((x >> 11) + 0.5) / (double)(1ull << 53);
+}
+
+// Picks how many bytes to wait before the next sample. Drawing the gap from an
+// exponential distribution makes every byte equally likely to be sampled.
+static void scheduleSample(GCProfile* profile) {
+  profile->bytesUntilSample =
+      (int64_t)(-log(nextRandom(profile)) * profile->interval);
+}
+
+void gcProfileInit(GCProfile* profile, size_t interval, int captureStacks) {
+  profile->interval = interval;
+  profile->captureStacks = captureStacks;
+  profile->currentSite = 0;
+  profile->random = 0x9e3779b97f4a7c15ull;
+
+  profile->sites = NULL;
+  profile->siteCount = 0;
+  profile->siteCapacity = 0;
+  profile->siteTableSize = 64;
+  profile->siteTable = calloc(profile->siteTableSize, sizeof(size_t));
+
+  profile->pending = NULL;
+  profile->pendingCount = 0;
+  profile->pendingCapacity = 0;
+
+  scheduleSample(profile);
+}
+
+void gcProfileFree(GCProfile* profile) {
+  free(profile->sites);
+  free(profile->siteTable);
+  free(profile->pending);
+}
+
+static uint64_t hashSite(uint64_t id, void** frames, int depth) {
+  // FNV-1a over the ID and frame addresses.
+  uint64_t hash = 14695981039346656037ull;
+  hash = (hash ^ id) * 1099511628211ull;
+  for (int i = 0; i < depth; i++) {
+    hash = (hash ^ (uint64_t)(uintptr_t)frames[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+// Rebuilds the site table at twice the size.
+static void growSiteTable(GCProfile* profile) {
+  free(profile->siteTable);
+  profile->siteTableSize *= 2;
+  profile->siteTable = calloc(profile->siteTableSize, sizeof(size_t));
+
+  for (size_t i = 0; i < profile->siteCount; i++) {
+    GCProfileSite* site = &profile->sites[i];
+    size_t slot = hashSite(site->id, site->frames, site->depth) &
+                  (profile->siteTableSize - 1);
+    while (profile->siteTable[slot]) {
+      slot = (slot + 1) & (profile->siteTableSize - 1);
+    }
+    profile->siteTable[slot] = i + 1;
+  }
+}
+
+// Returns the index of the site for [id] and [frames], adding it if needed.
+static size_t findSite(GCProfile* profile, uint64_t id, void** frames,
+                       int depth) {
+  size_t slot = hashSite(id, frames, depth) & (profile->siteTableSize - 1);
+  while (profile->siteTable[slot]) {
+    size_t index = profile->siteTable[slot] - 1;
+    GCProfileSite* site = &profile->sites[index];
+    if (site->id == id && site->depth == depth &&
+        memcmp(site->frames, frames, depth * sizeof(void*)) == 0) {
+      return index;
+    }
+    slot = (slot + 1) & (profile->siteTableSize - 1);
+  }
+
+  if (profile->siteCount == profile->siteCapacity) {
+    profile->siteCapacity = profile->siteCapacity == 0 ?
+        16 : profile->siteCapacity * 2;
+    profile->sites = realloc(profile->sites,
+                             profile->siteCapacity * sizeof(GCProfileSite));
+  }
+
+  size_t index = profile->siteCount++;
+  GCProfileSite* site = &profile->sites[index];
+  memset(site, 0, sizeof(GCProfileSite));
+  site->id = id;
+  site->depth = depth;
+  memcpy(site->frames, frames, depth * sizeof(void*));
+  profile->siteTable[slot] = index + 1;
+
+  // Keep the table at most half full.
+  if (profile->siteCount * 2 > profile->siteTableSize) growSiteTable(profile);
+
+  return index;
+}
+
+void gcProfileSample(GCProfile* profile, void* object, size_t size) {
+  scheduleSample(profile);
+
+  void* frames[GC_PROFILE_MAX_FRAMES + PROFILER_FRAMES];
+  int depth = 0;
+  if (profile->captureStacks) {
+    depth = backtrace(frames, GC_PROFILE_MAX_FRAMES + PROFILER_FRAMES);
+    depth = depth > PROFILER_FRAMES ? depth - PROFILER_FRAMES : 0;
+  }
+
+  size_t site = findSite(profile, profile->currentSite,
+                         frames + PROFILER_FRAMES, depth);
+
+  // An allocation of [size] bytes is sampled with probability
+  // 1 - e^(-size/interval), so scale by the inverse to estimate the total.
+  double scale = 1.0 / (1.0 - exp(-(double)size / profile->interval));
+  profile->sites[site].allocatedObjects += scale;
+  profile->sites[site].allocatedBytes += scale * size;
+
+  if (profile->pendingCount == profile->pendingCapacity) {
+    profile->pendingCapacity = profile->pendingCapacity == 0 ?
+        64 : profile->pendingCapacity * 2;
+    profile->pending = realloc(profile->pending,
+        profile->pendingCapacity * sizeof(GCProfileSample));
+  }
+
+  GCProfileSample* sample = &profile->pending[profile->pendingCount++];
+  sample->object = object;
+  sample->site = site;
+  sample->objects = scale;
+  sample->bytes = scale * size;
+}
+
+void gcProfileCollect(GCProfile* profile, int (*survived)(void* object)) {
+  for (size_t i = 0; i < profile->pendingCount; i++) {
+    GCProfileSample* sample = &profile->pending[i];
+    if (survived(sample->object)) {
+      profile->sites[sample->site].survivedObjects += sample->objects;
+      profile->sites[sample->site].survivedBytes += sample->bytes;
+    }
+  }
+
+  profile->pendingCount = 0;
+}
+
+void gcProfileWrite(GCProfile* profile, FILE* file, GCProfileMetric metric) {
+  for (size_t i = 0; i < profile->siteCount; i++) {
+    GCProfileSite* site = &profile->sites[i];
+
+    double value = 0;
+    switch (metric) {
+      case GC_PROFILE_ALLOCATED_BYTES: value = site->allocatedBytes; break;
+      case GC_PROFILE_ALLOCATED_OBJECTS: value = site->allocatedObjects; break;
+      case GC_PROFILE_SURVIVED_BYTES: value = site->survivedBytes; break;
+      case GC_PROFILE_SURVIVED_OBJECTS: value = site->survivedObjects; break;
+    }
+
+    if (value < 0.5) continue;
+
+    if (site->depth == 0) {
+      fprintf(file, "site:%llu", (unsigned long long)site->id);
+    } else {
+      char** names = backtrace_symbols(site->frames, site->depth);
+      for (int frame = site->depth - 1; frame >= 0; frame--) {
+        // Semicolons and spaces separate frames and the value in the folded
+        // format, so they can't appear in a frame's name.
+        for (char* c = names[frame]; *c; c++) {
+          if (*c == ';' || *c == ' ') *c = '_';
+        }
+        fprintf(file, "%s%s", frame < site->depth - 1 ? ";" : "",
+                names[frame]);
+      }
+      free(names);
+
+      if (site->id != 0) fprintf(file, ";site:%llu", (unsigned long long)site->id);
+    }
+
+    fprintf(file, " %.0f\n", value);
+  }
+}
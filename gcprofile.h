@@ -0,0 +1,94 @@
+#ifndef gcprofile_h
+#define gcprofile_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// The most stack frames kept for each allocation site.
+#define GC_PROFILE_MAX_FRAMES 32
+
+// What a written profile measures for each site.
+typedef enum {
+  GC_PROFILE_ALLOCATED_BYTES,
+  GC_PROFILE_ALLOCATED_OBJECTS,
+  GC_PROFILE_SURVIVED_BYTES,
+  GC_PROFILE_SURVIVED_OBJECTS
+} GCProfileMetric;
+
+// A place that allocates. Either a caller-supplied ID, or a captured stack.
+// The counts are estimates of the totals, scaled up from the samples.
+typedef struct {
+  uint64_t id;
+  int depth;
+  void* frames[GC_PROFILE_MAX_FRAMES];
+
+  double allocatedObjects;
+  double allocatedBytes;
+  double survivedObjects;
+  double survivedBytes;
+} GCProfileSite;
+
+// A sampled object waiting for the next collection to see if it survives.
+typedef struct {
+  void* object;
+  size_t site;
+
+  // How many objects and bytes this sample stands in for.
+  double objects;
+  double bytes;
+} GCProfileSample;
+
+// A sampling allocation profiler. About every [interval] bytes, an allocation
+// is sampled and attributed to the current site. The distance between samples
+// is randomized, so allocations that happen in a regular pattern don't always
+// get skipped.
+typedef struct {
+  size_t interval;
+  int captureStacks;
+
+  // The site that allocations are attributed to when stacks aren't captured.
+  uint64_t currentSite;
+
+  // Counts down with every allocated byte. The allocation that takes it below
+  // zero is sampled.
+  int64_t bytesUntilSample;
+  uint64_t random;
+
+  GCProfileSite* sites;
+  size_t siteCount;
+  size_t siteCapacity;
+
+  // An open-addressed hash table of indexes into [sites], plus one.
+  size_t* siteTable;
+  size_t siteTableSize;
+
+  GCProfileSample* pending;
+  size_t pendingCount;
+  size_t pendingCapacity;
+} GCProfile;
+
+void gcProfileInit(GCProfile* profile, size_t interval, int captureStacks);
+void gcProfileFree(GCProfile* profile);
+
+// Counts [size] newly allocated bytes. Returns non-zero if the allocation
+// should be passed to gcProfileSample().
+static inline int gcProfileCount(GCProfile* profile, size_t size) {
+  profile->bytesUntilSample -= (int64_t)size;
+  return profile->bytesUntilSample < 0;
+}
+
+// Records [object], which is [size] bytes, as a sample for the current site.
+void gcProfileSample(GCProfile* profile, void* object, size_t size);
+
+// At a collection, once every live object is known, checks which of the
+// pending samples survived by calling [survived] on each, and adds them to
+// their sites' totals. Returns with no samples pending.
+void gcProfileCollect(GCProfile* profile, int (*survived)(void* object));
+
+// Writes [metric] for every site to [file] in the folded stack format read by
+// flame graph tools, one "frame;frame;frame value" line per site, outermost
+// frame first.
+void gcProfileWrite(GCProfile* profile, FILE* file, GCProfileMetric metric);
+
+#endif
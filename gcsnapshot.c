@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "gcsnapshot.h"
+
+void gcSnapshotWriteHeader(FILE* file, const char** typeNames,
+                           uint32_t typeCount, const uint64_t* roots,
+                           uint64_t rootCount) {
+  uint32_t version = GC_SNAPSHOT_VERSION;
+  fwrite(GC_SNAPSHOT_MAGIC, 1, 8, file);
+  fwrite(&version, sizeof(version), 1, file);
+
+  fwrite(&typeCount, sizeof(typeCount), 1, file);
+  for (uint32_t i = 0; i < typeCount; i++) {
+    fwrite(typeNames[i], 1, strlen(typeNames[i]) + 1, file);
+  }
+
+  fwrite(&rootCount, sizeof(rootCount), 1, file);
+  fwrite(roots, sizeof(uint64_t), rootCount, file);
+}
+
+void gcSnapshotWriteObject(FILE* file, const GCSnapshotObject* object) {
+  fwrite(&object->address, sizeof(object->address), 1, file);
+  fwrite(&object->type, sizeof(object->type), 1, file);
+  fwrite(&object->size, sizeof(object->size), 1, file);
+  fwrite(&object->edgeCount, sizeof(object->edgeCount), 1, file);
+  fwrite(object->edges, sizeof(uint64_t), object->edgeCount, file);
+}
+
+// Reads a NUL-terminated string from [file]. Returns NULL if the file ends
+// first.
+static char* readName(FILE* file) {
+  size_t length = 0;
+  size_t capacity = 16;
+  char* name = malloc(capacity);
+
+  for (;;) {
+    int c = fgetc(file);
+    if (c == EOF) {
+      free(name);
+      return NULL;
+    }
+
+    if (length == capacity) {
+      capacity *= 2;
+      name = realloc(name, capacity);
+    }
+
+    name[length++] = (char)c;
+    if (c == '\0') return name;
+  }
+}
+
+int gcSnapshotOpen(GCSnapshot* snapshot, FILE* file,
+                   void (*root)(uint64_t address, void* data), void* data) {
+  memset(snapshot, 0, sizeof(GCSnapshot));
+  snapshot->file = file;
+
+  char magic[8];
+  uint32_t version;
+  if (fread(magic, 1, 8, file) != 8 ||
+      memcmp(magic, GC_SNAPSHOT_MAGIC, 8) != 0 ||
+      fread(&version, sizeof(version), 1, file) != 1 ||
+      version != GC_SNAPSHOT_VERSION) {
+    return 0;
+  }
+
+  uint32_t typeCount;
+  if (fread(&typeCount, sizeof(typeCount), 1, file) != 1 ||
+      typeCount > GC_SNAPSHOT_MAX_TYPES) {
+    return 0;
+  }
+
+  for (uint32_t i = 0; i < typeCount; i++) {
+    snapshot->typeNames[i] = readName(file);
+    if (!snapshot->typeNames[i]) return 0;
+    snapshot->typeCount++;
+  }
+
+  if (fread(&snapshot->rootCount, sizeof(uint64_t), 1, file) != 1) return 0;
+  for (uint64_t i = 0; i < snapshot->rootCount; i++) {
+    uint64_t address;
+    if (fread(&address, sizeof(address), 1, file) != 1) return 0;
+    if (root) root(address, data);
+  }
+
+  return 1;
+}
+
+int gcSnapshotNext(GCSnapshot* snapshot, GCSnapshotObject* object) {
+  FILE* file = snapshot->file;
+  if (fread(&object->address, sizeof(object->address), 1, file) != 1 ||
+      fread(&object->type, sizeof(object->type), 1, file) != 1 ||
+      fread(&object->size, sizeof(object->size), 1, file) != 1 ||
+      fread(&object->edgeCount, sizeof(object->edgeCount), 1, file) != 1) {
+    return 0;
+  }
+
+  if (object->edgeCount > snapshot->edgeCapacity) {
+    snapshot->edgeCapacity = object->edgeCount;
+    snapshot->edges = realloc(snapshot->edges,
+                              snapshot->edgeCapacity * sizeof(uint64_t));
+  }
+
+  object->edges = snapshot->edges;
+  return fread(object->edges, sizeof(uint64_t), object->edgeCount, file) ==
+         object->edgeCount;
+}
+
+void gcSnapshotClose(GCSnapshot* snapshot) {
+  for (uint32_t i = 0; i < snapshot->typeCount; i++) {
+    free(snapshot->typeNames[i]);
+  }
+  free(snapshot->edges);
+}
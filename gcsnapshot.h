@@ -0,0 +1,74 @@
+#ifndef gcsnapshot_h
+#define gcsnapshot_h
+
+#include <stdint.h>
+#include <stdio.h>
+
+// A heap snapshot is a compact binary file of the live object graph, written
+// in the host's byte order:
+//
+//     "L2SNAP\0\0"                  magic
+//     u32 version
+//     u32 typeCount, then that many NUL-terminated type names
+//     u64 rootCount, then that many u64 root addresses
+//     then, until the end of the file, one record per live object:
+//       u64 address
+//       u8  type
+//       u32 size in bytes
+//       u32 edgeCount, then that many u64 addresses it refers to
+//
+// Objects are written as they're reached, so every address an edge or root
+// refers to has a record somewhere in the file, though not necessarily before
+// the edge. Records are read one at a time, so a snapshot never has to fit in
+// memory all at once.
+#define GC_SNAPSHOT_MAGIC "L2SNAP\0\0"
+#define GC_SNAPSHOT_VERSION 1
+
+// The most types a snapshot can name.
+#define GC_SNAPSHOT_MAX_TYPES 16
+
+typedef struct {
+  uint64_t address;
+  uint8_t type;
+  uint32_t size;
+
+  uint32_t edgeCount;
+  uint64_t* edges;
+} GCSnapshotObject;
+
+// Streams a snapshot in or out of [file].
+typedef struct {
+  FILE* file;
+
+  uint32_t typeCount;
+  char* typeNames[GC_SNAPSHOT_MAX_TYPES];
+
+  uint64_t rootCount;
+
+  // Space for the edges of the last record read.
+  uint64_t* edges;
+  uint32_t edgeCapacity;
+} GCSnapshot;
+
+// Writes the snapshot header to [file], with [typeNames] for each type number
+// and the [rootCount] addresses in [roots].
+void gcSnapshotWriteHeader(FILE* file, const char** typeNames,
+                           uint32_t typeCount, const uint64_t* roots,
+                           uint64_t rootCount);
+
+// Appends the record for [object] to [file].
+void gcSnapshotWriteObject(FILE* file, const GCSnapshotObject* object);
+
+// Reads the snapshot header from [file] into [snapshot]. The roots are passed
+// to [root] one at a time, if it's not NULL. Returns zero if [file] isn't a
+// snapshot this version can read.
+int gcSnapshotOpen(GCSnapshot* snapshot, FILE* file,
+                   void (*root)(uint64_t address, void* data), void* data);
+
+// Reads the next record into [object]. Its edges are only valid until the
+// next call. Returns zero at the end of the snapshot.
+int gcSnapshotNext(GCSnapshot* snapshot, GCSnapshotObject* object);
+
+void gcSnapshotClose(GCSnapshot* snapshot);
+
+#endif
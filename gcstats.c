@@ -0,0 +1,63 @@
+#include <string.h>
+
+#include "gcstats.h"
+
+// Returns the bucket that [value] is counted in.
+static int bucketIndex(uint64_t value) {
+  if (value < GC_HISTOGRAM_SUB_BUCKETS) return (int)value;
+
+  // Keep the top GC_HISTOGRAM_SUB_BITS + 1 bits of the value. The leading one
+  // picks the power of two, and the rest pick the linear bucket within it.
+  int shift = 63 - __builtin_clzll(value) - GC_HISTOGRAM_SUB_BITS;
+  int sub = (int)(value >> shift) - GC_HISTOGRAM_SUB_BUCKETS;
+  return (shift + 1) * GC_HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+// Returns the largest value that is counted in bucket [index].
+static uint64_t bucketMax(int index) {
+  if (index < GC_HISTOGRAM_SUB_BUCKETS) return (uint64_t)index;
+
+  int shift = index / GC_HISTOGRAM_SUB_BUCKETS - 1;
+  uint64_t sub = index % GC_HISTOGRAM_SUB_BUCKETS + GC_HISTOGRAM_SUB_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
+
+void gcStatsInit(GCStats* stats) {
+  memset(stats, 0, sizeof(GCStats));
+}
+
+void gcStatsRecordCollection(GCStats* stats, uint64_t pauseNs,
+                             uint64_t liveBytes, uint64_t heapBytes,
+                             uint64_t allocatedBytes) {
+  stats->bytesAllocated += allocatedBytes;
+  stats->collections++;
+  stats->totalPauseNs += pauseNs;
+  if (pauseNs > stats->maxPauseNs) stats->maxPauseNs = pauseNs;
+  if (liveBytes > stats->peakLiveBytes) stats->peakLiveBytes = liveBytes;
+  if (heapBytes > stats->peakHeapBytes) stats->peakHeapBytes = heapBytes;
+
+  gcHistogramRecord(&stats->pauses, pauseNs);
+}
+
+void gcHistogramRecord(GCHistogram* histogram, uint64_t value) {
+  histogram->counts[bucketIndex(value)]++;
+  histogram->total++;
+}
+
+uint64_t gcHistogramPercentile(const GCHistogram* histogram,
+                               double percentile) {
+  if (histogram->total == 0) return 0;
+
+  // The rank of the value we want, counting from 1.
+  uint64_t rank = (uint64_t)(percentile / 100.0 * histogram->total + 0.5);
+  if (rank < 1) rank = 1;
+  if (rank > histogram->total) rank = histogram->total;
+
+  uint64_t seen = 0;
+  for (int i = 0; i < GC_HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->counts[i];
+    if (seen >= rank) return bucketMax(i);
+  }
+
+  return bucketMax(GC_HISTOGRAM_BUCKETS - 1);
+}
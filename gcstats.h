@@ -0,0 +1,57 @@
+#ifndef gcstats_h
+#define gcstats_h
+
+#include <stdint.h>
+
+// The pause histogram keeps 2^GC_HISTOGRAM_SUB_BITS linear buckets for each
+// power of two, in the style of an HDR histogram. That bounds the error of any
+// recorded value to about 1 part in 32, from nanoseconds up to hours, in a
+// fixed amount of memory.
+#define GC_HISTOGRAM_SUB_BITS 5
+#define GC_HISTOGRAM_SUB_BUCKETS (1 << GC_HISTOGRAM_SUB_BITS)
+#define GC_HISTOGRAM_BUCKETS ((64 - GC_HISTOGRAM_SUB_BITS + 1) * \
+                              GC_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+  uint64_t counts[GC_HISTOGRAM_BUCKETS];
+  uint64_t total;
+} GCHistogram;
+
+// Running totals for a VM's collections. These are only updated at the end of
+// each collection, so reading them never triggers one.
+typedef struct {
+  // The total number of bytes ever allocated.
+  uint64_t bytesAllocated;
+
+  uint64_t collections;
+
+  uint64_t totalPauseNs;
+  uint64_t maxPauseNs;
+
+  // The most bytes that have been live at the end of any collection.
+  uint64_t peakLiveBytes;
+
+  // The most bytes that have been reserved for the heap at the end of any
+  // collection.
+  uint64_t peakHeapBytes;
+
+  GCHistogram pauses;
+} GCStats;
+
+void gcStatsInit(GCStats* stats);
+
+// Records a collection that paused for [pauseNs], after which [liveBytes] were
+// live in a heap of [heapBytes], and [allocatedBytes] had been allocated since
+// the previous one.
+void gcStatsRecordCollection(GCStats* stats, uint64_t pauseNs,
+                             uint64_t liveBytes, uint64_t heapBytes,
+                             uint64_t allocatedBytes);
+
+void gcHistogramRecord(GCHistogram* histogram, uint64_t value);
+
+// Returns the value that [percentile] (from 0 to 100) of the recorded values
+// are less than or equal to, or 0 if nothing has been recorded.
+uint64_t gcHistogramPercentile(const GCHistogram* histogram,
+                               double percentile);
+
+#endif
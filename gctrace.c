@@ -0,0 +1,260 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "gctrace.h"
+
+static uint64_t hashKey(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdull;
+  key ^= key >> 33;
+  return key;
+}
+
+static void mapInit(GCTraceMap* map, size_t capacity) {
+  map->count = 0;
+  map->capacity = capacity;
+  map->keys = calloc(capacity, sizeof(uint64_t));
+  map->values = malloc(capacity * sizeof(uint64_t));
+}
+
+static void mapFree(GCTraceMap* map) {
+  free(map->keys);
+  free(map->values);
+}
+
+static void mapPut(GCTraceMap* map, uint64_t key, uint64_t value);
+
+// Moves the entries into a table of [capacity].
+static void mapResize(GCTraceMap* map, size_t capacity) {
+  GCTraceMap old = *map;
+  mapInit(map, capacity);
+  for (size_t i = 0; i < old.capacity; i++) {
+    if (old.keys[i]) mapPut(map, old.keys[i], old.values[i]);
+  }
+  mapFree(&old);
+}
+
+static void mapPut(GCTraceMap* map, uint64_t key, uint64_t value) {
+  if ((map->count + 1) * 2 > map->capacity) mapResize(map, map->capacity * 2);
+
+  size_t slot = hashKey(key) & (map->capacity - 1);
+  while (map->keys[slot] && map->keys[slot] != key) {
+    slot = (slot + 1) & (map->capacity - 1);
+  }
+
+  if (!map->keys[slot]) map->count++;
+  map->keys[slot] = key;
+  map->values[slot] = value;
+}
+
+// Returns the value for [key], or zero if there isn't one.
+static uint64_t mapGet(GCTraceMap* map, uint64_t key) {
+  size_t slot = hashKey(key) & (map->capacity - 1);
+  while (map->keys[slot]) {
+    if (map->keys[slot] == key) return map->values[slot];
+    slot = (slot + 1) & (map->capacity - 1);
+  }
+  return 0;
+}
+
+static void writeVarint(GCTrace* trace, uint64_t value) {
+  uint8_t bytes[10];
+  int length = 0;
+  do {
+    bytes[length] = value & 0x7f;
+    value >>= 7;
+    if (value) bytes[length] |= 0x80;
+    length++;
+  } while (value);
+
+  gzwrite(trace->file, bytes, length);
+}
+
+// Reads a varint into [value]. Returns zero at the end of the file.
+static int readVarint(GCTrace* trace, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int byte = gzgetc(trace->file);
+    if (byte < 0) return 0;
+
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return 1;
+  }
+  return 0;
+}
+
+// Writes a reference to the object at [address].
+static void writeRef(GCTrace* trace, void* address) {
+  uint64_t number = address ? mapGet(&trace->map, (uint64_t)(uintptr_t)address)
+                            : 0;
+  writeVarint(trace, number ? trace->objects - number + 1 : 0);
+}
+
+// Reads a reference into [number]. Returns zero at the end of the file.
+static int readRef(GCTrace* trace, uint64_t* number) {
+  uint64_t ref;
+  if (!readVarint(trace, &ref)) return 0;
+  *number = ref ? trace->objects - ref + 1 : 0;
+  return 1;
+}
+
+int gcTraceRecord(GCTrace* trace, const char* path) {
+  trace->file = gzopen(path, "wb");
+  if (!trace->file) return 0;
+
+  trace->replaying = 0;
+  trace->objects = 0;
+  mapInit(&trace->map, 1024);
+
+  uint32_t version = GC_TRACE_VERSION;
+  gzwrite(trace->file, GC_TRACE_MAGIC, 8);
+  gzwrite(trace->file, &version, sizeof(version));
+  return 1;
+}
+
+int gcTraceReplay(GCTrace* trace, const char* path) {
+  trace->file = gzopen(path, "rb");
+  if (!trace->file) return 0;
+
+  char magic[8];
+  uint32_t version;
+  if (gzread(trace->file, magic, 8) != 8 ||
+      memcmp(magic, GC_TRACE_MAGIC, 8) != 0 ||
+      gzread(trace->file, &version, sizeof(version)) != sizeof(version) ||
+      version < 1 || version > GC_TRACE_VERSION) {
+    gzclose(trace->file);
+    return 0;
+  }
+
+  trace->replaying = 1;
+  trace->objects = 0;
+  mapInit(&trace->map, 1024);
+  return 1;
+}
+
+void gcTraceClose(GCTrace* trace) {
+  gzclose(trace->file);
+  mapFree(&trace->map);
+}
+
+void gcTraceNew(GCTrace* trace, void* object, uint64_t type) {
+  writeVarint(trace, GC_TRACE_NEW);
+  writeVarint(trace, type);
+  mapPut(&trace->map, (uint64_t)(uintptr_t)object, ++trace->objects);
+}
+
+void gcTraceNewArray(GCTrace* trace, void* object, uint64_t length) {
+  writeVarint(trace, GC_TRACE_NEW_ARRAY);
+  writeVarint(trace, length);
+  mapPut(&trace->map, (uint64_t)(uintptr_t)object, ++trace->objects);
+}
+
+void gcTraceNewMany(GCTrace* trace, void* first, uint64_t type,
+                    uint64_t count, size_t stride) {
+  writeVarint(trace, GC_TRACE_NEW_MANY);
+  writeVarint(trace, type);
+  writeVarint(trace, count);
+  for (uint64_t i = 0; i < count; i++) {
+    mapPut(&trace->map, (uint64_t)(uintptr_t)((char*)first + i * stride),
+           ++trace->objects);
+  }
+}
+
+void gcTracePush(GCTrace* trace, void* object) {
+  writeVarint(trace, GC_TRACE_PUSH);
+  writeRef(trace, object);
+}
+
+void gcTracePop(GCTrace* trace) {
+  writeVarint(trace, GC_TRACE_POP);
+}
+
+void gcTraceSet(GCTrace* trace, void* object, uint64_t field, void* value) {
+  writeVarint(trace, GC_TRACE_SET);
+  writeRef(trace, object);
+  writeVarint(trace, field);
+  writeRef(trace, value);
+}
+
+void gcTraceInt(GCTrace* trace, void* object, uint64_t value) {
+  writeVarint(trace, GC_TRACE_INT);
+  writeRef(trace, object);
+  writeVarint(trace, value);
+}
+
+void gcTraceStore(GCTrace* trace, uint64_t slot, void* value) {
+  writeVarint(trace, GC_TRACE_STORE);
+  writeVarint(trace, slot);
+  writeRef(trace, value);
+}
+
+int gcTraceNext(GCTrace* trace, GCTraceRecord* record) {
+  uint64_t op;
+  if (!readVarint(trace, &op)) return 0;
+  record->op = (GCTraceOp)op;
+
+  switch (record->op) {
+    case GC_TRACE_NEW:
+      return readVarint(trace, &record->type);
+
+    case GC_TRACE_NEW_ARRAY:
+      return readVarint(trace, &record->length);
+
+    case GC_TRACE_PUSH:
+      return readRef(trace, &record->value);
+
+    case GC_TRACE_POP:
+      return 1;
+
+    case GC_TRACE_SET:
+      return readRef(trace, &record->object) &&
+             readVarint(trace, &record->field) &&
+             readRef(trace, &record->value);
+
+    case GC_TRACE_INT:
+      return readRef(trace, &record->object) &&
+             readVarint(trace, &record->value);
+
+    case GC_TRACE_STORE:
+      return readVarint(trace, &record->field) &&
+             readRef(trace, &record->value);
+
+    case GC_TRACE_NEW_MANY:
+      return readVarint(trace, &record->type) &&
+             readVarint(trace, &record->length);
+  }
+
+  // An op this version doesn't know.
+  return 0;
+}
+
+void gcTraceAllocated(GCTrace* trace, void* object) {
+  mapPut(&trace->map, ++trace->objects, (uint64_t)(uintptr_t)object);
+}
+
+void* gcTraceObject(GCTrace* trace, uint64_t number) {
+  if (number == 0) return NULL;
+  return (void*)(uintptr_t)mapGet(&trace->map, number);
+}
+
+void gcTraceRemap(GCTrace* trace, void* (*moved)(void* object, void* data),
+                  void* data) {
+  GCTraceMap old = trace->map;
+  size_t capacity = 1024;
+  while (capacity < old.count * 2) capacity *= 2;
+  mapInit(&trace->map, capacity);
+
+  for (size_t i = 0; i < old.capacity; i++) {
+    if (!old.keys[i]) continue;
+
+    if (trace->replaying) {
+      void* object = moved((void*)(uintptr_t)old.values[i], data);
+      if (object) mapPut(&trace->map, old.keys[i], (uint64_t)(uintptr_t)object);
+    } else {
+      void* object = moved((void*)(uintptr_t)old.keys[i], data);
+      if (object) mapPut(&trace->map, (uint64_t)(uintptr_t)object, old.values[i]);
+    }
+  }
+
+  mapFree(&old);
+}
@@ -0,0 +1,121 @@
+#ifndef gctrace_h
+#define gctrace_h
+
+#include <stdint.h>
+#include <zlib.h>
+
+// A trace is a gzip-compressed stream of the mutator's calls into the VM: the
+// objects it allocates, what it pushes and pops, and the fields it writes.
+// Replaying one makes exactly the same calls, so the same workload can be run
+// against any collector.
+//
+// Objects are numbered in the order they're allocated, starting at 1. A
+// reference to one is written as how many objects ago it was allocated, plus
+// one, with zero for NULL, so the references to recent objects that most
+// programs make mostly fit in a byte. Every number is an unsigned LEB128
+// varint.
+//
+//     "L2TRACE\0", u32 version
+//     then one op per record:
+//       NEW type                 allocate an object of [type]
+//       NEW_ARRAY length         allocate an array
+//       PUSH ref                 push an object
+//       POP                      pop the top of the stack
+//       SET ref field ref        store the second object in a field of the
+//                                first. Pairs' fields are 0 for head and 1
+//                                for tail. Arrays' fields are their indexes.
+//       INT ref value            set an int's value
+//       STORE slot ref           store an object in a slot of the stack
+//       NEW_MANY type count      allocate [count] objects of [type] at once,
+//                                numbered in address order
+//
+// Version 1 traces are the same, without NEW_MANY.
+#define GC_TRACE_MAGIC "L2TRACE\0"
+#define GC_TRACE_VERSION 2
+
+typedef enum {
+  GC_TRACE_NEW,
+  GC_TRACE_NEW_ARRAY,
+  GC_TRACE_PUSH,
+  GC_TRACE_POP,
+  GC_TRACE_SET,
+  GC_TRACE_INT,
+  GC_TRACE_STORE,
+  GC_TRACE_NEW_MANY
+} GCTraceOp;
+
+// A single replayed op. [object] and [value] are object numbers, or zero for
+// NULL. A STORE's slot is in [field], and a NEW_MANY's count in [length].
+typedef struct {
+  GCTraceOp op;
+  uint64_t type;
+  uint64_t length;
+  uint64_t object;
+  uint64_t field;
+  uint64_t value;
+} GCTraceRecord;
+
+// Maps non-zero keys to values with open addressing. Entries are never removed
+// one at a time. Instead, the whole map is rebuilt after each collection.
+typedef struct {
+  uint64_t* keys;
+  uint64_t* values;
+  size_t count;
+  size_t capacity;
+} GCTraceMap;
+
+// A trace being recorded or replayed.
+//
+// Objects move during collection, so to tell which object an address refers
+// to, a recording keeps a map from each object's address to its number. A
+// replay keeps the reverse. After the collector has worked out where each
+// survivor will go, and before it forgets, it calls gcTraceRemap() to update
+// the map and drop the dead.
+typedef struct {
+  gzFile file;
+  int replaying;
+
+  // The number of objects allocated so far, which is also the number of the
+  // newest one.
+  uint64_t objects;
+
+  GCTraceMap map;
+} GCTrace;
+
+// Starts recording a trace to [path]. Returns zero if it can't be written.
+int gcTraceRecord(GCTrace* trace, const char* path);
+
+// Opens the trace at [path] for replay. Returns zero if it can't be read or
+// isn't a trace.
+int gcTraceReplay(GCTrace* trace, const char* path);
+
+void gcTraceClose(GCTrace* trace);
+
+// Records each op.
+void gcTraceNew(GCTrace* trace, void* object, uint64_t type);
+void gcTraceNewArray(GCTrace* trace, void* object, uint64_t length);
+void gcTraceNewMany(GCTrace* trace, void* first, uint64_t type,
+                    uint64_t count, size_t stride);
+void gcTracePush(GCTrace* trace, void* object);
+void gcTracePop(GCTrace* trace);
+void gcTraceSet(GCTrace* trace, void* object, uint64_t field, void* value);
+void gcTraceInt(GCTrace* trace, void* object, uint64_t value);
+void gcTraceStore(GCTrace* trace, uint64_t slot, void* value);
+
+// Reads the next op into [record]. Returns zero at the end of the trace.
+int gcTraceNext(GCTrace* trace, GCTraceRecord* record);
+
+// While replaying, gives the object just allocated for a NEW or NEW_ARRAY, or
+// each of a NEW_MANY's objects in turn, its number.
+void gcTraceAllocated(GCTrace* trace, void* object);
+
+// While replaying, returns the object numbered [number], or NULL if it's zero
+// or the object has died.
+void* gcTraceObject(GCTrace* trace, uint64_t number);
+
+// Updates every tracked object's address to [moved] of it. [moved] returns
+// NULL for an object that didn't survive.
+void gcTraceRemap(GCTrace* trace, void* (*moved)(void* object, void* data),
+                  void* data);
+
+#endif
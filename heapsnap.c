@@ -0,0 +1,406 @@
+// Reads a heap snapshot written by writeHeapSnapshot() and reports what is
+// keeping memory alive: the objects with the largest retained size, which is
+// how much would be freed if that object alone became unreachable.
+//
+// An object's retained set is everything it dominates: the objects that every
+// path from a root passes through it to reach. The dominator tree is built
+// with the Lengauer-Tarjan algorithm, using iteration instead of recursion so
+// that deep graphs like long lists don't overflow the native stack.
+//
+// Usage: heapsnap <snapshot> [top count]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gcsnapshot.h"
+
+#define NONE UINT32_MAX
+
+// The object graph, with node 0 standing for the roots and node i + 1 for the
+// i-th object record. Successors and predecessors are stored as compressed
+// adjacency arrays: node n's edges are [start[n], start[n + 1]).
+typedef struct {
+  uint32_t nodeCount;
+  uint64_t* addresses;
+  uint8_t* types;
+  uint32_t* sizes;
+
+  size_t* succStart;
+  uint32_t* succ;
+
+  size_t* predStart;
+  uint32_t* pred;
+} Graph;
+
+// Grows [*array] of [size]-byte items so it can hold at least [count] of them.
+static void ensure(void** array, size_t* capacity, size_t count, size_t size) {
+  if (count <= *capacity) return;
+
+  while (*capacity < count) *capacity = *capacity == 0 ? 1024 : *capacity * 2;
+  *array = realloc(*array, *capacity * size);
+  if (!*array) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+}
+
+// Edge targets as addresses, until every record has been read and they can be
+// resolved to nodes.
+typedef struct {
+  uint64_t* targets;
+  size_t count;
+  size_t capacity;
+} Edges;
+
+static void addEdge(uint64_t address, void* data) {
+  Edges* edges = (Edges*)data;
+  ensure((void**)&edges->targets, &edges->capacity, edges->count + 1,
+         sizeof(uint64_t));
+  edges->targets[edges->count++] = address;
+}
+
+static uint64_t hashAddress(uint64_t address) {
+  address ^= address >> 33;
+  address *= 0xff51afd7ed558ccdull;
+  address ^= address >> 33;
+  return address;
+}
+
+// Reads the snapshot in [file] into [graph]. Records are streamed, so only the
+// graph itself is ever held in memory.
+static int readGraph(FILE* file, Graph* graph, GCSnapshot* snapshot) {
+  Edges edges = { NULL, 0, 0 };
+  if (!gcSnapshotOpen(snapshot, file, addEdge, &edges)) return 0;
+
+  size_t capacity = 0;
+  size_t startCapacity = 0;
+  size_t typeCapacity = 0;
+  size_t sizeCapacity = 0;
+  graph->addresses = NULL;
+  graph->types = NULL;
+  graph->sizes = NULL;
+  graph->succStart = NULL;
+
+  // Node 0's edges are the roots, which were just read.
+  ensure((void**)&graph->succStart, &startCapacity, 2, sizeof(size_t));
+  ensure((void**)&graph->addresses, &capacity, 1, sizeof(uint64_t));
+  ensure((void**)&graph->types, &typeCapacity, 1, sizeof(uint8_t));
+  ensure((void**)&graph->sizes, &sizeCapacity, 1, sizeof(uint32_t));
+  graph->addresses[0] = 0;
+  graph->types[0] = 0;
+  graph->sizes[0] = 0;
+  graph->succStart[0] = 0;
+
+  uint32_t count = 1;
+  GCSnapshotObject object;
+  while (gcSnapshotNext(snapshot, &object)) {
+    if (count == NONE - 1) {
+      fprintf(stderr, "Too many objects.\n");
+      exit(1);
+    }
+
+    ensure((void**)&graph->succStart, &startCapacity, count + 2,
+           sizeof(size_t));
+    ensure((void**)&graph->addresses, &capacity, count + 1, sizeof(uint64_t));
+    ensure((void**)&graph->types, &typeCapacity, count + 1, sizeof(uint8_t));
+    ensure((void**)&graph->sizes, &sizeCapacity, count + 1, sizeof(uint32_t));
+
+    graph->succStart[count] = edges.count;
+    graph->addresses[count] = object.address;
+    graph->types[count] = object.type;
+    graph->sizes[count] = object.size;
+    for (uint32_t i = 0; i < object.edgeCount; i++) {
+      addEdge(object.edges[i], &edges);
+    }
+    count++;
+  }
+  graph->succStart[count] = edges.count;
+  graph->nodeCount = count;
+
+  // Map addresses to nodes with an open-addressed hash table at most half full.
+  size_t tableSize = 1;
+  while (tableSize < (size_t)count * 2) tableSize *= 2;
+  uint32_t* table = malloc(tableSize * sizeof(uint32_t));
+  memset(table, 0xff, tableSize * sizeof(uint32_t));
+
+  for (uint32_t node = 1; node < count; node++) {
+    size_t slot = hashAddress(graph->addresses[node]) & (tableSize - 1);
+    while (table[slot] != NONE) slot = (slot + 1) & (tableSize - 1);
+    table[slot] = node;
+  }
+
+  // Resolve each edge's address to its node. The node numbers are written
+  // over the front of the same array, which is safe since each one is smaller
+  // than the address it replaces and is never ahead of it.
+  graph->succ = (uint32_t*)edges.targets;
+  for (size_t i = 0; i < edges.count; i++) {
+    uint64_t address = edges.targets[i];
+    size_t slot = hashAddress(address) & (tableSize - 1);
+    while (table[slot] != NONE && graph->addresses[table[slot]] != address) {
+      slot = (slot + 1) & (tableSize - 1);
+    }
+    graph->succ[i] = table[slot];
+  }
+  free(table);
+
+  // Build the predecessors by counting each node's incoming edges first.
+  graph->predStart = calloc(count + 1, sizeof(size_t));
+  for (size_t i = 0; i < edges.count; i++) {
+    if (graph->succ[i] != NONE) graph->predStart[graph->succ[i] + 1]++;
+  }
+  for (uint32_t node = 0; node < count; node++) {
+    graph->predStart[node + 1] += graph->predStart[node];
+  }
+
+  graph->pred = malloc((graph->predStart[count] + 1) * sizeof(uint32_t));
+  size_t* fill = malloc((count + 1) * sizeof(size_t));
+  memcpy(fill, graph->predStart, (count + 1) * sizeof(size_t));
+  for (uint32_t node = 0; node < count; node++) {
+    for (size_t i = graph->succStart[node]; i < graph->succStart[node + 1];
+         i++) {
+      uint32_t target = graph->succ[i];
+      if (target != NONE) graph->pred[fill[target]++] = node;
+    }
+  }
+  free(fill);
+
+  return 1;
+}
+
+// The state for Lengauer-Tarjan. [semi] and the DFS order are preorder numbers
+// starting at 1, with 0 meaning unreached.
+typedef struct {
+  uint32_t* dfn;
+  uint32_t* vertex;
+  uint32_t* parent;
+  uint32_t* semi;
+  uint32_t* label;
+  uint32_t* ancestor;
+  uint32_t* idom;
+  uint32_t* bucketHead;
+  uint32_t* bucketNext;
+
+  // Scratch space for path compression.
+  uint32_t* path;
+} Dominators;
+
+// Numbers the nodes reachable from node 0 in depth-first preorder. Returns how
+// many there are.
+static uint32_t numberNodes(Graph* graph, Dominators* d) {
+  uint32_t* stack = malloc(graph->nodeCount * sizeof(uint32_t));
+  size_t* cursor = malloc(graph->nodeCount * sizeof(size_t));
+
+  uint32_t reached = 0;
+  uint32_t depth = 0;
+  stack[depth++] = 0;
+  d->dfn[0] = ++reached;
+  d->vertex[reached] = 0;
+  d->parent[0] = NONE;
+  cursor[0] = graph->succStart[0];
+
+  while (depth > 0) {
+    uint32_t node = stack[depth - 1];
+    if (cursor[node] == graph->succStart[node + 1]) {
+      depth--;
+      continue;
+    }
+
+    uint32_t target = graph->succ[cursor[node]++];
+    if (target == NONE || d->dfn[target] != 0) continue;
+
+    d->dfn[target] = ++reached;
+    d->vertex[reached] = target;
+    d->parent[target] = node;
+    cursor[target] = graph->succStart[target];
+    stack[depth++] = target;
+  }
+
+  free(stack);
+  free(cursor);
+  return reached;
+}
+
+// Compresses the ancestor path from [node] so later evaluations are fast, then
+// returns the node on it with the smallest semidominator.
+static uint32_t eval(Dominators* d, uint32_t node) {
+  if (d->ancestor[node] == NONE) return node;
+
+  // Collect the path up to the last node whose ancestor is a tree root...
+  uint32_t length = 0;
+  for (uint32_t x = node; d->ancestor[d->ancestor[x]] != NONE;
+       x = d->ancestor[x]) {
+    d->path[length++] = x;
+  }
+
+  // ...then compress it from the top down.
+  while (length > 0) {
+    uint32_t x = d->path[--length];
+    uint32_t up = d->ancestor[x];
+    if (d->semi[d->label[up]] < d->semi[d->label[x]]) {
+      d->label[x] = d->label[up];
+    }
+    d->ancestor[x] = d->ancestor[up];
+  }
+
+  return d->label[node];
+}
+
+// Fills in [d->idom] for every node reachable from node 0. Returns how many
+// nodes are reachable.
+static uint32_t findDominators(Graph* graph, Dominators* d) {
+  uint32_t n = graph->nodeCount;
+  d->dfn = calloc(n, sizeof(uint32_t));
+  d->vertex = malloc((n + 1) * sizeof(uint32_t));
+  d->parent = malloc(n * sizeof(uint32_t));
+  d->semi = malloc(n * sizeof(uint32_t));
+  d->label = malloc(n * sizeof(uint32_t));
+  d->ancestor = malloc(n * sizeof(uint32_t));
+  d->idom = malloc(n * sizeof(uint32_t));
+  d->bucketHead = malloc(n * sizeof(uint32_t));
+  d->bucketNext = malloc(n * sizeof(uint32_t));
+  d->path = malloc(n * sizeof(uint32_t));
+
+  uint32_t reached = numberNodes(graph, d);
+
+  for (uint32_t node = 0; node < n; node++) {
+    d->semi[node] = d->dfn[node];
+    d->label[node] = node;
+    d->ancestor[node] = NONE;
+    d->idom[node] = NONE;
+    d->bucketHead[node] = NONE;
+  }
+
+  for (uint32_t i = reached; i >= 2; i--) {
+    uint32_t w = d->vertex[i];
+
+    // The semidominator is the earliest node with a path to [w] through nodes
+    // numbered after it.
+    for (size_t e = graph->predStart[w]; e < graph->predStart[w + 1]; e++) {
+      uint32_t v = graph->pred[e];
+      if (d->dfn[v] == 0) continue;
+
+      uint32_t u = eval(d, v);
+      if (d->semi[u] < d->semi[w]) d->semi[w] = d->semi[u];
+    }
+
+    uint32_t semi = d->vertex[d->semi[w]];
+    d->bucketNext[w] = d->bucketHead[semi];
+    d->bucketHead[semi] = w;
+
+    uint32_t parent = d->parent[w];
+    d->ancestor[w] = parent;
+
+    // Every node whose semidominator is [parent] now has its immediate
+    // dominator, or one it can be derived from.
+    for (uint32_t v = d->bucketHead[parent]; v != NONE; v = d->bucketNext[v]) {
+      uint32_t u = eval(d, v);
+      d->idom[v] = d->semi[u] < d->semi[v] ? u : parent;
+    }
+    d->bucketHead[parent] = NONE;
+  }
+
+  for (uint32_t i = 2; i <= reached; i++) {
+    uint32_t w = d->vertex[i];
+    if (d->idom[w] != d->vertex[d->semi[w]]) d->idom[w] = d->idom[d->idom[w]];
+  }
+
+  return reached;
+}
+
+static const char* typeName(GCSnapshot* snapshot, uint8_t type) {
+  return type < snapshot->typeCount ? snapshot->typeNames[type] : "?";
+}
+
+int main(int argc, const char* argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <snapshot> [top count]\n", argv[0]);
+    return 1;
+  }
+
+  int top = argc > 2 ? atoi(argv[2]) : 20;
+  if (top < 1) top = 1;
+
+  FILE* file = fopen(argv[1], "rb");
+  if (!file) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  Graph graph;
+  GCSnapshot snapshot;
+  if (!readGraph(file, &graph, &snapshot)) {
+    fprintf(stderr, "%s is not a heap snapshot.\n", argv[1]);
+    return 1;
+  }
+  fclose(file);
+
+  Dominators d;
+  uint32_t reached = findDominators(&graph, &d);
+
+  // Every node's retained size is its own plus that of everything it
+  // immediately dominates. Walking in reverse preorder sees children first.
+  uint64_t* retained = malloc(graph.nodeCount * sizeof(uint64_t));
+  for (uint32_t node = 0; node < graph.nodeCount; node++) {
+    retained[node] = graph.sizes[node];
+  }
+  for (uint32_t i = reached; i >= 2; i--) {
+    uint32_t w = d.vertex[i];
+    retained[d.idom[w]] += retained[w];
+  }
+
+  uint64_t typeCounts[GC_SNAPSHOT_MAX_TYPES] = {0};
+  uint64_t typeBytes[GC_SNAPSHOT_MAX_TYPES] = {0};
+  for (uint32_t node = 1; node < graph.nodeCount; node++) {
+    if (graph.types[node] >= GC_SNAPSHOT_MAX_TYPES) continue;
+    typeCounts[graph.types[node]]++;
+    typeBytes[graph.types[node]] += graph.sizes[node];
+  }
+
+  printf("%u objects, %llu bytes reachable from %llu roots.\n",
+         reached - 1, (unsigned long long)retained[0],
+         (unsigned long long)snapshot.rootCount);
+  for (uint32_t type = 0; type < snapshot.typeCount; type++) {
+    if (typeCounts[type] == 0) continue;
+    printf("  %-8s %10llu objects %12llu bytes\n", typeName(&snapshot, type),
+           (unsigned long long)typeCounts[type],
+           (unsigned long long)typeBytes[type]);
+  }
+
+  // Keep the largest retainers in [best], sorted largest first.
+  uint32_t* best = malloc(top * sizeof(uint32_t));
+  int bestCount = 0;
+  for (uint32_t i = 2; i <= reached; i++) {
+    uint32_t node = d.vertex[i];
+    if (bestCount == top && retained[node] <= retained[best[top - 1]]) {
+      continue;
+    }
+
+    int slot = bestCount < top ? bestCount++ : top - 1;
+    while (slot > 0 && retained[best[slot - 1]] < retained[node]) {
+      best[slot] = best[slot - 1];
+      slot--;
+    }
+    best[slot] = node;
+  }
+
+  printf("\n%-18s %-8s %10s %12s %-18s\n", "address", "type", "size",
+         "retained", "dominator");
+  for (int i = 0; i < bestCount; i++) {
+    uint32_t node = best[i];
+    uint32_t idom = d.idom[node];
+    printf("0x%016llx %-8s %10u %12llu ",
+           (unsigned long long)graph.addresses[node],
+           typeName(&snapshot, graph.types[node]), graph.sizes[node],
+           (unsigned long long)retained[node]);
+    if (idom == 0) {
+      printf("(root)\n");
+    } else {
+      printf("0x%016llx\n", (unsigned long long)graph.addresses[idom]);
+    }
+  }
+
+  gcSnapshotClose(&snapshot);
+  return 0;
+}
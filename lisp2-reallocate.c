@@ -2,24 +2,64 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-
-#define STACK_MAX 256
+#include <unistd.h>
+
+#include "gccensus.h"
+#include "gcidle.h"
+#include "gclog.h"
+#include "gcmmu.h"
+#include "gcpages.h"
+#include "gcpressure.h"
+#include "gcprobes.h"
+#include "gcprofile.h"
+#include "gcsnapshot.h"
+#include "gcstats.h"
+#include "gctrace.h"
+
+// The stack is made of segments of this many slots. Must be a power of two.
+#define STACK_SEGMENT_SIZE 256
 #define HEAP_MIN 16
+
+// The heap newVM() creates is grown or shrunk after each collection to this
+// many times the live bytes. A different multiple can be passed to
+// newVMWithHeadroom().
 #define HEAP_HEADROOM 1.5
 
+// How many bytes below a VM's hard limit are held back for cleanup code to
+// allocate in once an allocation has failed. See setHeapLimits().
+#define HEAP_RESERVE (16 * 1024)
+
+// Once the live bytes are over a VM's soft limit, the heap is only given this
+// fraction of them again as headroom.
+#define SOFT_LIMIT_GROWTH 0.25
+
+// The most objects vmAllocMany() allocates at once. The heap here could hand
+// out any number, but lisp2.c's mark-region collector can't, and this keeps
+// traces replayable there.
+#define ALLOC_MANY_MAX (32 * 1024 / sizeof(Object))
+
 typedef enum {
   OBJ_INT,
   OBJ_PAIR
 } ObjectType;
 
-typedef struct sObject {
-  ObjectType type;
+// The header word packs the mark bit, ObjectType, a saturating age and, during
+// collection, the forwarding offset from the start of the heap:
+//
+//     bit  0     mark
+//     bits 1-3   type
+//     bits 4-7   age
+//     bits 8-63  forwarding offset
+#define HEADER_MARK_BIT       ((uint64_t)1)
+#define HEADER_TYPE_SHIFT     1
+#define HEADER_TYPE_MASK      ((uint64_t)0x7 << HEADER_TYPE_SHIFT)
+#define HEADER_AGE_SHIFT      4
+#define HEADER_AGE_MASK       ((uint64_t)0xf << HEADER_AGE_SHIFT)
+#define HEADER_AGE_MAX        15
+#define HEADER_FORWARD_SHIFT  8
 
-  // During the sweep phase of garbage collection, this will be non-NULL if the
-  // object was reached, otherwise it will be NULL. Before compaction, this
-  // will store the address that the object will end up at after compaction.
-  // Once garbage collection is done, this is reset to NULL.
-  void* moveTo;
+typedef struct sObject {
+  uint64_t header;
 
   union {
     // OBJ_INT.
@@ -33,9 +73,61 @@ typedef struct sObject {
   };
 } Object;
 
+static inline ObjectType objectType(Object* object) {
+  return (ObjectType)((object->header & HEADER_TYPE_MASK) >> HEADER_TYPE_SHIFT);
+}
+
+static inline int isMarked(Object* object) {
+  return (object->header & HEADER_MARK_BIT) != 0;
+}
+
+static inline int objectAge(Object* object) {
+  return (int)((object->header & HEADER_AGE_MASK) >> HEADER_AGE_SHIFT);
+}
+
+static inline size_t forwardingOffset(Object* object) {
+  return (size_t)(object->header >> HEADER_FORWARD_SHIFT);
+}
+
+static inline void setForwardingOffset(Object* object, size_t offset) {
+  object->header = (object->header & ((1 << HEADER_FORWARD_SHIFT) - 1)) |
+                   ((uint64_t)offset << HEADER_FORWARD_SHIFT);
+}
+
+// The stack grows by adding segments rather than by reallocating, so a slot
+// never moves while it's in use.
+typedef struct {
+  Object* slots[STACK_SEGMENT_SIZE];
+} StackSegment;
+
+// A stack slot rooting an object for native code. Collections update the slot
+// when they move the object. See openHandleScope().
+typedef Object** Handle;
+
+// The depth of the stack when a handle scope was opened.
 typedef struct {
-  Object* stack[STACK_MAX];
-  int stackSize;
+  size_t stackSize;
+} HandleScope;
+
+typedef struct sVM {
+  // The stack's segments, bottom first. Segments above the top of the stack
+  // are kept for when it grows again.
+  StackSegment** segments;
+  size_t segmentCount;
+  size_t segmentCapacity;
+  size_t stackSize;
+
+  // Slots outside the VM registered with vmAddRoot(). Any of them may be NULL.
+  Object*** roots;
+  size_t rootCount;
+  size_t rootCapacity;
+
+  // The objects the mark phase has marked but not scanned yet. Marking works
+  // through these instead of recursing, so a long list can't overflow the C
+  // stack.
+  Object** grey;
+  size_t greyCount;
+  size_t greyCapacity;
 
   // The beginning of the contiguous block of memory that objects are allocated
   // from.
@@ -44,10 +136,81 @@ typedef struct {
   // Pointer to immediately past the end of the heap.
   void* end;
 
+  // Whether [heap] was mapped by enableHugePages() instead of malloc()ed, in
+  // which case it's resized by remapping it.
+  int hugePages;
+
+  // How many times the live bytes the heap is sized to after a collection.
+  double headroom;
+
+  // The cgroup's memory limit and pressure, which adjust [headroom], or NULL
+  // if they're ignored. See enableMemoryPressure().
+  GCPressure* pressure;
+
+  // Limits on the size of the heap, or zero if there are none. See
+  // setHeapLimits().
+  size_t softLimit;
+  size_t hardLimit;
+
+  // Set when an allocation has failed at the hard limit, which opens up the
+  // reserve below it until a collection frees enough to close it again.
+  int reserveOpen;
+
+  // Called when an allocation fails, just before it returns NULL, or NULL.
+  void (*outOfMemory)(struct sVM* vm, size_t size);
+
   // The beginning of the next chunk of memory to be allocated from the heap.
   void* next;
+
+  // An event for each collection, with timings for each of its phases.
+  GCLog events;
+  uint64_t collections;
+
+  // How long past collections took, for vmIdleNotification().
+  GCPausePredictor predictor;
+
+  // Running totals across all collections, and the bytes that were live at
+  // the end of the last one.
+  GCStats stats;
+  size_t liveSize;
+
+  // What the last collection found in the heap.
+  GCCensus census;
+
+  // Hardware counters captured around each phase, or NULL.
+  GCPerfCounters* counters;
+
+  // When every collection paused the VM, and where to report pause times and
+  // MMU when the VM is freed, if anywhere.
+  GCTimeline pauses;
+  const char* reportPath;
+
+  // The allocation profiler, or NULL if allocations aren't being sampled.
+  GCProfile* profile;
+
+  // The trace being recorded or replayed, or NULL.
+  GCTrace* trace;
 } VM;
 
+static inline Object** stackSlot(VM* vm, size_t slot) {
+  return &vm->segments[slot / STACK_SEGMENT_SIZE]
+              ->slots[slot & (STACK_SEGMENT_SIZE - 1)];
+}
+
+static inline Object* getStack(VM* vm, size_t slot) {
+  return *stackSlot(vm, slot);
+}
+
+// Returns how many of the slots in [segment] of the stack are in use.
+static inline size_t segmentSlots(VM* vm, size_t segment) {
+  size_t used = vm->stackSize - segment * STACK_SEGMENT_SIZE;
+  return used < STACK_SEGMENT_SIZE ? used : STACK_SEGMENT_SIZE;
+}
+
+static inline size_t usedSegments(VM* vm) {
+  return (vm->stackSize + STACK_SEGMENT_SIZE - 1) / STACK_SEGMENT_SIZE;
+}
+
 void assert(int condition, const char* message) {
   if (!condition) {
     printf("%s\n", message);
@@ -55,58 +218,175 @@ void assert(int condition, const char* message) {
   }
 }
 
-void assertLive(VM* vm, long expectedCount) {
-  long actualCount = (vm->next - vm->heap) / sizeof(Object);
+void assertLive(VM* vm, size_t expectedCount) {
+  size_t actualCount = (vm->next - vm->heap) / sizeof(Object);
   if (actualCount == expectedCount) {
-    printf("PASS: Expected and found %ld live objects.\n", expectedCount);
+    printf("PASS: Expected and found %zu live objects.\n", expectedCount);
   } else {
-    printf("Expected heap to contain %ld objects, but had %ld.\n",
+    printf("Expected heap to contain %zu objects, but had %zu.\n",
            expectedCount, actualCount);
     exit(1);
   }
 }
 
-VM* newVM() {
+// Creates a new VM whose heap is resized to [headroom] times the live bytes
+// after each collection.
+VM* newVMWithHeadroom(double headroom) {
   VM* vm = malloc(sizeof(VM));
+  vm->segments = NULL;
+  vm->segmentCount = 0;
+  vm->segmentCapacity = 0;
   vm->stackSize = 0;
+  vm->roots = NULL;
+  vm->rootCount = 0;
+  vm->rootCapacity = 0;
+  vm->grey = NULL;
+  vm->greyCount = 0;
+  vm->greyCapacity = 0;
 
   vm->heap = malloc(HEAP_MIN);
   vm->end = vm->heap + HEAP_MIN;
+  vm->hugePages = 0;
+  vm->headroom = headroom;
+  vm->pressure = NULL;
+  vm->softLimit = 0;
+  vm->hardLimit = 0;
+  vm->reserveOpen = 0;
+  vm->outOfMemory = NULL;
   vm->next = vm->heap;
 
+  gcLogInit(&vm->events);
+  vm->collections = 0;
+  gcPredictorInit(&vm->predictor);
+  gcStatsInit(&vm->stats);
+  vm->liveSize = 0;
+  gcCensusReset(&vm->census, HEAP_MIN);
+  vm->counters = NULL;
+  gcTimelineInit(&vm->pauses, gcNow());
+  vm->reportPath = NULL;
+  vm->profile = NULL;
+  vm->trace = NULL;
+
   return vm;
 }
 
+VM* newVM() {
+  return newVMWithHeadroom(HEAP_HEADROOM);
+}
+
+void growStack(VM* vm) {
+  if (vm->segmentCount == vm->segmentCapacity) {
+    vm->segmentCapacity = vm->segmentCapacity == 0 ? 4
+                                                   : vm->segmentCapacity * 2;
+    vm->segments = realloc(vm->segments,
+                           vm->segmentCapacity * sizeof(StackSegment*));
+    assert(vm->segments != NULL, "Out of memory!");
+  }
+
+  StackSegment* segment = malloc(sizeof(StackSegment));
+  assert(segment != NULL, "Out of memory!");
+  vm->segments[vm->segmentCount++] = segment;
+}
+
 void push(VM* vm, Object* value) {
-  assert(vm->stackSize < STACK_MAX, "Stack overflow!");
-  vm->stack[vm->stackSize++] = value;
+  if (vm->stackSize == vm->segmentCount * STACK_SEGMENT_SIZE) growStack(vm);
+  *stackSlot(vm, vm->stackSize++) = value;
+  if (vm->trace && !vm->trace->replaying) gcTracePush(vm->trace, value);
 }
 
 
 Object* pop(VM* vm) {
   assert(vm->stackSize > 0, "Stack underflow!");
-  return vm->stack[--vm->stackSize];
+  if (vm->trace && !vm->trace->replaying) gcTracePop(vm->trace);
+  return getStack(vm, --vm->stackSize);
+}
+
+// Registers [slot], which lives outside the VM, as a root until it's removed
+// with vmRemoveRoot(). The slot is updated whenever its object moves.
+void vmAddRoot(VM* vm, Object** slot) {
+  if (vm->rootCount == vm->rootCapacity) {
+    vm->rootCapacity = vm->rootCapacity == 0 ? 16 : vm->rootCapacity * 2;
+    vm->roots = realloc(vm->roots, vm->rootCapacity * sizeof(Object**));
+    assert(vm->roots != NULL, "Out of memory!");
+  }
+
+  vm->roots[vm->rootCount++] = slot;
+}
+
+void vmRemoveRoot(VM* vm, Object** slot) {
+  for (size_t i = vm->rootCount; i > 0; i--) {
+    if (vm->roots[i - 1] == slot) {
+      vm->roots[i - 1] = vm->roots[--vm->rootCount];
+      return;
+    }
+  }
 }
 
-void mark(Object* object) {
-  // If already marked, we're done. Check this first to avoid recursing
-  // on cycles in the object graph.
-  if (object->moveTo) return;
+// Opens a scope for handles. Every handle made after this is released when
+// the scope is closed. Scopes must be closed in the reverse of the order they
+// were opened.
+HandleScope openHandleScope(VM* vm) {
+  HandleScope scope = { vm->stackSize };
+  return scope;
+}
+
+// Roots [object] until the current handle scope is closed.
+Handle newHandle(VM* vm, Object* object) {
+  push(vm, object);
+  return stackSlot(vm, vm->stackSize - 1);
+}
+
+// Releases every handle made since [scope] was opened.
+void closeHandleScope(VM* vm, HandleScope scope) {
+  assert(scope.stackSize <= vm->stackSize, "Handle scope closed twice!");
+  if (vm->trace && !vm->trace->replaying) {
+    for (size_t i = scope.stackSize; i < vm->stackSize; i++) {
+      gcTracePop(vm->trace);
+    }
+  }
+
+  vm->stackSize = scope.stackSize;
+}
 
-  // Any non-zero pointer indicates the object was reached. For no particular
-  // reason, we use the object's own address as the marked value.
-  object->moveTo = object;
+// Marks [object], if it isn't already, and queues it to have its fields
+// scanned.
+static void markGrey(VM* vm, Object* object) {
+  // If already marked, we're done. Check this first to avoid looping on cycles
+  // in the object graph.
+  if (isMarked(object)) return;
 
-  if (object->type == OBJ_PAIR) {
-    mark(object->head);
-    mark(object->tail);
+  object->header |= HEADER_MARK_BIT;
+
+  if (vm->greyCount == vm->greyCapacity) {
+    vm->greyCapacity = vm->greyCapacity == 0 ? 256 : vm->greyCapacity * 2;
+    vm->grey = realloc(vm->grey, vm->greyCapacity * sizeof(Object*));
+  }
+  vm->grey[vm->greyCount++] = object;
+}
+
+// Marks [object] and everything reachable from it.
+void mark(VM* vm, Object* object) {
+  markGrey(vm, object);
+
+  while (vm->greyCount > 0) {
+    object = vm->grey[--vm->greyCount];
+    if (objectType(object) == OBJ_PAIR) {
+      markGrey(vm, object->head);
+      markGrey(vm, object->tail);
+    }
   }
 }
 
 void markAll(VM* vm)
 {
-  for (int i = 0; i < vm->stackSize; i++) {
-    mark(vm->stack[i]);
+  for (size_t segment = 0; segment < usedSegments(vm); segment++) {
+    Object** slots = vm->segments[segment]->slots;
+    size_t count = segmentSlots(vm, segment);
+    for (size_t i = 0; i < count; i++) mark(vm, slots[i]);
+  }
+
+  for (size_t i = 0; i < vm->rootCount; i++) {
+    if (*vm->roots[i]) mark(vm, *vm->roots[i]);
   }
 }
 
@@ -118,39 +398,60 @@ size_t calculateNewLocations(VM* vm)
   // address. When we're done, we may end up reallocating and moving the heap,
   // but these will let us calculate the moved address based on the old heap
   // location.
+  //
+  // Every object is visited here, so this takes the census too.
   void* to = vm->heap;
+  void* deadStart = NULL;
   while (from < vm->next) {
     Object* object = (Object*)from;
-    if (object->moveTo) {
-      object->moveTo = to;
+    gcCensusRegion(&vm->census, from - vm->heap, sizeof(Object),
+                   isMarked(object));
+
+    if (isMarked(object)) {
+      if (deadStart) gcCensusSpan(&vm->census, from - deadStart);
+      deadStart = NULL;
+
+      gcCensusLive(&vm->census, objectType(object), sizeof(Object));
+      gcCensusMoved(&vm->census, sizeof(Object), from - to);
+
+      setForwardingOffset(object, to - vm->heap);
       to += sizeof(Object);
+    } else if (!deadStart) {
+      deadStart = from;
     }
 
     from += sizeof(Object);
   }
 
+  if (deadStart) gcCensusSpan(&vm->census, from - deadStart);
+
   return to - vm->heap;
 }
 
-void updateAllObjectPointers(VM* vm, void* oldHeap)
+void updateAllObjectPointers(VM* vm, void* oldHeap, void* oldNext)
 {
-  // Walk the heap.
+  // Walk the heap. [oldNext] is the end of the used part of the heap before
+  // collection, translated into the (possibly new) heap.
   void* from = vm->heap;
-  while (from < vm->next) {
+  while (from < oldNext) {
     Object* object = (Object*)from;
 
-    if (object->moveTo) {
-      switch (object->type) {
+    if (isMarked(object)) {
+      switch (objectType(object)) {
         case OBJ_INT:
           // Nothing to do.
           break;
 
-        case OBJ_PAIR:
-          // Calculate the new addresses as an offset from the old heap in case
-          // the heap itself moved.
-          object->head = vm->heap + (object->head->moveTo - oldHeap);
-          object->tail = vm->heap + (object->tail->moveTo - oldHeap);
+        case OBJ_PAIR: {
+          // The fields still point into the old heap, which may have been
+          // freed if the heap moved. Find the referenced objects relative to
+          // the new heap before reading their forwarding offsets.
+          Object* head = ((void*)object->head - oldHeap) + vm->heap;
+          Object* tail = ((void*)object->tail - oldHeap) + vm->heap;
+          object->head = vm->heap + forwardingOffset(head);
+          object->tail = vm->heap + forwardingOffset(tail);
           break;
+        }
       }
     }
 
@@ -158,89 +459,761 @@ void updateAllObjectPointers(VM* vm, void* oldHeap)
   }
 
   // Fix the stack pointers.
-  for (int i = 0; i < vm->stackSize; i++) {
-    // Find the object referenced by the stack. We have to do a little
-    // arithmetic here because the stack points to the object's old location in
-    // oldHeap and the heap may have been reallocated. The *relative* pointer
-    // is still valid, so we recalculate the object's address in the new heap
-    // based on where it was relative to the beginning of the old heap.
-    Object* object = ((void*)vm->stack[i] - oldHeap) + vm->heap;
+  for (size_t segment = 0; segment < usedSegments(vm); segment++) {
+    Object** slots = vm->segments[segment]->slots;
+    size_t count = segmentSlots(vm, segment);
+    for (size_t i = 0; i < count; i++) {
+      // Find the object referenced by the stack. We have to do a little
+      // arithmetic here because the stack points to the object's old location
+      // in oldHeap and the heap may have been reallocated. The *relative*
+      // pointer is still valid, so we recalculate the object's address in the
+      // new heap based on where it was relative to the beginning of the old
+      // heap.
+      Object* object = ((void*)slots[i] - oldHeap) + vm->heap;
+
+      // Update the pointer on the stack to point to the object's new
+      // compacted location.
+      slots[i] = vm->heap + forwardingOffset(object);
+    }
+  }
 
-    // Update the pointer on the stack to point to the object's new compacted
-    // location.
-    vm->stack[i] = vm->heap + (object->moveTo - oldHeap);
+  // And the registered roots, the same way.
+  for (size_t i = 0; i < vm->rootCount; i++) {
+    Object** root = vm->roots[i];
+    if (!*root) continue;
+
+    Object* object = ((void*)*root - oldHeap) + vm->heap;
+    *root = vm->heap + forwardingOffset(object);
   }
 }
 
-void compact(VM* vm, void* oldHeap) {
+void compact(VM* vm, void* oldNext) {
   void* from = vm->heap;
 
-  while (from < vm->next) {
+  while (from < oldNext) {
     Object* object = (Object*)from;
-    if (object->moveTo) {
-      // Move the object from its old location to its new location relative to
-      // the heap's (possibly new) location.
-      Object* to = vm->heap + (object->moveTo - oldHeap);
+    if (isMarked(object)) {
+      // Move the object from its old location to its new location. The
+      // forwarding offset is relative to the start of the heap, so it is still
+      // valid if the heap itself moved.
+      Object* to = vm->heap + forwardingOffset(object);
       memmove(to, object, sizeof(Object));
 
-      // Clear the mark.
-      to->moveTo = NULL;
+      // Clear the mark and forwarding offset, and age the object.
+      int age = objectAge(to);
+      if (age < HEADER_AGE_MAX) age++;
+      to->header = (to->header & HEADER_TYPE_MASK) |
+                   ((uint64_t)age << HEADER_AGE_SHIFT);
+    }
+
+    from += sizeof(Object);
+  }
+}
+
+// Rebases every reference into the compacted heap after realloc() has moved it
+// away from [oldHeap].
+void relocatePointers(VM* vm, void* oldHeap) {
+  void* from = vm->heap;
+  while (from < vm->next) {
+    Object* object = (Object*)from;
+    if (objectType(object) == OBJ_PAIR) {
+      object->head = ((void*)object->head - oldHeap) + vm->heap;
+      object->tail = ((void*)object->tail - oldHeap) + vm->heap;
     }
 
     from += sizeof(Object);
   }
+
+  for (size_t segment = 0; segment < usedSegments(vm); segment++) {
+    Object** slots = vm->segments[segment]->slots;
+    size_t count = segmentSlots(vm, segment);
+    for (size_t i = 0; i < count; i++) {
+      slots[i] = ((void*)slots[i] - oldHeap) + vm->heap;
+    }
+  }
+
+  for (size_t i = 0; i < vm->rootCount; i++) {
+    Object** root = vm->roots[i];
+    if (*root) *root = ((void*)*root - oldHeap) + vm->heap;
+  }
+}
+
+// Where a survivor will be once compaction is done, relative to the heap's
+// current address.
+static void* compactedAddress(void* object, void* data) {
+  VM* vm = (VM*)data;
+  Object* survivor = (Object*)object;
+  return isMarked(survivor) ? vm->heap + forwardingOffset(survivor) : NULL;
+}
+
+// Where an object is after the heap moves from [moved][0] to [moved][1].
+static void* relocatedAddress(void* object, void* data) {
+  void** moved = (void**)data;
+  return (object - moved[0]) + moved[1];
+}
+
+static int isSurvivor(void* object) {
+  return isMarked((Object*)object);
+}
+
+// Returns the size to make the heap after a collection that left [liveSize]
+// bytes live, when [vm] is watching memory pressure. The headroom shrinks
+// under pressure, so collections come sooner, and grows when memory is
+// ample. The heap doesn't grow by more than the cgroup has left either,
+// unless the live objects and [additionalSize] need it.
+static size_t pressureHeapSize(VM* vm, size_t liveSize,
+                               size_t additionalSize) {
+  gcPressureRead(vm->pressure, gcNow());
+  double headroom = gcPressureHeadroom(vm->pressure, vm->headroom);
+  size_t heapSize = liveSize * headroom + additionalSize;
+
+  size_t oldSize = vm->end - vm->heap;
+  uint64_t room = gcPressureRoom(vm->pressure);
+  if (heapSize > oldSize && heapSize - oldSize > room) {
+    heapSize = oldSize + room;
+    if (heapSize < liveSize + additionalSize) {
+      heapSize = liveSize + additionalSize;
+    }
+  }
+
+  return heapSize;
+}
+
+// Returns the most bytes the heap can grow to: the hard limit, less the
+// reserve unless it's open.
+static inline size_t hardTarget(VM* vm) {
+  if (vm->hardLimit == 0) return SIZE_MAX;
+  if (vm->reserveOpen || vm->hardLimit < HEAP_RESERVE) return vm->hardLimit;
+  return vm->hardLimit - HEAP_RESERVE;
+}
+
+// Caps [heapSize] at the limits after a collection that left [liveSize] bytes
+// live. The soft limit only trims headroom, and never stops [additionalSize]
+// from fitting. The hard limit does, but the live objects always fit.
+static size_t limitHeapSize(VM* vm, size_t heapSize, size_t liveSize,
+                            size_t additionalSize) {
+  if (vm->softLimit != 0) {
+    size_t soft = liveSize + (size_t)(liveSize * SOFT_LIMIT_GROWTH);
+    if (soft < vm->softLimit) soft = vm->softLimit;
+    if (heapSize > soft) heapSize = soft;
+    if (heapSize < liveSize + additionalSize) {
+      heapSize = liveSize + additionalSize;
+    }
+  }
+
+  if (heapSize > hardTarget(vm)) heapSize = hardTarget(vm);
+  if (heapSize < liveSize) heapSize = liveSize;
+  return heapSize;
+}
+
+// Resizes the heap to [heapSize] bytes, keeping what's in it. It may move.
+// Returns zero, and leaves the heap as it was, if it can't be resized.
+static int resizeHeap(VM* vm, size_t heapSize) {
+  void* resized;
+  if (vm->hugePages) {
+    resized = gcPagesResize(vm->heap, vm->end - vm->heap, heapSize);
+  } else {
+    resized = realloc(vm->heap, heapSize);
+  }
+
+  if (!resized) return 0;
+  vm->heap = resized;
+  return 1;
 }
 
 void gc(VM* vm, size_t additionalSize) {
+  GCEvent event;
+  memset(&event, 0, sizeof(event));
+  event.sequence = ++vm->collections;
+  event.kind = GC_KIND_COMPACT;
+  event.startNs = gcNow();
+  event.heapSizeBefore = vm->end - vm->heap;
+  event.usedBytesBefore = vm->next - vm->heap;
+
+  // There's only the one collector, which lisp2.c calls COLLECTOR_LISP2 (0).
+  GC_PROBE3(gc__start, event.sequence, 0, event.usedBytesBefore);
+
+  gcPhaseBegin(&event, GC_PHASE_MARK, vm->counters);
   markAll(vm);
+  gcPhaseEnd(&event, GC_PHASE_MARK, vm->counters);
+
+  if (vm->profile) gcProfileCollect(vm->profile, isSurvivor);
+
+  gcCensusReset(&vm->census, vm->next - vm->heap);
+  gcPhaseBegin(&event, GC_PHASE_CALCULATE, vm->counters);
   size_t liveSize = calculateNewLocations(vm);
+  gcPhaseEnd(&event, GC_PHASE_CALCULATE, vm->counters);
+  if (vm->trace) gcTraceRemap(vm->trace, compactedAddress, vm);
+  size_t usedSize = vm->next - vm->heap;
+
+  // Close the reserve once there's room for it again.
+  if (vm->reserveOpen && liveSize + 2 * HEAP_RESERVE <= vm->hardLimit) {
+    vm->reserveOpen = 0;
+  }
 
   // Grow the heap to ensure we have enough headroom.
-  size_t heapSize = liveSize * HEAP_HEADROOM + additionalSize;
+  size_t heapSize = liveSize * vm->headroom + additionalSize;
+  if (vm->pressure) heapSize = pressureHeapSize(vm, liveSize, additionalSize);
+  heapSize = limitHeapSize(vm, heapSize, liveSize, additionalSize);
   if (heapSize < HEAP_MIN) heapSize = HEAP_MIN;
 
+  // Live objects may still be anywhere in the used part of the heap until
+  // compaction is done, so don't shrink past that yet. If the heap can't be
+  // resized, keep it as it is and let the allocation that needed the room
+  // fail.
   void* oldHeap = vm->heap;
-  vm->heap = realloc(vm->heap, heapSize);
-  vm->end = vm->heap + heapSize;
+  if (heapSize > usedSize && !resizeHeap(vm, heapSize)) {
+    heapSize = event.heapSizeBefore;
+  }
+
+  gcPhaseBegin(&event, GC_PHASE_UPDATE, vm->counters);
+  updateAllObjectPointers(vm, oldHeap, vm->heap + usedSize);
+  gcPhaseEnd(&event, GC_PHASE_UPDATE, vm->counters);
+
+  gcPhaseBegin(&event, GC_PHASE_COMPACT, vm->counters);
+  compact(vm, vm->heap + usedSize);
+  gcPhaseEnd(&event, GC_PHASE_COMPACT, vm->counters);
+
   vm->next = vm->heap + liveSize;
 
-  updateAllObjectPointers(vm, oldHeap);
-  compact(vm, oldHeap);
+  // Now that everything is compacted, it's safe to shrink. That may move the
+  // heap again, in which case the references have to follow it.
+  if (heapSize <= usedSize) {
+    void* compactedHeap = vm->heap;
+    if (!resizeHeap(vm, heapSize)) heapSize = event.heapSizeBefore;
+    vm->next = vm->heap + liveSize;
+    if (vm->heap != compactedHeap) relocatePointers(vm, compactedHeap);
+  }
+
+  vm->end = vm->heap + heapSize;
+  if (vm->trace && vm->heap != oldHeap) {
+    void* moved[] = { oldHeap, vm->heap };
+    gcTraceRemap(vm->trace, relocatedAddress, moved);
+  }
+  if (heapSize != event.heapSizeBefore) {
+    GC_PROBE2(heap__resize, event.heapSizeBefore, heapSize);
+  }
+
+  event.endNs = gcNow();
+  gcStatsRecordCollection(&vm->stats, event.endNs - event.startNs, liveSize,
+                          heapSize, usedSize - vm->liveSize);
+  vm->liveSize = liveSize;
+  gcTimelineRecord(&vm->pauses, event.startNs, event.endNs);
+
+  event.heapSizeAfter = heapSize;
+  event.liveBytes = liveSize;
+  event.freedBytes = usedSize - liveSize;
+  event.objectsBefore = usedSize / sizeof(Object);
+  event.liveObjects = liveSize / sizeof(Object);
+  event.freedObjects = event.objectsBefore - event.liveObjects;
+  gcPredictorRecord(&vm->predictor, &event);
+  gcLogPush(&vm->events, &event);
+
+  GC_PROBE4(gc__end, event.sequence, event.liveBytes, event.freedBytes,
+            event.endNs - event.startNs);
+}
+
+// Tells the VM that the mutator is idle until [deadlineNs], a time from
+// gcNow(). If enough of the heap has been used since the last collection and
+// the next one is predicted to finish by then, collects now. Returns what it
+// did.
+GCIdleAction vmIdleNotification(VM* vm, uint64_t deadlineNs) {
+  uint64_t now = gcNow();
+  if (deadlineNs <= now) return GC_IDLE_NONE;
+
+  size_t usedBytes = vm->next - vm->heap;
+  if (!gcIdleShouldCollect(vm->liveSize, usedBytes, vm->end - vm->heap)) {
+    return GC_IDLE_NONE;
+  }
+
+  if (gcPredictPause(&vm->predictor, GC_KIND_COMPACT, vm->liveSize,
+                     usedBytes) > deadlineNs - now) {
+    return GC_IDLE_NONE;
+  }
+
+  gc(vm, 0);
+  return GC_IDLE_FULL;
+}
+
+void getGCStats(VM* vm, GCStats* stats) {
+  *stats = vm->stats;
+
+  // Everything past what survived the last collection was allocated since.
+  stats->bytesAllocated += (vm->next - vm->heap) - vm->liveSize;
+}
+
+double getGCMMU(VM* vm, uint64_t windowNs) {
+  return gcTimelineMMU(&vm->pauses, windowNs, gcNow());
+}
+
+void writeGCReport(VM* vm, FILE* file) {
+  gcWriteReport(file, &vm->pauses, &vm->stats, gcNow());
+}
+
+void getGCCensus(VM* vm, GCCensus* census) {
+  *census = vm->census;
+}
+
+void writeGCCensus(VM* vm, FILE* file) {
+  static const char* typeNames[] = { "int", "pair" };
+  gcCensusWriteJSON(file, &vm->census, typeNames, 2);
+}
+
+void setGCReportPath(VM* vm, const char* path) {
+  vm->reportPath = path;
+}
+
+// Starts capturing hardware counters around each phase. Returns the bitmask of
+// available GCCounters, or zero if there are none.
+uint32_t enableGCCounters(VM* vm) {
+  if (vm->counters) return vm->counters->available;
+
+  GCPerfCounters* counters = malloc(sizeof(GCPerfCounters));
+  if (gcPerfOpen(counters) == 0) {
+    free(counters);
+    return 0;
+  }
+
+  vm->counters = counters;
+  return counters->available;
+}
+
+// Starts sizing the heap with the memory limit and pressure of the cgroup in
+// [cgroupDir], or the process's own cgroup if it's NULL, with stalls read
+// from [stallPath] or the default PSI file if it's NULL. See gcPressureInit().
+// Returns zero, and leaves the heap sized as before, if none of the files
+// can be read.
+int enableMemoryPressure(VM* vm, const char* cgroupDir,
+                         const char* stallPath) {
+  GCPressure* pressure = malloc(sizeof(GCPressure));
+  if (!gcPressureInit(pressure, cgroupDir, stallPath)) {
+    free(pressure);
+    return 0;
+  }
 
-  printf("%ld live bytes after collection. Heap size %ld.\n",
-         vm->next - vm->heap, vm->end - vm->heap);
+  free(vm->pressure);
+  vm->pressure = pressure;
+  return 1;
 }
 
-Object* newObject(VM* vm, ObjectType type) {
-  if (vm->next + sizeof(Object) > vm->end) gc(vm, sizeof(Object));
+// Moves [vm]'s heap to memory that's aligned to 2MB and backed by transparent
+// huge pages where the kernel allows it, and keeps it there as it grows and
+// shrinks. Growing remaps the heap in place when the address space after it
+// is free, instead of copying it. Must be called before anything is
+// allocated. Returns zero if something already has been, or the memory can't
+// be mapped, and leaves the heap as it was.
+int enableHugePages(VM* vm) {
+  if (vm->hugePages) return 1;
+  if (vm->next != vm->heap) return 0;
+
+  size_t heapSize = vm->end - vm->heap;
+  void* heap = gcPagesMap(heapSize);
+  if (!heap) return 0;
+
+  free(vm->heap);
+  vm->heap = heap;
+  vm->end = vm->heap + heapSize;
+  vm->next = vm->heap;
+  vm->hugePages = 1;
+  return 1;
+}
+
+// Starts sampling about one allocation every [interval] bytes, attributed to
+// the native stack if [captureStacks] is non-zero, or else to the last site
+// passed to setAllocationSite().
+void startAllocationProfile(VM* vm, size_t interval, int captureStacks) {
+  if (!vm->profile) vm->profile = malloc(sizeof(GCProfile));
+  else gcProfileFree(vm->profile);
+
+  gcProfileInit(vm->profile, interval, captureStacks);
+}
+
+void setAllocationSite(VM* vm, uint64_t site) {
+  if (vm->profile) vm->profile->currentSite = site;
+}
+
+void writeAllocationProfile(VM* vm, FILE* file, GCProfileMetric metric) {
+  if (vm->profile) gcProfileWrite(vm->profile, file, metric);
+}
+
+// Writes every object reachable from the stack to [file] in the format
+// described in gcsnapshot.h. Objects are marked while they're being walked, so
+// this can't be called during a collection.
+void writeHeapSnapshot(VM* vm, FILE* file) {
+  static const char* typeNames[] = { "int", "pair" };
+
+  // The stack, then the registered roots that point to something.
+  Object** roots = malloc((vm->stackSize + vm->rootCount + 1) *
+                          sizeof(Object*));
+  size_t rootCount = 0;
+  for (size_t i = 0; i < vm->stackSize; i++) {
+    roots[rootCount++] = getStack(vm, i);
+  }
+  for (size_t i = 0; i < vm->rootCount; i++) {
+    if (*vm->roots[i]) roots[rootCount++] = *vm->roots[i];
+  }
+
+  uint64_t* addresses = malloc((rootCount + 1) * sizeof(uint64_t));
+  for (size_t i = 0; i < rootCount; i++) {
+    addresses[i] = (uint64_t)(uintptr_t)roots[i];
+  }
+  gcSnapshotWriteHeader(file, typeNames, 2, addresses, rootCount);
+  free(addresses);
+
+  // Every live object fits in the used part of the heap, so that bounds the
+  // worklist.
+  size_t count = 0;
+  Object** reached = malloc((vm->next - vm->heap) + sizeof(Object*));
+
+  for (size_t i = 0; i < rootCount; i++) {
+    Object* root = roots[i];
+    if (isMarked(root)) continue;
+    root->header |= HEADER_MARK_BIT;
+    reached[count++] = root;
+  }
+
+  for (size_t written = 0; written < count; written++) {
+    Object* object = reached[written];
+    uint64_t edges[2];
+
+    GCSnapshotObject record;
+    record.address = (uint64_t)(uintptr_t)object;
+    record.type = objectType(object);
+    record.size = sizeof(Object);
+    record.edgeCount = 0;
+    record.edges = edges;
+
+    if (objectType(object) == OBJ_PAIR) {
+      Object* fields[] = { object->head, object->tail };
+      for (int i = 0; i < 2; i++) {
+        edges[record.edgeCount++] = (uint64_t)(uintptr_t)fields[i];
+        if (isMarked(fields[i])) continue;
+        fields[i]->header |= HEADER_MARK_BIT;
+        reached[count++] = fields[i];
+      }
+    }
+
+    gcSnapshotWriteObject(file, &record);
+  }
+
+  for (size_t i = 0; i < count; i++) reached[i]->header &= ~HEADER_MARK_BIT;
+  free(reached);
+  free(roots);
+}
+
+// Limits how big the heap can grow. Zero means no limit.
+//
+// The heap is never grown past [softLimit], so collections come sooner, unless
+// the live objects and the allocation that triggered the collection need it.
+// Past that, it only gets SOFT_LIMIT_GROWTH of the live bytes as headroom.
+//
+// The heap never grows past [hardLimit] less HEAP_RESERVE, and an allocation
+// that doesn't fit then fails and returns NULL, as does one that fails
+// because the heap couldn't be grown. The first failure at the hard limit
+// opens up the reserve, so that the code handling the failure can still
+// allocate, until a collection frees enough to close it again.
+void setHeapLimits(VM* vm, size_t softLimit, size_t hardLimit) {
+  vm->softLimit = softLimit;
+  vm->hardLimit = hardLimit;
+  vm->reserveOpen = 0;
+}
+
+// Has [handler] called whenever an allocation fails, with the size that
+// didn't fit, before NULL is returned.
+void setOutOfMemoryHandler(VM* vm, void (*handler)(VM* vm, size_t size)) {
+  vm->outOfMemory = handler;
+}
+
+// Opens the reserve, if there's a hard limit, and calls the out of memory
+// handler. Returns NULL for the allocation to return.
+static Object* allocationFailed(VM* vm, size_t size) {
+  if (vm->hardLimit != 0) vm->reserveOpen = 1;
+  if (vm->outOfMemory) vm->outOfMemory(vm, size);
+  return NULL;
+}
+
+// The slow path of newObject(), for when the heap is full, or allocations are
+// being sampled or traced. It's kept out of line so the fast path stays small
+// enough to inline everywhere.
+__attribute__((noinline, cold))
+Object* newObjectSlow(VM* vm, ObjectType type) {
+  if (vm->next + sizeof(Object) > vm->end) {
+    GC_PROBE2(alloc__slow, type, sizeof(Object));
+    gc(vm, sizeof(Object));
+    if (vm->next + sizeof(Object) > vm->end) {
+      return allocationFailed(vm, sizeof(Object));
+    }
+  }
 
   Object* object = (Object*)vm->next;
   vm->next += sizeof(Object);
 
-  object->type = type;
-  object->moveTo = NULL;
+  object->header = (uint64_t)type << HEADER_TYPE_SHIFT;
 
+  if (vm->profile && gcProfileCount(vm->profile, sizeof(Object))) {
+    gcProfileSample(vm->profile, object, sizeof(Object));
+  }
+  if (vm->trace && !vm->trace->replaying) gcTraceNew(vm->trace, object, type);
+
+  return object;
+}
+
+// Creates a new object, or returns NULL if the heap can't make room for it.
+// This is the fast path: it only bumps [next], and leaves everything else to
+// newObjectSlow().
+static inline Object* newObject(VM* vm, ObjectType type) {
+  void* next = vm->next;
+  if (__builtin_expect(next + sizeof(Object) > vm->end ||
+                       vm->profile != NULL || vm->trace != NULL, 0)) {
+    return newObjectSlow(vm, type);
+  }
+
+  vm->next = next + sizeof(Object);
+
+  Object* object = (Object*)next;
+  object->header = (uint64_t)type << HEADER_TYPE_SHIFT;
   return object;
 }
 
-void pushInt(VM* vm, int intValue) {
+// Creates [count] new objects of [type] next to each other in the heap, and
+// returns the first. The heap grows to fit all of them at once, so building a
+// structure out of them needs no more checks. They aren't rooted, and must all
+// be initialized before anything else is allocated. Returns NULL if [count] is
+// zero or more than ALLOC_MANY_MAX, or if they don't fit.
+Object* vmAllocMany(VM* vm, ObjectType type, size_t count) {
+  if (count == 0 || count > ALLOC_MANY_MAX) return NULL;
+  if (type != OBJ_INT && type != OBJ_PAIR) return NULL;
+
+  size_t size = count * sizeof(Object);
+  if (vm->next + size > vm->end) {
+    GC_PROBE2(alloc__slow, type, size);
+    gc(vm, size);
+    if (vm->next + size > vm->end) return allocationFailed(vm, size);
+  }
+
+  Object* first = (Object*)vm->next;
+  vm->next += size;
+  for (size_t i = 0; i < count; i++) {
+    first[i].header = (uint64_t)type << HEADER_TYPE_SHIFT;
+  }
+
+  if (vm->profile && gcProfileCount(vm->profile, size)) {
+    gcProfileSample(vm->profile, first, size);
+  }
+  if (vm->trace && !vm->trace->replaying) {
+    gcTraceNewMany(vm->trace, first, type, count, sizeof(Object));
+  }
+
+  return first;
+}
+
+// These return the object they push, or NULL, leaving the stack alone, if
+// there's no room for it.
+Object* pushInt(VM* vm, int intValue) {
   Object* object = newObject(vm, OBJ_INT);
+  if (!object) return NULL;
   object->value = intValue;
+  if (vm->trace && !vm->trace->replaying) {
+    gcTraceInt(vm->trace, object, (uint32_t)intValue);
+  }
 
   push(vm, object);
+  return object;
 }
 
 Object* pushPair(VM* vm) {
   Object* object = newObject(vm, OBJ_PAIR);
+  if (!object) return NULL;
   object->tail = pop(vm);
   object->head = pop(vm);
+  if (vm->trace && !vm->trace->replaying) {
+    gcTraceSet(vm->trace, object, 1, object->tail);
+    gcTraceSet(vm->trace, object, 0, object->head);
+  }
 
   push(vm, object);
   return object;
 }
 
+// Starts recording a trace of the mutator's calls to [path]. Must be called
+// before anything is allocated.
+int startTraceRecording(VM* vm, const char* path) {
+  GCTrace* trace = malloc(sizeof(GCTrace));
+  if (!gcTraceRecord(trace, path)) {
+    free(trace);
+    return 0;
+  }
+
+  vm->trace = trace;
+  return 1;
+}
+
+void stopTrace(VM* vm) {
+  if (!vm->trace) return;
+
+  gcTraceClose(vm->trace);
+  free(vm->trace);
+  vm->trace = NULL;
+}
+
+// Stores [value] in [object]'s head if [index] is 0, or its tail if it's 1.
+void setField(VM* vm, Object* object, size_t index, Object* value) {
+  if (index == 0) {
+    object->head = value;
+  } else {
+    object->tail = value;
+  }
+
+  if (vm->trace && !vm->trace->replaying) {
+    gcTraceSet(vm->trace, object, index, value);
+  }
+}
+
+void setStack(VM* vm, size_t slot, Object* value) {
+  *stackSlot(vm, slot) = value;
+  if (vm->trace && !vm->trace->replaying) gcTraceStore(vm->trace, slot, value);
+}
+
+// Pushes a list of the [count] ints in [values], chained through its pairs'
+// heads like the ones pushPair() builds and ending at the int -1. It's built
+// back to front with vmAllocMany(), a chunk at a time. Returns NULL, leaving
+// the stack alone, if the list doesn't fit.
+Object* pushList(VM* vm, const int* values, size_t count) {
+  if (!pushInt(vm, -1)) return NULL;
+  size_t top = vm->stackSize - 1;
+  int tracing = vm->trace && !vm->trace->replaying;
+
+  size_t end = count;
+  while (end > 0) {
+    size_t length = end < ALLOC_MANY_MAX ? end : ALLOC_MANY_MAX;
+    size_t start = end - length;
+
+    // The pairs point at the rest of the list until the ints exist, and stay
+    // rooted while they're allocated, which can move them.
+    Object* pairs = vmAllocMany(vm, OBJ_PAIR, length);
+    if (!pairs) break;
+    Object* rest = getStack(vm, top);
+    for (size_t i = length; i > 0; i--) {
+      Object* pair = &pairs[i - 1];
+      pair->head = i == length ? rest : &pairs[i];
+      pair->tail = rest;
+      if (tracing) {
+        gcTraceSet(vm->trace, pair, 0, pair->head);
+        gcTraceSet(vm->trace, pair, 1, pair->tail);
+      }
+    }
+    push(vm, pairs);
+
+    Object* ints = vmAllocMany(vm, OBJ_INT, length);
+    if (!ints) break;
+    Object* pair = getStack(vm, vm->stackSize - 1);
+    for (size_t i = 0; i < length; i++) {
+      ints[i].value = values[start + i];
+      pair->tail = &ints[i];
+      if (tracing) {
+        gcTraceInt(vm->trace, &ints[i], (uint32_t)ints[i].value);
+        gcTraceSet(vm->trace, pair, 1, pair->tail);
+      }
+      pair = pair->head;
+    }
+
+    setStack(vm, top, pop(vm));
+    end = start;
+  }
+
+  // If a chunk didn't fit, drop what's been built so far.
+  if (end > 0) {
+    while (vm->stackSize > top) pop(vm);
+    return NULL;
+  }
+  return getStack(vm, top);
+}
+
+// Replays the trace at [path] on a new [vm]. Returns the number of ops
+// replayed, or -1 if the trace can't be read or uses arrays, which this VM
+// doesn't have.
+long replayTrace(VM* vm, const char* path) {
+  GCTrace* trace = malloc(sizeof(GCTrace));
+  if (!gcTraceReplay(trace, path)) {
+    free(trace);
+    return -1;
+  }
+  vm->trace = trace;
+
+  long ops = 0;
+  GCTraceRecord record;
+  while (ops >= 0 && gcTraceNext(trace, &record)) {
+    Object* object = gcTraceObject(trace, record.object);
+    Object* value = gcTraceObject(trace, record.value);
+
+    switch (record.op) {
+      case GC_TRACE_NEW:
+        if (record.type != OBJ_INT && record.type != OBJ_PAIR) {
+          ops = -1;
+          continue;
+        }
+        object = newObject(vm, (ObjectType)record.type);
+        if (!object) {
+          ops = -1;
+          continue;
+        }
+        object->head = NULL;
+        object->tail = NULL;
+        gcTraceAllocated(trace, object);
+        break;
+
+      case GC_TRACE_NEW_MANY:
+        object = vmAllocMany(vm, (ObjectType)record.type, record.length);
+        if (!object) {
+          ops = -1;
+          continue;
+        }
+        for (uint64_t i = 0; i < record.length; i++) {
+          object[i].head = NULL;
+          object[i].tail = NULL;
+          gcTraceAllocated(trace, &object[i]);
+        }
+        break;
+
+      case GC_TRACE_PUSH:
+        if (!value) ops = -1;
+        else push(vm, value);
+        break;
+
+      case GC_TRACE_POP:
+        if (vm->stackSize == 0) ops = -1;
+        else pop(vm);
+        break;
+
+      case GC_TRACE_SET:
+        if (!object || !value) ops = -1;
+        else setField(vm, object, record.field, value);
+        break;
+
+      case GC_TRACE_INT:
+        if (!object) ops = -1;
+        else object->value = (int)record.value;
+        break;
+
+      case GC_TRACE_STORE:
+        if (!value || record.field >= (uint64_t)vm->stackSize) ops = -1;
+        else setStack(vm, (size_t)record.field, value);
+        break;
+
+      default:
+        ops = -1;
+        continue;
+    }
+
+    if (ops >= 0) ops++;
+  }
+
+  stopTrace(vm);
+  return ops;
+}
+
 void objectPrint(Object* object) {
-  switch (object->type) {
+  switch (objectType(object)) {
     case OBJ_INT:
       printf("%d", object->value);
       break;
@@ -256,7 +1229,32 @@ void objectPrint(Object* object) {
 }
 
 void freeVM(VM *vm) {
-  free(vm->heap);
+  if (vm->reportPath) {
+    FILE* file = fopen(vm->reportPath, "w");
+    if (file) {
+      writeGCReport(vm, file);
+      fclose(file);
+    }
+  }
+
+  gcTimelineFree(&vm->pauses);
+  gcLogStopWriter(&vm->events);
+  if (vm->counters) {
+    gcPerfClose(vm->counters);
+    free(vm->counters);
+  }
+  if (vm->profile) {
+    gcProfileFree(vm->profile);
+    free(vm->profile);
+  }
+  stopTrace(vm);
+  free(vm->pressure);
+  for (size_t i = 0; i < vm->segmentCount; i++) free(vm->segments[i]);
+  free(vm->segments);
+  free(vm->roots);
+  free(vm->grey);
+  if (vm->hugePages) gcPagesUnmap(vm->heap, vm->end - vm->heap);
+  else free(vm->heap);
   free(vm);
 }
 
@@ -305,41 +1303,404 @@ void test4() {
   VM* vm = newVM();
   pushInt(vm, 1);
   pushInt(vm, 2);
-  Object* a = pushPair(vm);
+  pushPair(vm);
   pushInt(vm, 3);
   pushInt(vm, 4);
   Object* b = pushPair(vm);
 
-  a->tail = b;
-  b->tail = a;
+  // Allocating [b] may have moved the heap, so find [a] again from the stack.
+  Object* a = getStack(vm, 0);
+  setField(vm, a, 1, b);
+  setField(vm, b, 1, a);
 
   gc(vm, 0);
   assertLive(vm, 4);
   freeVM(vm);
 }
 
-void perfTest() {
-  printf("Performance Test.\n");
+void test5() {
+  printf("Test 5: Handles survive stack growth and heap moves.\n");
   VM* vm = newVM();
 
-  for (int i = 0; i < 100000; i++) {
-    for (int j = 0; j < 20; j++) {
-      pushInt(vm, i);
+  HandleScope outer = openHandleScope(vm);
+  pushInt(vm, 42);
+  Handle answer = newHandle(vm, pop(vm));
+
+  // Enough roots to take many segments, and to grow the heap many times.
+  HandleScope inner = openHandleScope(vm);
+  int roots = 40 * STACK_SEGMENT_SIZE;
+  for (int i = 0; i < roots; i++) pushInt(vm, i);
+
+  for (int i = 0; i < roots; i++) {
+    assert(getStack(vm, i + 1)->value == i, "Root was not preserved.");
+  }
+  assert((*answer)->value == 42, "Handle was not updated.");
+
+  closeHandleScope(vm, inner);
+  gc(vm, 0);
+  assertLive(vm, 1);
+
+  closeHandleScope(vm, outer);
+  gc(vm, 0);
+  assertLive(vm, 0);
+  freeVM(vm);
+}
+
+void test6() {
+  printf("Test 6: Registered roots are kept alive and updated.\n");
+  VM* vm = newVM();
+  Object* global = NULL;
+  vmAddRoot(vm, &global);
+
+  pushInt(vm, -1);
+  pop(vm);
+  pushInt(vm, 1);
+  pushInt(vm, 2);
+  global = pushPair(vm);
+  pop(vm);
+
+  gc(vm, 0);
+  assertLive(vm, 3);
+  assert(global->head->value == 1 && global->tail->value == 2,
+         "Registered root was not updated.");
+
+  vmRemoveRoot(vm, &global);
+  gc(vm, 0);
+  assertLive(vm, 0);
+  freeVM(vm);
+}
+
+// Returns whether [list] holds the [count] ints in [values], in order, and
+// then ends at the int -1.
+static int isPushedList(Object* list, const int* values, size_t count) {
+  for (size_t i = 0; i < count; i++, list = list->head) {
+    if (objectType(list) != OBJ_PAIR || list->tail->value != values[i]) {
+      return 0;
     }
+  }
+  return objectType(list) == OBJ_INT && list->value == -1;
+}
+
+void test7() {
+  printf("Test 7: Lists built with bulk allocation survive collection.\n");
+  int values[5000];
+  for (int i = 0; i < 5000; i++) values[i] = i * 7 - 3;
+
+  VM* vm = newVM();
+  assert(vmAllocMany(vm, OBJ_INT, 0) == NULL &&
+         vmAllocMany(vm, OBJ_INT, ALLOC_MANY_MAX + 1) == NULL,
+         "Allocated an unsupported number of objects.");
+
+  Object* list = pushList(vm, values, 5000);
+  assert(isPushedList(list, values, 5000), "Built the wrong list.");
+  assert(vm->collections > 0, "Building the list did not grow the heap.");
+
+  gc(vm, 0);
+  assertLive(vm, 2 * 5000 + 1);
+  assert(isPushedList(getStack(vm, 0), values, 5000),
+         "Collection broke the list.");
+  freeVM(vm);
+}
 
-    for (int k = 0; k < 20; k++) {
+void test8() {
+  printf("Test 8: Idle notifications collect when there's time.\n");
+  VM* vm = newVM();
+  pushInt(vm, -1);
+  for (int i = 0; i < 1000; i++) {
+    pushInt(vm, i);
+    pushPair(vm);
+  }
+  gc(vm, 0);
+
+  // Use up three quarters of the room the collection left.
+  size_t count = (vm->end - vm->heap - vm->liveSize) * 3 / 4 / sizeof(Object);
+  for (size_t i = 0; i < count; i++) {
+    pushInt(vm, (int)i);
+    pop(vm);
+  }
+
+  uint64_t collections = vm->collections;
+  assert(vmIdleNotification(vm, gcNow()) == GC_IDLE_NONE &&
+         vm->collections == collections,
+         "Collected after the deadline.");
+  assert(vmIdleNotification(vm, gcNow() + 1000000000) == GC_IDLE_FULL &&
+         vm->collections == collections + 1,
+         "Did not collect while idle.");
+  assert(vmIdleNotification(vm, gcNow() + 1000000000) == GC_IDLE_NONE,
+         "Collected an empty heap while idle.");
+  assertLive(vm, 2 * 1000 + 1);
+  freeVM(vm);
+}
+
+// Writes [text] to the file [name] in [dir].
+static void writeFakeFile(const char* dir, const char* name, const char* text) {
+  char path[256];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  FILE* file = fopen(path, "w");
+  fputs(text, file);
+  fclose(file);
+}
+
+// Writes a fake cgroup's memory files to [dir].
+static void writeFakeCgroup(const char* dir, const char* max,
+                            const char* current, const char* stall) {
+  char pressure[128];
+  snprintf(pressure, sizeof(pressure),
+           "some avg10=%s avg60=0.00 avg300=0.00 total=0\n"
+           "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n", stall);
+  writeFakeFile(dir, "memory.max", max);
+  writeFakeFile(dir, "memory.current", current);
+  writeFakeFile(dir, "memory.pressure", pressure);
+}
+
+// Collects with a fresh reading of the cgroup's files, and returns the size
+// the heap ends up.
+static size_t heapSizeAfterGC(VM* vm) {
+  vm->pressure->readNs = 0;
+  gc(vm, 0);
+  return vm->end - vm->heap;
+}
+
+void test9() {
+  printf("Test 9: Memory pressure adjusts the heap's headroom.\n");
+  char dir[] = "/tmp/lisp2-cgroup-XXXXXX";
+  assert(mkdtemp(dir) != NULL, "Could not create a fake cgroup.");
+
+  VM* vm = newVM();
+  assert(!enableMemoryPressure(vm, "/nonexistent", "/nonexistent"),
+         "Enabled memory pressure without any files.");
+
+  writeFakeCgroup(dir, "100000000\n", "10000000\n", "0.00");
+
+  // Extra slashes still name the same directory, but leave no room for the
+  // file names after it.
+  char longDir[GC_PRESSURE_PATH_MAX - 4];
+  memset(longDir, '/', sizeof(longDir) - 1);
+  memcpy(longDir, dir, strlen(dir));
+  longDir[sizeof(longDir) - 1] = '\0';
+  assert(!enableMemoryPressure(vm, longDir, NULL),
+         "Enabled memory pressure with a truncated path.");
+
+  assert(enableMemoryPressure(vm, dir, NULL),
+         "Could not read the fake cgroup.");
+
+  pushInt(vm, -1);
+  for (int i = 0; i < 1000; i++) {
+    pushInt(vm, i);
+    pushPair(vm);
+  }
+  size_t live = (2 * 1000 + 1) * sizeof(Object);
+
+  assert(heapSizeAfterGC(vm) == live * 2,
+         "Did not relax the headroom with ample memory.");
+
+  writeFakeCgroup(dir, "100000000\n", "95000000\n", "0.00");
+  assert(heapSizeAfterGC(vm) == live * 9 / 8,
+         "Did not shrink the headroom near the limit.");
+
+  writeFakeCgroup(dir, "100000000\n", "10000000\n", "20.00");
+  assert(heapSizeAfterGC(vm) == live * 9 / 8,
+         "Did not shrink the headroom while stalling.");
+
+  writeFakeCgroup(dir, "max\n", "10000000\n", "2.00");
+  assert(heapSizeAfterGC(vm) == live * 5 / 4,
+         "Did not shrink the headroom under moderate pressure.");
+
+  writeFakeCgroup(dir, "max\n", "10000000\n", "0.00");
+  assert(heapSizeAfterGC(vm) == live * 3 / 2,
+         "Changed the headroom without a limit or pressure.");
+
+  // The heap can't grow past what the cgroup has left.
+  size_t before = vm->end - vm->heap;
+  vm->headroom = 100;
+  writeFakeCgroup(dir, "1000000\n", "800000\n", "0.00");
+  assert(heapSizeAfterGC(vm) == before + 200000,
+         "Grew the heap past the cgroup's limit.");
+  assertLive(vm, 2 * 1000 + 1);
+
+  freeVM(vm);
+  const char* names[] = { "memory.max", "memory.current", "memory.pressure" };
+  for (int i = 0; i < 3; i++) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+    unlink(path);
+  }
+  rmdir(dir);
+}
+
+static int outOfMemoryCalls = 0;
+
+static void countOutOfMemory(VM* vm, size_t size) {
+  outOfMemoryCalls++;
+}
+
+void test10() {
+  printf("Test 10: Allocation fails gracefully at the hard limit.\n");
+  VM* vm = newVM();
+  setHeapLimits(vm, 0, 100 * 1024);
+  setOutOfMemoryHandler(vm, countOutOfMemory);
+
+  // Grow a list until it doesn't fit.
+  pushInt(vm, -1);
+  int length = 0;
+  while (pushInt(vm, length)) {
+    if (!pushPair(vm)) {
       pop(vm);
+      break;
     }
+    length++;
   }
+  assert(outOfMemoryCalls == 1 && vm->reserveOpen && vm->stackSize == 1,
+         "Did not fail once at the hard limit.");
+  assert(length > 1500 && vm->end - vm->heap <= 100 * 1024,
+         "Grew the heap past the hard limit.");
+
+  // Cleanup code can still allocate in the reserve.
+  for (int i = 0; i < 100; i++) {
+    assert(pushInt(vm, i) != NULL, "Could not allocate in the reserve.");
+  }
+
+  // Dropping the list closes the reserve again.
+  while (vm->stackSize > 0) pop(vm);
+  gc(vm, 0);
+  assert(!vm->reserveOpen && pushList(vm, (int[]){ 1, 2, 3 }, 3) != NULL,
+         "Did not recover after freeing memory.");
+  freeVM(vm);
+
+  // Over the soft limit, the heap gets less headroom.
+  vm = newVM();
+  setHeapLimits(vm, 64 * 1024, 0);
+  pushInt(vm, -1);
+  for (int i = 0; i < 10000; i++) {
+    pushInt(vm, i);
+    pushPair(vm);
+  }
+  gc(vm, 0);
+  assertLive(vm, 2 * 10000 + 1);
+  assert(vm->end - vm->heap == vm->liveSize + vm->liveSize / 4,
+         "Did not trim the headroom over the soft limit.");
+  freeVM(vm);
+}
+
+void test11() {
+  printf("Test 11: A huge-page heap grows and shrinks.\n");
+  VM* vm = newVM();
+  assert(enableHugePages(vm), "Could not map the heap in huge pages.");
+
+  // Enough to take up several huge pages.
+  for (int i = 0; i < 300000; i++) pushInt(vm, i);
+  gc(vm, 0);
+  assertLive(vm, 300000);
+  assert((uintptr_t)vm->heap % GC_HUGE_PAGE_SIZE == 0 &&
+         vm->end - vm->heap > 3 * GC_HUGE_PAGE_SIZE,
+         "Did not grow the heap in huge pages.");
+
+  long sum = 0;
+  for (int i = 0; i < 300000; i++) sum += getStack(vm, i)->value;
+  assert(sum == 300000L * 299999 / 2, "Lost objects growing the heap.");
+
+  // Dropping them shrinks it again.
+  while (vm->stackSize > 1) pop(vm);
+  gc(vm, 0);
+  assertLive(vm, 1);
+  assert((uintptr_t)vm->heap % GC_HUGE_PAGE_SIZE == 0 &&
+         vm->end - vm->heap < GC_HUGE_PAGE_SIZE &&
+         getStack(vm, 0)->value == 0,
+         "Did not shrink the heap in huge pages.");
+  freeVM(vm);
+
+  // It's too late once something has been allocated.
+  vm = newVM();
+  pushInt(vm, 1);
+  assert(!enableHugePages(vm), "Moved a heap that had objects in it.");
+  freeVM(vm);
+}
+
+void test12() {
+  printf("Test 12: Long lists don't overflow the C stack when marked.\n");
+  VM* vm = newVM();
+  int length = 1000000;
+  pushInt(vm, -1);
+  for (int i = 0; i < length; i++) {
+    pushInt(vm, i);
+    pushPair(vm);
+  }
+  gc(vm, 0);
+  assertLive(vm, 2 * (size_t)length + 1);
+
+  long sum = 0;
+  for (Object* node = getStack(vm, 0); objectType(node) == OBJ_PAIR;
+       node = node->head) {
+    sum += node->tail->value;
+  }
+  assert(sum == (long)length * (length - 1) / 2, "Lost part of a long list.");
   freeVM(vm);
 }
 
+#include "gcbench.h"
+
+// The heap is resized to a multiple of the live bytes after each collection,
+// so the multiple is all there is to set.
+static VM* newSizedVM(uint64_t liveBytes, double multiple) {
+  return newVMWithHeadroom(multiple);
+}
+
 int main(int argc, const char * argv[]) {
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    runBenchmarks("lisp2-reallocate", "lisp2", newVM);
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "alloc") == 0) {
+    allocBenchmark("lisp2-reallocate", "lisp2", newVM);
+    listBenchmark("lisp2-reallocate", "lisp2", newVM);
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "idle") == 0) {
+    idleBenchmark("lisp2-reallocate", "lisp2", newVM);
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "huge") == 0) {
+    hugePageBenchmark("lisp2-reallocate", "lisp2", newSizedVM);
+    return 0;
+  }
+
+  if (argc == 4 && strcmp(argv[1], "record") == 0) {
+    if (recordBenchmark(argv[2], argv[3], newVM)) return 0;
+    fprintf(stderr, "Could not record %s to %s.\n", argv[2], argv[3]);
+    return 1;
+  }
+
+  if (argc >= 3 && strcmp(argv[1], "replay") == 0) {
+    if (replayBenchmark("lisp2-reallocate", "lisp2", argv[2], newVM)) return 0;
+    fprintf(stderr, "Could not replay %s.\n", argv[2]);
+    return 1;
+  }
+
+  if (argc == 3 && strcmp(argv[1], "sweep") == 0) {
+    writeSweepHeader();
+    if (sweepBenchmark("lisp2-reallocate", "lisp2", argv[2], newVM,
+                       newSizedVM)) {
+      return 0;
+    }
+    fprintf(stderr, "No benchmark named %s.\n", argv[2]);
+    return 1;
+  }
+
   test1();
   test2();
   test3();
   test4();
-  perfTest();
-  
+  test5();
+  test6();
+  test7();
+  test8();
+  test9();
+  test10();
+  test11();
+  test12();
+
   return 0;
 }
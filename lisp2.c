@@ -1,29 +1,149 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <time.h>
 #include <stdlib.h>
 #include <string.h>
-
-#define STACK_MAX 256
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "gccensus.h"
+#include "gcidle.h"
+#include "gclog.h"
+#include "gcmmu.h"
+#include "gcpages.h"
+#include "gcprobes.h"
+#include "gcprofile.h"
+#include "gcsnapshot.h"
+#include "gcstats.h"
+#include "gctrace.h"
+
+// The stack is made of segments of this many slots. Must be a power of two.
+#define STACK_SEGMENT_SIZE 256
+
+// The size of the heap newVM() and newVMWithCollector() create. A different
+// size can be passed to newVMWithHeapSize().
 #define HEAP_SIZE (1024 * 1024)
 
-// Two kinds of objects are supported: a (boxed) integer, and a pair of
-// references to other objects.
+// Objects at least this many bytes are allocated in the large object space
+// instead of the heap, so that compaction never has to copy them.
+#define LARGE_OBJECT_MIN (16 * 1024)
+
+// How many bytes the large object space can hold before allocating another
+// large object triggers a collection.
+#define LARGE_SPACE_SIZE (16 * 1024 * 1024)
+
+// How many bytes below a VM's hard limit are held back for cleanup code to
+// allocate in once an allocation has failed. See setHeapLimits().
+#define HEAP_RESERVE (16 * 1024)
+
+// Once the live bytes are over a VM's soft limit, the next collection is
+// triggered when this fraction of them again has been allocated.
+#define SOFT_LIMIT_GROWTH 0.25
+
+// If less than this fraction of the used part of the LISP2 heap is garbage,
+// collection sweeps the garbage onto free lists instead of compacting. This
+// only looks at how much garbage there is, not how it's spread out.
+#define GARBAGE_THRESHOLD 0.25
+
+// The number of segregated free lists. Each list holds free cells of a single
+// size, in multiples of 8 bytes, except for the last one which holds all of
+// the cells too big for the others.
+#define FREE_LIST_CLASSES 32
+
+// The mark-region collector divides the heap into blocks, and each block into
+// lines. Objects are allocated into runs of free lines, and liveness is
+// tracked per line, not per object.
+#define LINE_SIZE 256
+#define BLOCK_SIZE (32 * 1024)
+#define LINES_PER_BLOCK (BLOCK_SIZE / LINE_SIZE)
+
+// A block with fewer than this many live lines after a mark-region collection
+// is a candidate for evacuation in the next one.
+#define EVACUATE_THRESHOLD (LINES_PER_BLOCK / 2)
+
+// The most objects vmAllocMany() can allocate at once. Mark-region can only
+// hand out one block's worth of contiguous memory, and the limit is the same
+// for every collector so that traces replay under each of them.
+#define ALLOC_MANY_MAX (BLOCK_SIZE / sizeof(Object))
+
+// Which algorithm a VM uses to collect its heap.
+typedef enum {
+  // Mark-compact. Every collection slides all of the live objects down to the
+  // start of the heap.
+  COLLECTOR_LISP2,
+
+  // Immix-style mark-region. Objects are marked in place and allocation
+  // reuses the free lines between them. Only sparse blocks are evacuated.
+  COLLECTOR_MARK_REGION,
+
+  // Cheney semi-space copying. The heap is split in half, and each collection
+  // copies the live objects from the half in use into the other one. It only
+  // touches live objects, so it wins when most of the heap is garbage.
+  COLLECTOR_SEMISPACE,
+
+  COLLECTOR_COUNT
+} Collector;
+
+// The state of a block in the mark-region heap.
+typedef enum {
+  // Every line is free and nothing has been allocated in it since the last
+  // collection, so it can be used as evacuation space.
+  BLOCK_FREE,
+
+  // Some lines are free and can be allocated into.
+  BLOCK_RECYCLABLE,
+
+  // Every line is in use, or the allocator has claimed the block.
+  BLOCK_FULL,
+
+  // A sparse block whose live objects are being evacuated by the current
+  // collection.
+  BLOCK_EVACUATE
+} BlockState;
+
+// Three kinds of objects are supported: a (boxed) integer, a pair of
+// references to other objects, and a variable-length array of references.
+// Free cells left behind by sweeping aren't real objects, but they have a
+// type so that the heap can still be walked.
 typedef enum {
   OBJ_INT,
-  OBJ_PAIR
+  OBJ_PAIR,
+  OBJ_ARRAY,
+  OBJ_FREE
 } ObjectType;
 
+// The names of each ObjectType, for snapshots and censuses.
+static const char* typeNames[] = { "int", "pair", "array", "free" };
+
+// Every object starts with a single header word that packs together all of
+// the metadata the VM and the collector need:
+//
+//     bit  0     Mark bit. Set while the object is known to be reachable.
+//     bits 1-3   The object's ObjectType.
+//     bits 4-7   Age. The number of collections the object has survived,
+//                saturating at HEADER_AGE_MAX.
+//     bit  8     Forwarded bit. Set when the mark-region or semi-space
+//                collector has copied the object somewhere else.
+//     bits 9-63  Forwarding offset. During collection, this is where the object
+//                will end up after compaction or evacuation, as a byte offset
+//                from the start of the heap. It is zero outside of collection.
+//
+// The header is a fixed 64 bits wide, even on 32-bit hosts, so the forwarding
+// offset can always address a heap of any size we could allocate.
+#define HEADER_MARK_BIT       ((uint64_t)1)
+#define HEADER_TYPE_SHIFT     1
+#define HEADER_TYPE_MASK      ((uint64_t)0x7 << HEADER_TYPE_SHIFT)
+#define HEADER_AGE_SHIFT      4
+#define HEADER_AGE_MASK       ((uint64_t)0xf << HEADER_AGE_SHIFT)
+#define HEADER_AGE_MAX        15
+#define HEADER_FORWARDED_BIT  ((uint64_t)1 << 8)
+#define HEADER_FORWARD_SHIFT  9
+
 // A single object in the VM.
 typedef struct sObject {
-  // The type of this object.
-  ObjectType type;
-
-  // During the sweep phase of garbage collection, this will be non-NULL if the
-  // object was reached, otherwise it will be NULL. Before compaction, this
-  // will store the address that the object will end up at after compaction.
-  // Once garbage collection is done, this is reset to NULL. It is only used
-  // during collection.
-  void* moveTo;
+  // The packed type, mark, age and forwarding state of this object. See above.
+  uint64_t header;
 
   // The type-specific data for the object.
   union {
@@ -35,141 +155,785 @@ typedef struct sObject {
       struct sObject* head;
       struct sObject* tail;
     };
+
+    // OBJ_ARRAY. Elements may be NULL.
+    struct {
+      size_t length;
+      struct sObject* elements[];
+    };
+
+    // OBJ_FREE.
+    struct {
+      size_t cellSize;
+      struct sObject* nextFree;
+    };
   };
 } Object;
 
+// Large objects live in their own page-aligned mappings outside of the heap.
+// Each one is preceded by this header, which links it into the VM's list of
+// large objects.
+typedef struct sLargeObject {
+  struct sLargeObject* next;
+
+  // The size of the whole mapping, including this header.
+  size_t mappedSize;
+} LargeObject;
+
+// Returns the type of [object].
+static inline ObjectType objectType(Object* object) {
+  return (ObjectType)((object->header & HEADER_TYPE_MASK) >> HEADER_TYPE_SHIFT);
+}
+
+// Returns non-zero if [object] has been reached by the current collection.
+static inline int isMarked(Object* object) {
+  return (object->header & HEADER_MARK_BIT) != 0;
+}
+
+// Returns the number of collections [object] has survived.
+static inline int objectAge(Object* object) {
+  return (int)((object->header & HEADER_AGE_MASK) >> HEADER_AGE_SHIFT);
+}
+
+// Returns the number of bytes needed for an array with [length] elements.
+// Arrays are never smaller than the other objects, so every object in the
+// heap is at least sizeof(Object) bytes.
+static inline size_t arraySize(size_t length) {
+  size_t size = offsetof(Object, elements) + length * sizeof(Object*);
+  return size < sizeof(Object) ? sizeof(Object) : size;
+}
+
+// Returns the number of bytes [object] occupies.
+static inline size_t objectSize(Object* object) {
+  switch (objectType(object)) {
+    case OBJ_ARRAY: return arraySize(object->length);
+    case OBJ_FREE: return object->cellSize;
+    default: return sizeof(Object);
+  }
+}
+
+// Returns the byte offset from the start of the heap that [object] will be
+// moved to by compaction.
+static inline size_t forwardingOffset(Object* object) {
+  return (size_t)(object->header >> HEADER_FORWARD_SHIFT);
+}
+
+// Stores [offset] as the forwarding offset of [object], leaving the rest of
+// its header alone.
+static inline void setForwardingOffset(Object* object, size_t offset) {
+  object->header = (object->header & ((1 << HEADER_FORWARD_SHIFT) - 1)) |
+                   ((uint64_t)offset << HEADER_FORWARD_SHIFT);
+}
+
+// A fixed-size piece of the stack. The stack grows by adding segments rather
+// than by reallocating, so a slot never moves while it's in use.
+typedef struct {
+  Object* slots[STACK_SEGMENT_SIZE];
+} StackSegment;
+
+// A slot on the stack that roots an object for native code. Collections update
+// the slot when they move the object, so read the object through the handle
+// after anything that can allocate. See openHandleScope().
+typedef Object** Handle;
+
+// The depth of the stack when a handle scope was opened.
+typedef struct {
+  size_t stackSize;
+} HandleScope;
+
 // A virtual machine with its own virtual stack and heap. All objects live on
 // the heap. The stack just points to them.
-typedef struct {
-  Object* stack[STACK_MAX];
-  int stackSize;
+typedef struct sVM {
+  // The stack's segments, bottom first. Slot [i] is in segment
+  // [i / STACK_SEGMENT_SIZE]. Segments above the top of the stack are kept for
+  // when it grows again.
+  StackSegment** segments;
+  size_t segmentCount;
+  size_t segmentCapacity;
+  size_t stackSize;
+
+  // Slots outside the VM that were registered with vmAddRoot(), in no
+  // particular order. Collections treat each one like a stack slot, except
+  // that it may be NULL.
+  Object*** roots;
+  size_t rootCount;
+  size_t rootCapacity;
 
   // The beginning of the contiguous heap of memory that objects are allocated
   // from.
   void* heap;
 
+  // The number of bytes in [heap], and the number of whole mark-region blocks
+  // in it. A mark-region heap is always a whole number of blocks.
+  size_t heapSize;
+  int heapBlocks;
+
+  // Whether [heap] was mapped by enableHugePages() instead of malloc()ed.
+  int hugePages;
+
   // The beginning of the next chunk of memory to be allocated from the heap.
   void* next;
+
+  // The end of the chunk of memory that [next] bump allocates through. For
+  // LISP2, that's the end of the heap. For mark-region, it's the end of the
+  // current run of free lines. For semi-space, it's the end of the current
+  // half of the heap.
+  void* limit;
+
+  // The start of the part of the heap objects are bump allocated from. This
+  // is the start of the heap, except for semi-space, where it's the start of
+  // the half in use.
+  void* space;
+
+  // The algorithm that collects the heap.
+  Collector collector;
+
+  // Mark-region state. One mark byte per line, and the state of each block.
+  uint8_t* lineMarks;
+  BlockState* blockStates;
+
+  // Where the mark-region allocator will look for the next run of free lines.
+  int holeBlock;
+  int holeLine;
+
+  // The space that evacuated objects are copied into.
+  void* copyNext;
+  void* copyLimit;
+
+  // The objects marked by the current collection. Mark-region uses this to
+  // clear marks without walking the heap, which has holes in it. Semi-space
+  // uses it to scan the large objects it reaches, since they aren't copied.
+  Object** marked;
+  size_t markedCount;
+  size_t markedCapacity;
+
+  // The objects the LISP2 mark phase has marked but not scanned yet. Marking
+  // works through these instead of recursing, so a long list can't overflow
+  // the C stack.
+  Object** grey;
+  size_t greyCount;
+  size_t greyCapacity;
+
+  // The slots the mark-region mark phase has yet to follow. Marking queues the
+  // slots rather than the objects in them, since evacuating an object means
+  // updating the slot that referenced it.
+  Object*** greySlots;
+  size_t greySlotCount;
+  size_t greySlotCapacity;
+
+  // The bytes of heap objects reached by the current LISP2 mark phase.
+  size_t markedBytes;
+
+  // The number of objects, including large ones, reached by the current
+  // collection.
+  size_t markedObjects;
+
+  // An event for each collection, with timings for each of its phases.
+  GCLog events;
+  uint64_t collections;
+
+  // Running totals across all collections. See getGCStats().
+  GCStats stats;
+
+  // What the last collection found in the heap. See getGCCensus().
+  GCCensus census;
+
+  // When every collection paused the VM, for computing minimum mutator
+  // utilization. See getGCMMU().
+  GCTimeline pauses;
+
+  // If not NULL, a report of pause times and MMU is written here when the VM
+  // is freed. See setGCReportPath().
+  const char* reportPath;
+
+  // Hardware counters captured around each phase, or NULL if they aren't
+  // enabled. See enableGCCounters().
+  GCPerfCounters* counters;
+
+  // The allocation profiler, or NULL if allocations aren't being sampled. See
+  // startAllocationProfile().
+  GCProfile* profile;
+
+  // If not NULL, the mutator's calls are being recorded to, or replayed from,
+  // this trace. See startTraceRecording() and replayTrace().
+  GCTrace* trace;
+
+  // The bytes and objects, including large ones, that were live at the end of
+  // the last collection, and that have been allocated since then.
+  size_t liveBytes;
+  size_t liveObjects;
+  size_t allocatedBytes;
+  size_t allocatedObjects;
+
+  // Limits on the bytes in use, including large objects, or zero if there
+  // are none. See setHeapLimits().
+  size_t softLimit;
+  size_t hardLimit;
+
+  // Set when an allocation has failed at the hard limit, which opens up the
+  // reserve below it until a collection frees enough to close it again.
+  int reserveOpen;
+
+  // How many bytes can be allocated after the last collection before the
+  // limits have to be checked. See updateBudget().
+  size_t budget;
+
+  // Called when an allocation fails, just before it returns NULL, or NULL.
+  void (*outOfMemory)(struct sVM* vm, size_t size);
+
+  // When the LISP2 heap is swept instead of compacted, the free cells are put
+  // on these lists by size. See FREE_LIST_CLASSES.
+  Object* freeLists[FREE_LIST_CLASSES];
+
+  // Set to make the next LISP2 collection compact, however little garbage the
+  // heap has.
+  int forceCompact;
+
+  // Set to make the next LISP2 collection sweep instead of compacting, unless
+  // [forceCompact] is also set.
+  int forceSweep;
+
+  // How long past collections took, for vmIdleNotification() to predict the
+  // next one's pause.
+  GCPausePredictor predictor;
+
+  // The objects in the large object space, most recently allocated first.
+  LargeObject* largeObjects;
+
+  // The number of bytes mapped for [largeObjects].
+  size_t largeSize;
 } VM;
 
-void assertLive(VM* vm, long expectedCount) {
-  long actualCount = (vm->next - vm->heap) / sizeof(Object);
+// Returns a pointer to [slot] of the stack, counting from the bottom. Its
+// segment must already have been allocated.
+static inline Object** stackSlot(VM* vm, size_t slot) {
+  return &vm->segments[slot / STACK_SEGMENT_SIZE]
+              ->slots[slot & (STACK_SEGMENT_SIZE - 1)];
+}
+
+// Returns the object in [slot] of the stack, counting from the bottom.
+static inline Object* getStack(VM* vm, size_t slot) {
+  return *stackSlot(vm, slot);
+}
+
+// Returns how many of the slots in [segment] of the stack are in use.
+static inline size_t segmentSlots(VM* vm, size_t segment) {
+  size_t used = vm->stackSize - segment * STACK_SEGMENT_SIZE;
+  return used < STACK_SEGMENT_SIZE ? used : STACK_SEGMENT_SIZE;
+}
+
+// Returns the number of stack segments that have slots in use.
+static inline size_t usedSegments(VM* vm) {
+  return (vm->stackSize + STACK_SEGMENT_SIZE - 1) / STACK_SEGMENT_SIZE;
+}
+
+// Returns non-zero if [object] lives in the heap, as opposed to the large
+// object space.
+static inline int isInHeap(VM* vm, Object* object) {
+  return (void*)object >= vm->heap &&
+         (void*)object < vm->heap + vm->heapSize;
+}
+
+// Returns where [object] will be once compaction is done. Large objects are
+// never moved.
+static inline Object* forwardedAddress(VM* vm, Object* object) {
+  if (!isInHeap(vm, object)) return object;
+  return vm->heap + forwardingOffset(object);
+}
+
+// Returns the large object space header for [object].
+static inline LargeObject* largeObjectOf(Object* object) {
+  return (LargeObject*)object - 1;
+}
+
+void assertLive(VM* vm, size_t expectedCount) {
+  size_t actualCount = 0;
+  if (vm->collector == COLLECTOR_MARK_REGION) {
+    // The mark-region heap has holes of stale bytes in it that can't be
+    // walked, so count the heap objects the last collection reached.
+    for (size_t i = 0; i < vm->markedCount; i++) {
+      if (isInHeap(vm, vm->marked[i])) actualCount++;
+    }
+  } else {
+    // Count the objects between the free cells.
+    void* from = vm->space;
+    while (from < vm->next) {
+      Object* object = (Object*)from;
+      if (objectType(object) != OBJ_FREE) actualCount++;
+      from += objectSize(object);
+    }
+  }
+
   if (actualCount == expectedCount) {
-    printf("PASS: Expected and found %ld live objects.\n", expectedCount);
+    printf("PASS: Expected and found %zu live objects.\n", expectedCount);
   } else {
-    printf("Expected heap to contain %ld objects, but had %ld.\n",
+    printf("Expected heap to contain %zu objects, but had %zu.\n",
            expectedCount, actualCount);
     exit(1);
   }
 }
 
-// Creates a new VM with an empty stack and an empty (but allocated) heap.
-VM* newVM() {
+void assertLargeLive(VM* vm, size_t expectedCount) {
+  size_t actualCount = 0;
+  for (LargeObject* large = vm->largeObjects; large; large = large->next) {
+    actualCount++;
+  }
+
+  if (actualCount == expectedCount) {
+    printf("PASS: Expected and found %zu live large objects.\n",
+           expectedCount);
+  } else {
+    printf("Expected large object space to contain %zu objects, but had %zu.\n",
+           expectedCount, actualCount);
+    exit(1);
+  }
+}
+
+// Creates a new VM with an empty stack and an empty (but allocated) heap of at
+// least [heapSize] bytes, collected by [collector].
+VM* newVMWithHeapSize(Collector collector, size_t heapSize) {
   VM* vm = malloc(sizeof(VM));
+  vm->segments = NULL;
+  vm->segmentCount = 0;
+  vm->segmentCapacity = 0;
   vm->stackSize = 0;
-
-  vm->heap = malloc(HEAP_SIZE);
+  vm->roots = NULL;
+  vm->rootCount = 0;
+  vm->rootCapacity = 0;
+
+  // Round up so the semi-space halves stay aligned, and to whole blocks for
+  // mark-region so there's never a partial one at the end.
+  size_t granule = collector == COLLECTOR_MARK_REGION ? BLOCK_SIZE : 16;
+  vm->heapSize = (heapSize + granule - 1) / granule * granule;
+  if (vm->heapSize == 0) vm->heapSize = granule;
+  vm->heapBlocks = (int)(vm->heapSize / BLOCK_SIZE);
+
+  vm->heap = malloc(vm->heapSize);
+  vm->hugePages = 0;
   vm->next = vm->heap;
+  vm->limit = vm->heap + vm->heapSize;
+  vm->space = vm->heap;
+  vm->collector = collector;
+
+  vm->lineMarks = NULL;
+  vm->blockStates = NULL;
+  vm->holeBlock = 0;
+  vm->holeLine = 0;
+  vm->copyNext = NULL;
+  vm->copyLimit = NULL;
+  vm->marked = NULL;
+  vm->markedCount = 0;
+  vm->markedCapacity = 0;
+  vm->grey = NULL;
+  vm->greyCount = 0;
+  vm->greyCapacity = 0;
+  vm->greySlots = NULL;
+  vm->greySlotCount = 0;
+  vm->greySlotCapacity = 0;
+
+  if (collector == COLLECTOR_MARK_REGION) {
+    vm->lineMarks = calloc((size_t)vm->heapBlocks * LINES_PER_BLOCK, 1);
+    vm->blockStates = malloc(vm->heapBlocks * sizeof(BlockState));
+    for (int i = 0; i < vm->heapBlocks; i++) vm->blockStates[i] = BLOCK_FREE;
+
+    // Start with nothing to bump through so the first allocation finds a run
+    // of free lines.
+    vm->limit = vm->next;
+  }
+
+  if (collector == COLLECTOR_SEMISPACE) {
+    vm->limit = vm->heap + vm->heapSize / 2;
+  }
+
+  vm->markedBytes = 0;
+  vm->markedObjects = 0;
+  for (int i = 0; i < FREE_LIST_CLASSES; i++) vm->freeLists[i] = NULL;
+  vm->forceCompact = 0;
+  vm->forceSweep = 0;
+  gcPredictorInit(&vm->predictor);
+
+  vm->largeObjects = NULL;
+  vm->largeSize = 0;
+
+  gcLogInit(&vm->events);
+  vm->collections = 0;
+  gcStatsInit(&vm->stats);
+  gcCensusReset(&vm->census, vm->heapSize);
+  gcTimelineInit(&vm->pauses, gcNow());
+  vm->reportPath = NULL;
+  vm->counters = NULL;
+  vm->profile = NULL;
+  vm->trace = NULL;
+  vm->liveBytes = 0;
+  vm->liveObjects = 0;
+  vm->allocatedBytes = 0;
+  vm->allocatedObjects = 0;
+  vm->softLimit = 0;
+  vm->hardLimit = 0;
+  vm->reserveOpen = 0;
+  vm->budget = SIZE_MAX;
+  vm->outOfMemory = NULL;
 
   return vm;
 }
 
-// Pushes a reference to [value] onto the VM's stack.
-void push(VM* vm, Object* value) {
-  if (vm->stackSize == STACK_MAX) {
-    perror("Stack overflow.\n");
+// Creates a new VM with an empty stack and an empty (but allocated) heap of
+// HEAP_SIZE bytes, collected by [collector].
+VM* newVMWithCollector(Collector collector) {
+  return newVMWithHeapSize(collector, HEAP_SIZE);
+}
+
+// Creates a new VM with an empty stack and an empty (but allocated) heap.
+VM* newVM() {
+  return newVMWithCollector(COLLECTOR_LISP2);
+}
+
+static VM* newLisp2VM() {
+  return newVMWithCollector(COLLECTOR_LISP2);
+}
+
+static VM* newMarkRegionVM() {
+  return newVMWithCollector(COLLECTOR_MARK_REGION);
+}
+
+static VM* newSemispaceVM() {
+  return newVMWithCollector(COLLECTOR_SEMISPACE);
+}
+
+static VM* newSizedLisp2VM(uint64_t liveBytes, double multiple) {
+  return newVMWithHeapSize(COLLECTOR_LISP2, (size_t)(liveBytes * multiple));
+}
+
+static VM* newSizedMarkRegionVM(uint64_t liveBytes, double multiple) {
+  return newVMWithHeapSize(COLLECTOR_MARK_REGION,
+                           (size_t)(liveBytes * multiple));
+}
+
+// The sweep counts both halves of a semi-space heap, so it can't run in less
+// than twice the live size.
+static VM* newSizedSemispaceVM(uint64_t liveBytes, double multiple) {
+  return newVMWithHeapSize(COLLECTOR_SEMISPACE,
+                           (size_t)(liveBytes * multiple));
+}
+
+// Every collector, with the name the tests and benchmarks report it by and
+// the constructors the benchmarks make its VMs with.
+typedef struct {
+  Collector collector;
+  const char* name;
+  VM* (*create)(void);
+  VM* (*createSized)(uint64_t liveBytes, double multiple);
+} CollectorInfo;
+
+static const CollectorInfo collectors[COLLECTOR_COUNT] = {
+  { COLLECTOR_LISP2, "lisp2", newLisp2VM, newSizedLisp2VM },
+  { COLLECTOR_MARK_REGION, "mark-region", newMarkRegionVM,
+    newSizedMarkRegionVM },
+  { COLLECTOR_SEMISPACE, "semispace", newSemispaceVM, newSizedSemispaceVM }
+};
+
+// Moves [vm]'s heap to memory that's aligned to 2MB and backed by transparent
+// huge pages where the kernel allows it, so that tracing and compacting a big
+// heap misses the TLB less. The old heap is dropped rather than copied, so
+// this must be called before anything is allocated. Returns zero if something
+// already has been, or the memory can't be mapped, and leaves the heap as it
+// was.
+int enableHugePages(VM* vm) {
+  if (vm->hugePages) return 1;
+  if (vm->collections != 0 || vm->allocatedObjects != 0) return 0;
+
+  void* heap = gcPagesMap(vm->heapSize);
+  if (!heap) return 0;
+
+  free(vm->heap);
+  vm->heap = heap;
+  vm->hugePages = 1;
+  vm->next = vm->heap;
+  vm->space = vm->heap;
+  if (vm->collector == COLLECTOR_LISP2) {
+    vm->limit = vm->heap + vm->heapSize;
+  } else if (vm->collector == COLLECTOR_SEMISPACE) {
+    vm->limit = vm->heap + vm->heapSize / 2;
+  } else {
+    vm->limit = vm->next;
+  }
+  return 1;
+}
+
+// Adds another segment to the top of the stack.
+void growStack(VM* vm) {
+  if (vm->segmentCount == vm->segmentCapacity) {
+    vm->segmentCapacity = vm->segmentCapacity == 0 ? 4
+                                                   : vm->segmentCapacity * 2;
+    vm->segments = realloc(vm->segments,
+                           vm->segmentCapacity * sizeof(StackSegment*));
+  }
+
+  StackSegment* segment = malloc(sizeof(StackSegment));
+  if (vm->segments == NULL || segment == NULL) {
+    perror("Out of memory");
     exit(1);
   }
+  vm->segments[vm->segmentCount++] = segment;
+}
+
+// Pushes a reference to [value] onto the VM's stack.
+void push(VM* vm, Object* value) {
+  if (vm->stackSize == vm->segmentCount * STACK_SEGMENT_SIZE) growStack(vm);
 
-  vm->stack[vm->stackSize++] = value;
+  *stackSlot(vm, vm->stackSize++) = value;
+  if (vm->trace && !vm->trace->replaying) gcTracePush(vm->trace, value);
 }
 
 // Pops the top-most reference to an object from the stack.
 Object* pop(VM* vm) {
-  return vm->stack[--vm->stackSize];
+  if (vm->trace && !vm->trace->replaying) gcTracePop(vm->trace);
+  return getStack(vm, --vm->stackSize);
+}
+
+// Registers [slot], which lives outside the VM, as a root. Until it's removed
+// with vmRemoveRoot(), the object it points to, if any, is kept alive, and
+// the slot is updated whenever the object moves. A slot can be registered
+// more than once, and must then be removed as many times.
+//
+// Traces don't record registered roots, so a VM that uses them may not
+// replay the same way.
+void vmAddRoot(VM* vm, Object** slot) {
+  if (vm->rootCount == vm->rootCapacity) {
+    vm->rootCapacity = vm->rootCapacity == 0 ? 16 : vm->rootCapacity * 2;
+    vm->roots = realloc(vm->roots, vm->rootCapacity * sizeof(Object**));
+    if (vm->roots == NULL) {
+      perror("Out of memory");
+      exit(1);
+    }
+  }
+
+  vm->roots[vm->rootCount++] = slot;
+}
+
+// Unregisters [slot]. Does nothing if it isn't registered.
+void vmRemoveRoot(VM* vm, Object** slot) {
+  // Roots are usually removed in the reverse of the order they were added, so
+  // look from the end. Move the last root into the hole to keep them packed.
+  for (size_t i = vm->rootCount; i > 0; i--) {
+    if (vm->roots[i - 1] == slot) {
+      vm->roots[i - 1] = vm->roots[--vm->rootCount];
+      return;
+    }
+  }
+}
+
+// Opens a scope for handles. Every handle made after this is released when
+// the scope is closed. Scopes nest, and must be closed in the reverse of the
+// order they were opened.
+HandleScope openHandleScope(VM* vm) {
+  HandleScope scope = { vm->stackSize };
+  return scope;
+}
+
+// Roots [object] until the current handle scope is closed, and returns the
+// slot it's rooted in.
+Handle newHandle(VM* vm, Object* object) {
+  push(vm, object);
+  return stackSlot(vm, vm->stackSize - 1);
+}
+
+// Releases every handle made since [scope] was opened, along with anything
+// else pushed since then.
+void closeHandleScope(VM* vm, HandleScope scope) {
+  // Closing a scope twice, or an outer one before an inner one, would put
+  // stale slots back on the stack.
+  if (scope.stackSize > vm->stackSize) {
+    printf("Handle scope closed twice!\n");
+    exit(1);
+  }
+
+  // A trace only knows about single pops.
+  if (vm->trace && !vm->trace->replaying) {
+    for (size_t i = scope.stackSize; i < vm->stackSize; i++) {
+      gcTracePop(vm->trace);
+    }
+  }
+
+  vm->stackSize = scope.stackSize;
+}
+
+// Marks [object], if it isn't already, and queues it to have its fields
+// scanned.
+static void markGrey(VM* vm, Object* object) {
+  // If already marked, we're done. Check this first to avoid looping on cycles
+  // in the object graph.
+  if (isMarked(object)) return;
+
+  object->header |= HEADER_MARK_BIT;
+  vm->markedObjects++;
+  gcCensusLive(&vm->census, objectType(object), objectSize(object));
+  if (isInHeap(vm, object)) vm->markedBytes += objectSize(object);
+
+  if (vm->greyCount == vm->greyCapacity) {
+    vm->greyCapacity = vm->greyCapacity == 0 ? 256 : vm->greyCapacity * 2;
+    vm->grey = realloc(vm->grey, vm->greyCapacity * sizeof(Object*));
+  }
+  vm->grey[vm->greyCount++] = object;
 }
 
-// Marks [object] as being reachable and still (potentially) in use.
-void mark(Object* object) {
-  // If already marked, we're done. Check this first to avoid recursing
-  // on cycles in the object graph.
-  if (object->moveTo) return;
+// Marks [object] and everything reachable from it.
+void mark(VM* vm, Object* object) {
+  markGrey(vm, object);
+
+  while (vm->greyCount > 0) {
+    object = vm->grey[--vm->greyCount];
 
-  // Any non-zero pointer indicates the object was reached. For no particular
-  // reason, we use the object's own address as the marked value.
-  object->moveTo = object;
+    switch (objectType(object)) {
+      case OBJ_INT:
+      case OBJ_FREE:
+        break;
 
-  // Recurse into the object's fields.
-  if (object->type == OBJ_PAIR) {
-    mark(object->head);
-    mark(object->tail);
+      case OBJ_PAIR:
+        markGrey(vm, object->head);
+        markGrey(vm, object->tail);
+        break;
+
+      case OBJ_ARRAY:
+        for (size_t i = 0; i < object->length; i++) {
+          if (object->elements[i]) markGrey(vm, object->elements[i]);
+        }
+        break;
+    }
   }
 }
 
 // The mark phase of garbage collection. Starting at the roots (in this case,
-// just the stack), recursively walks all reachable objects in the VM.
+// just the stack), walks all reachable objects in the VM.
 void markAll(VM* vm) {
-  for (int i = 0; i < vm->stackSize; i++) {
-    mark(vm->stack[i]);
+  vm->markedBytes = 0;
+  for (size_t segment = 0; segment < usedSegments(vm); segment++) {
+    Object** slots = vm->segments[segment]->slots;
+    size_t count = segmentSlots(vm, segment);
+    for (size_t i = 0; i < count; i++) mark(vm, slots[i]);
+  }
+
+  for (size_t i = 0; i < vm->rootCount; i++) {
+    if (*vm->roots[i]) mark(vm, *vm->roots[i]);
   }
 }
 
 // Phase one of the LISP2 algorithm. Walks the entire heap and, for each live
 // object, calculates where it will end up after compaction has moved it.
 //
+// Since this visits every object anyway, it also fills in the heap's half of
+// the census: where the live and dead bytes are, how the dead ones are strung
+// together, and how far each live object is going to move.
+//
 // Returns the address of the end of the live section of the heap after
 // compaction is done.
 void* calculateNewLocations(VM* vm) {
   // Calculate the new locations of the objects in the heap.
   void* from = vm->heap;
   void* to = vm->heap;
+  void* deadStart = NULL;
   while (from < vm->next) {
     Object* object = (Object*)from;
-    if (object->moveTo) {
-      object->moveTo = to;
+    size_t size = objectSize(object);
+    gcCensusRegion(&vm->census, from - vm->heap, size, isMarked(object));
+
+    if (isMarked(object)) {
+      if (deadStart) gcCensusSpan(&vm->census, from - deadStart);
+      deadStart = NULL;
+
+      setForwardingOffset(object, to - vm->heap);
+      gcCensusMoved(&vm->census, size, from - to);
 
       // We increase the destination address only when we pass a live object.
       // This effectively slides objects up on memory over dead ones.
-      to += sizeof(Object);
+      to += size;
+    } else if (!deadStart) {
+      deadStart = from;
     }
 
-    from += sizeof(Object);
+    from += size;
   }
 
+  if (deadStart) gcCensusSpan(&vm->census, from - deadStart);
+
   return to;
 }
 
+// Points each reference field in [object] at where the referenced object will
+// be once compaction is done.
+void updateFields(VM* vm, Object* object) {
+  switch (objectType(object)) {
+    case OBJ_INT:
+    case OBJ_FREE:
+      break;
+
+    case OBJ_PAIR:
+      object->head = forwardedAddress(vm, object->head);
+      object->tail = forwardedAddress(vm, object->tail);
+      break;
+
+    case OBJ_ARRAY:
+      for (size_t i = 0; i < object->length; i++) {
+        if (object->elements[i]) {
+          object->elements[i] = forwardedAddress(vm, object->elements[i]);
+        }
+      }
+      break;
+  }
+}
+
 // Phase two of the LISP2 algorithm. Now that we know where each object *will*
 // be, find every reference to an object and update that pointer to the new
 // value. This includes reference in the stack, as well as fields in (live)
 // objects that point to other objects.
 //
 // We do this *before* compaction. Since an object's new location is stored in
-// [object.moveTo] in the object itself, this needs to be able to find the
+// the header of the object itself, this needs to be able to find the
 // object. Doing this process before objects have been moved ensures we can
 // still find them by traversing the *old* pointers.
 void updateAllObjectPointers(VM* vm) {
   // Walk the stack.
-  for (int i = 0; i < vm->stackSize; i++) {
-    // Update the pointer on the stack to point to the object's new compacted
-    // location.
-    vm->stack[i] = vm->stack[i]->moveTo;
+  for (size_t segment = 0; segment < usedSegments(vm); segment++) {
+    Object** slots = vm->segments[segment]->slots;
+    size_t count = segmentSlots(vm, segment);
+    for (size_t i = 0; i < count; i++) {
+      // Update the pointer on the stack to point to the object's new
+      // compacted location.
+      slots[i] = forwardedAddress(vm, slots[i]);
+    }
+  }
+
+  // And the registered roots.
+  for (size_t i = 0; i < vm->rootCount; i++) {
+    Object** root = vm->roots[i];
+    if (*root) *root = forwardedAddress(vm, *root);
   }
 
-  // Walk the heap, fixing fields in live pairs.
+  // Walk the heap, fixing fields in live objects.
   void* from = vm->heap;
   while (from < vm->next) {
     Object* object = (Object*)from;
+    if (isMarked(object)) updateFields(vm, object);
 
-    if (object->moveTo && object->type == OBJ_PAIR) {
-      object->head = object->head->moveTo;
-      object->tail = object->tail->moveTo;
-    }
+    from += objectSize(object);
+  }
 
-    from += sizeof(Object);
+  // Large objects don't move, but they can still refer to objects that do.
+  for (LargeObject* large = vm->largeObjects; large; large = large->next) {
+    Object* object = (Object*)(large + 1);
+    if (isMarked(object)) updateFields(vm, object);
   }
 }
 
+// Clears the mark and forwarding offset of an object that survived this
+// collection, and ages it.
+static inline void unmarkSurvivor(Object* object) {
+  int age = objectAge(object);
+  if (age < HEADER_AGE_MAX) age++;
+  object->header = (object->header & HEADER_TYPE_MASK) |
+                   ((uint64_t)age << HEADER_AGE_SHIFT);
+}
+
 // Phase three of the LISP2 algorithm. Now that we know where everything will
 // end up, and all of the pointers have been fixed, actually slide all of the
 // live objects up in memory.
@@ -178,189 +942,2877 @@ void compact(VM* vm) {
 
   while (from < vm->next) {
     Object* object = (Object*)from;
-    if (object->moveTo) {
+    if (isMarked(object)) {
       // Move the object from its old location to its new location.
-      Object* to = object->moveTo;
-      memmove(to, object, sizeof(Object));
-
-      // Clear the mark.
-      to->moveTo = NULL;
+      // Read the size before moving, since the move may overwrite it.
+      size_t size = objectSize(object);
+      Object* to = vm->heap + forwardingOffset(object);
+      memmove(to, object, size);
+      unmarkSurvivor(to);
+
+      from += size;
+    } else {
+      from += objectSize(object);
     }
+  }
+}
 
-    from += sizeof(Object);
+// The large object space is collected by mark-sweep instead of compaction.
+// Walks the large objects, unmapping the ones that weren't reached and
+// clearing the marks on the rest.
+void sweepLargeObjects(VM* vm) {
+  LargeObject** link = &vm->largeObjects;
+  while (*link) {
+    LargeObject* large = *link;
+    Object* object = (Object*)(large + 1);
+
+    if (isMarked(object)) {
+      unmarkSurvivor(object);
+      link = &large->next;
+    } else {
+      // Unlink it and give its pages back to the OS.
+      *link = large->next;
+      vm->largeSize -= large->mappedSize;
+      munmap(large, large->mappedSize);
+    }
   }
 }
 
-// Free memory for all unused objects.
-void gc(VM* vm) {
-  // Find out which objects are still in use.
-  markAll(vm);
+// Returns the index of the free list that holds cells of [size] bytes.
+static inline int sizeClass(size_t size) {
+  size_t sizeClass = size / 8;
+  return sizeClass < FREE_LIST_CLASSES ? (int)sizeClass : FREE_LIST_CLASSES - 1;
+}
 
-  // Determine where they will end up.
-  void* end = calculateNewLocations(vm);
+// Turns the [size] bytes at [start] into a free cell and adds it to the free
+// lists.
+void addFreeCell(VM* vm, void* start, size_t size) {
+  Object* cell = (Object*)start;
+  cell->header = (uint64_t)OBJ_FREE << HEADER_TYPE_SHIFT;
+  cell->cellSize = size;
 
-  // Fix the references to them.
-  updateAllObjectPointers(vm);
+  int index = sizeClass(size);
+  cell->nextFree = vm->freeLists[index];
+  vm->freeLists[index] = cell;
+}
 
-  // Compact the memory.
-  compact(vm);
+// Empties the free lists. The cells stay in the heap as garbage.
+void clearFreeLists(VM* vm) {
+  for (int i = 0; i < FREE_LIST_CLASSES; i++) vm->freeLists[i] = NULL;
+}
 
-  // Update the end of the heap to the new post-compaction end.
-  vm->next = end;
+// Takes a free cell of at least [size] bytes off the free lists, splitting off
+// and re-filing whatever is left over. Returns NULL if there isn't one.
+void* allocateFromFreeLists(VM* vm, size_t size) {
+  // A cell can only be split if the remainder is big enough to be a free cell
+  // itself, so after trying for an exact fit, skip to the classes that are
+  // that much bigger.
+  int exact = sizeClass(size);
+  int first = sizeClass(size + sizeof(Object));
+
+  for (int i = exact; i < FREE_LIST_CLASSES; i++) {
+    if (i > exact && i < first) continue;
+
+    Object** link = &vm->freeLists[i];
+    while (*link) {
+      Object* cell = *link;
+      size_t remainder = cell->cellSize - size;
+      if (cell->cellSize >= size &&
+          (remainder == 0 || remainder >= sizeof(Object))) {
+        *link = cell->nextFree;
+        if (remainder > 0) addFreeCell(vm, (void*)cell + size, remainder);
+        return cell;
+      }
+
+      link = &cell->nextFree;
+    }
+  }
 
-  printf("%ld live bytes after collection.\n", vm->next - vm->heap);
+  return NULL;
 }
 
-// Create a new object.
-//
-// This does *not* root the object, so it's important that a GC does not happen
-// between calling this and adding a reference to the object in a field or on
-// the stack.
-Object* newObject(VM* vm, ObjectType type) {
-  if (vm->next + sizeof(Object) > vm->heap + HEAP_SIZE) {
-    gc(vm);
+// The non-moving alternative to compaction. Walks the heap, clearing the marks
+// on live objects and coalescing each run of dead ones into a free cell. Like
+// calculateNewLocations(), it fills in the census along the way.
+void sweep(VM* vm) {
+  clearFreeLists(vm);
 
-    // If there still isn't room after collection, we can't fit it.
-    if (vm->next + sizeof(Object) > vm->heap + HEAP_SIZE) {
-      perror("Out of memory");
-      exit(1);
+  void* from = vm->heap;
+  void* deadStart = NULL;
+  while (from < vm->next) {
+    Object* object = (Object*)from;
+    size_t size = objectSize(object);
+    gcCensusRegion(&vm->census, from - vm->heap, size, isMarked(object));
+
+    if (isMarked(object)) {
+      if (deadStart) {
+        addFreeCell(vm, deadStart, from - deadStart);
+        gcCensusSpan(&vm->census, from - deadStart);
+      }
+      deadStart = NULL;
+      unmarkSurvivor(object);
+    } else if (!deadStart) {
+      deadStart = from;
     }
+
+    from += size;
   }
 
-  Object* object = (Object*)vm->next;
-  vm->next += sizeof(Object);
+  // Garbage at the end of the used part of the heap can just be bump
+  // allocated over again.
+  if (deadStart) {
+    gcCensusSpan(&vm->census, from - deadStart);
+    vm->next = deadStart;
+  }
 
-  object->type = type;
-  object->moveTo = NULL;
+  // Send allocation to the free lists first.
+  vm->limit = vm->next;
+}
 
-  return object;
+// Returns the index of the block containing heap address [address].
+static inline int blockIndex(VM* vm, void* address) {
+  return (int)((address - vm->heap) / BLOCK_SIZE);
 }
 
-// Creates a new int object and pushes it onto the stack.
-void pushInt(VM* vm, int intValue) {
-  Object* object = newObject(vm, OBJ_INT);
-  object->value = intValue;
+// Marks the lines that [object] overlaps as live.
+void markLines(VM* vm, Object* object) {
+  size_t first = ((void*)object - vm->heap) / LINE_SIZE;
+  size_t last = ((void*)object + objectSize(object) - 1 - vm->heap) / LINE_SIZE;
+  memset(vm->lineMarks + first, 1, last - first + 1);
+}
 
-  push(vm, object);
+// Finds the next run of free lines in a recyclable block that can hold [size]
+// bytes, or failing that, claims a free block. Points [next] and [limit] at it
+// and returns non-zero, or returns zero if the heap is full.
+int findHole(VM* vm, size_t size) {
+  // Prefer reusing the holes in partially-used blocks, and leave the free
+  // blocks for evacuation as long as possible.
+  for (; vm->holeBlock < vm->heapBlocks; vm->holeBlock++, vm->holeLine = 0) {
+    if (vm->blockStates[vm->holeBlock] != BLOCK_RECYCLABLE) continue;
+
+    uint8_t* marks = vm->lineMarks + vm->holeBlock * LINES_PER_BLOCK;
+    while (vm->holeLine < LINES_PER_BLOCK) {
+      // Skip the live lines.
+      if (marks[vm->holeLine]) {
+        vm->holeLine++;
+        continue;
+      }
+
+      // Find the end of the run of free lines.
+      int start = vm->holeLine;
+      while (vm->holeLine < LINES_PER_BLOCK && !marks[vm->holeLine]) {
+        vm->holeLine++;
+      }
+
+      void* block = vm->heap + (size_t)vm->holeBlock * BLOCK_SIZE;
+      if ((size_t)(vm->holeLine - start) * LINE_SIZE >= size) {
+        vm->next = block + (size_t)start * LINE_SIZE;
+        vm->limit = block + (size_t)vm->holeLine * LINE_SIZE;
+        return 1;
+      }
+    }
+  }
+
+  for (int i = 0; i < vm->heapBlocks; i++) {
+    if (vm->blockStates[i] == BLOCK_FREE) {
+      vm->blockStates[i] = BLOCK_FULL;
+      vm->next = vm->heap + (size_t)i * BLOCK_SIZE;
+      vm->limit = vm->next + BLOCK_SIZE;
+      return 1;
+    }
+  }
+
+  return 0;
 }
 
-// Creates a new pair object. The field values for the pair are popped from the
-// stack, then the resulting pair is pushed.
-Object* pushPair(VM* vm) {
-  // Create the pair before popping the fields. This ensures the fields don't
-  // get collected if creating the pair triggers a GC.
-  Object* object = newObject(vm, OBJ_PAIR);
+// Allocates [size] bytes to copy an evacuated object into, from the free
+// blocks. Returns NULL if there's no space left, in which case the object just
+// stays where it is.
+void* allocateCopy(VM* vm, size_t size) {
+  if (vm->copyNext + size > vm->copyLimit) {
+    int block = -1;
+    for (int i = 0; i < vm->heapBlocks; i++) {
+      if (vm->blockStates[i] == BLOCK_FREE) {
+        block = i;
+        break;
+      }
+    }
 
-  object->tail = pop(vm);
-  object->head = pop(vm);
+    if (block == -1) return NULL;
 
-  push(vm, object);
-  return object;
+    vm->blockStates[block] = BLOCK_FULL;
+    vm->copyNext = vm->heap + (size_t)block * BLOCK_SIZE;
+    vm->copyLimit = vm->copyNext + BLOCK_SIZE;
+  }
+
+  void* copy = vm->copyNext;
+  vm->copyNext += size;
+  return copy;
 }
 
-// Prints [object].
-void objectPrint(Object* object) {
-  switch (object->type) {
+// Remembers that [object] was marked so its mark can be cleared afterwards.
+void recordMarked(VM* vm, Object* object) {
+  if (vm->markedCount == vm->markedCapacity) {
+    vm->markedCapacity = vm->markedCapacity == 0 ? 256 : vm->markedCapacity * 2;
+    vm->marked = realloc(vm->marked, vm->markedCapacity * sizeof(Object*));
+  }
+
+  vm->marked[vm->markedCount++] = object;
+}
+
+// Queues [slot] to have the object it references marked.
+static void queueSlot(VM* vm, Object** slot) {
+  if (vm->greySlotCount == vm->greySlotCapacity) {
+    vm->greySlotCapacity =
+        vm->greySlotCapacity == 0 ? 256 : vm->greySlotCapacity * 2;
+    vm->greySlots = realloc(vm->greySlots,
+                            vm->greySlotCapacity * sizeof(Object**));
+  }
+  vm->greySlots[vm->greySlotCount++] = slot;
+}
+
+// Marks the object referenced by [slot], if it isn't already, and queues its
+// fields. If the object is in a block being evacuated, it is copied out first,
+// and [slot] is updated to point to the copy.
+static void markSlot(VM* vm, Object** slot) {
+  Object* object = *slot;
+
+  // If it's already been evacuated, just point at the copy.
+  if (object->header & HEADER_FORWARDED_BIT) {
+    *slot = vm->heap + forwardingOffset(object);
+    return;
+  }
+
+  if (isMarked(object)) return;
+
+  if (isInHeap(vm, object) &&
+      vm->blockStates[blockIndex(vm, object)] == BLOCK_EVACUATE) {
+    size_t size = objectSize(object);
+    Object* copy = allocateCopy(vm, size);
+    if (copy) {
+      memcpy(copy, object, size);
+      object->header |= HEADER_FORWARDED_BIT;
+      setForwardingOffset(object, (void*)copy - vm->heap);
+
+      *slot = copy;
+      object = copy;
+    }
+  }
+
+  object->header |= HEADER_MARK_BIT;
+  vm->markedObjects++;
+  gcCensusLive(&vm->census, objectType(object), objectSize(object));
+  recordMarked(vm, object);
+  if (isInHeap(vm, object)) markLines(vm, object);
+
+  // The fields queued are the ones in the copy, which won't move again.
+  switch (objectType(object)) {
     case OBJ_INT:
-      printf("%d", object->value);
+    case OBJ_FREE:
       break;
 
     case OBJ_PAIR:
-      printf("(");
-      objectPrint(object->head);
-      printf(", ");
-      objectPrint(object->tail);
-      printf(")");
+      queueSlot(vm, &object->head);
+      queueSlot(vm, &object->tail);
+      break;
+
+    case OBJ_ARRAY:
+      for (size_t i = 0; i < object->length; i++) {
+        if (object->elements[i]) queueSlot(vm, &object->elements[i]);
+      }
+      break;
+  }
+}
+
+// Marks the object referenced by [slot] and everything it references,
+// evacuating the ones in blocks being evacuated and updating the slots that
+// referenced them.
+void markRegion(VM* vm, Object** slot) {
+  markSlot(vm, slot);
+  while (vm->greySlotCount > 0) {
+    markSlot(vm, vm->greySlots[--vm->greySlotCount]);
+  }
+}
+
+// Returns non-zero if [object] was reached by the collection in progress,
+// whether it was marked in place or copied somewhere else.
+static int isSurvivor(void* object) {
+  uint64_t header = ((Object*)object)->header;
+  return (header & HEADER_MARK_BIT) || (header & HEADER_FORWARDED_BIT);
+}
+
+// Once marking is done, finds out which of the objects the profiler sampled
+// since the last collection survived it.
+void collectSamples(VM* vm) {
+  if (vm->profile) gcProfileCollect(vm->profile, isSurvivor);
+}
+
+// Returns where [object] is after a collection that only moves objects by
+// evacuating or copying them, or NULL if it's garbage.
+static void* copiedAddress(void* object, void* data) {
+  VM* vm = (VM*)data;
+  Object* survivor = (Object*)object;
+  if (survivor->header & HEADER_FORWARDED_BIT) {
+    return vm->heap + forwardingOffset(survivor);
+  }
+
+  return isMarked(survivor) ? survivor : NULL;
+}
+
+// Returns where [object] will be once compaction is done, or NULL if it's
+// garbage.
+static void* compactedAddress(void* object, void* data) {
+  Object* survivor = (Object*)object;
+  return isMarked(survivor) ? forwardedAddress((VM*)data, survivor) : NULL;
+}
+
+// Once the collector knows where each survivor is going, updates the trace's
+// map of objects, if there is a trace, with [moved].
+void remapTrace(VM* vm, void* (*moved)(void* object, void* data)) {
+  if (vm->trace) gcTraceRemap(vm->trace, moved, vm);
+}
+
+// Collects the heap using the mark-region algorithm. Returns the number of live
+// bytes in the heap.
+size_t collectRegions(VM* vm, GCEvent* event) {
+  event->kind = GC_KIND_MARK_REGION;
+
+  // Pick the blocks that were sparse after the last collection as evacuation
+  // candidates. Those line marks are stale, but are a good enough guess.
+  for (int i = 0; i < vm->heapBlocks; i++) {
+    if (vm->blockStates[i] != BLOCK_RECYCLABLE) continue;
+
+    int liveLines = 0;
+    uint8_t* marks = vm->lineMarks + i * LINES_PER_BLOCK;
+    for (int line = 0; line < LINES_PER_BLOCK; line++) liveLines += marks[line];
+
+    if (liveLines < EVACUATE_THRESHOLD) vm->blockStates[i] = BLOCK_EVACUATE;
+  }
+
+  vm->copyNext = NULL;
+  vm->copyLimit = NULL;
+  vm->markedCount = 0;
+  memset(vm->lineMarks, 0, (size_t)vm->heapBlocks * LINES_PER_BLOCK);
+
+  gcPhaseBegin(event, GC_PHASE_MARK, vm->counters);
+  for (size_t segment = 0; segment < usedSegments(vm); segment++) {
+    Object** slots = vm->segments[segment]->slots;
+    size_t count = segmentSlots(vm, segment);
+    for (size_t i = 0; i < count; i++) markRegion(vm, &slots[i]);
+  }
+  for (size_t i = 0; i < vm->rootCount; i++) {
+    if (*vm->roots[i]) markRegion(vm, vm->roots[i]);
+  }
+  gcPhaseEnd(event, GC_PHASE_MARK, vm->counters);
+
+  collectSamples(vm);
+  remapTrace(vm, copiedAddress);
+
+  gcPhaseBegin(event, GC_PHASE_SWEEP, vm->counters);
+
+  // Now that the line marks are accurate, classify each block by how many of
+  // its lines are free.
+  for (int i = 0; i < vm->heapBlocks; i++) {
+    int liveLines = 0;
+    uint8_t* marks = vm->lineMarks + i * LINES_PER_BLOCK;
+    for (int line = 0; line < LINES_PER_BLOCK; line++) liveLines += marks[line];
+
+    if (liveLines == 0) {
+      vm->blockStates[i] = BLOCK_FREE;
+    } else if (liveLines == LINES_PER_BLOCK) {
+      vm->blockStates[i] = BLOCK_FULL;
+    } else {
+      vm->blockStates[i] = BLOCK_RECYCLABLE;
+    }
+  }
+
+  // Clear the marks on everything that survived.
+  size_t liveSize = 0;
+  for (size_t i = 0; i < vm->markedCount; i++) {
+    Object* object = vm->marked[i];
+    if (isInHeap(vm, object)) liveSize += objectSize(object);
+
+    // Large objects are unmarked by the sweep below.
+    if (isInHeap(vm, object)) unmarkSurvivor(object);
+  }
+
+  sweepLargeObjects(vm);
+  gcPhaseEnd(event, GC_PHASE_SWEEP, vm->counters);
+
+  // Start allocating from the first hole again.
+  vm->holeBlock = 0;
+  vm->holeLine = 0;
+  vm->next = vm->heap;
+  vm->limit = vm->heap;
+
+  return liveSize;
+}
+
+// Copies [object] into to-space, unless it's already there, and returns its
+// new address. Large objects aren't copied. Instead, they're marked and queued
+// to have their fields scanned.
+Object* copyObject(VM* vm, Object* object) {
+  if (!isInHeap(vm, object)) {
+    if (!isMarked(object)) {
+      object->header |= HEADER_MARK_BIT;
+      vm->markedObjects++;
+      gcCensusLive(&vm->census, objectType(object), objectSize(object));
+      recordMarked(vm, object);
+    }
+
+    return object;
+  }
+
+  if (object->header & HEADER_FORWARDED_BIT) {
+    return vm->heap + forwardingOffset(object);
+  }
+
+  // To-space is as big as from-space, so there's always room.
+  size_t size = objectSize(object);
+  Object* copy = (Object*)vm->next;
+  vm->next += size;
+  memcpy(copy, object, size);
+  unmarkSurvivor(copy);
+  vm->markedObjects++;
+  gcCensusLive(&vm->census, objectType(copy), size);
+
+  // Leave a forwarding address behind for any other references to it.
+  object->header |= HEADER_FORWARDED_BIT;
+  setForwardingOffset(object, (void*)copy - vm->heap);
+  return copy;
+}
+
+// Copies the objects that [object]'s fields refer to, and points the fields at
+// the copies.
+void scanFields(VM* vm, Object* object) {
+  switch (objectType(object)) {
+    case OBJ_INT:
+    case OBJ_FREE:
+      break;
+
+    case OBJ_PAIR:
+      object->head = copyObject(vm, object->head);
+      object->tail = copyObject(vm, object->tail);
+      break;
+
+    case OBJ_ARRAY:
+      for (size_t i = 0; i < object->length; i++) {
+        if (object->elements[i]) {
+          object->elements[i] = copyObject(vm, object->elements[i]);
+        }
+      }
+      break;
+  }
+}
+
+// Collects the heap using Cheney's semi-space algorithm. Returns the number of
+// live bytes in the heap.
+size_t collectSemispace(VM* vm, GCEvent* event) {
+  event->kind = GC_KIND_SEMISPACE;
+
+  void* toSpace = vm->space == vm->heap ? vm->heap + vm->heapSize / 2
+                                         : vm->heap;
+  vm->next = toSpace;
+  vm->markedCount = 0;
+
+  gcPhaseBegin(event, GC_PHASE_COPY, vm->counters);
+
+  // Copy the roots.
+  for (size_t segment = 0; segment < usedSegments(vm); segment++) {
+    Object** slots = vm->segments[segment]->slots;
+    size_t count = segmentSlots(vm, segment);
+    for (size_t i = 0; i < count; i++) slots[i] = copyObject(vm, slots[i]);
+  }
+  for (size_t i = 0; i < vm->rootCount; i++) {
+    Object** root = vm->roots[i];
+    if (*root) *root = copyObject(vm, *root);
+  }
+
+  // To-space doubles as the queue of objects whose fields haven't been
+  // scanned yet. Walk it until it catches up with the objects being copied
+  // into it, scanning any large objects that got reached along the way.
+  void* scan = toSpace;
+  size_t largeScan = 0;
+  while (scan < vm->next || largeScan < vm->markedCount) {
+    if (scan < vm->next) {
+      Object* object = (Object*)scan;
+      scanFields(vm, object);
+      scan += objectSize(object);
+    } else {
+      scanFields(vm, vm->marked[largeScan++]);
+    }
+  }
+  gcPhaseEnd(event, GC_PHASE_COPY, vm->counters);
+
+  collectSamples(vm);
+  remapTrace(vm, copiedAddress);
+
+  gcPhaseBegin(event, GC_PHASE_SWEEP, vm->counters);
+  sweepLargeObjects(vm);
+  gcPhaseEnd(event, GC_PHASE_SWEEP, vm->counters);
+
+  vm->space = toSpace;
+  vm->limit = toSpace + vm->heapSize / 2;
+  return vm->next - toSpace;
+}
+
+// Collects the heap with the LISP2 algorithm, or just sweeps it if too little
+// of it is garbage for compaction to be worth it. Returns the number of live
+// bytes in the heap.
+size_t collectLisp2(VM* vm, GCEvent* event) {
+  // Find out which objects are still in use.
+  gcPhaseBegin(event, GC_PHASE_MARK, vm->counters);
+  markAll(vm);
+  gcPhaseEnd(event, GC_PHASE_MARK, vm->counters);
+
+  collectSamples(vm);
+
+  // If only a little of the heap is garbage, sliding every live object down
+  // over it isn't worth it. Leave them where they are and reuse the garbage
+  // through the free lists instead.
+  size_t usedSize = vm->next - vm->heap;
+  double garbage = usedSize == 0 ? 0 :
+      (double)(usedSize - vm->markedBytes) / usedSize;
+  int sweepOnly = vm->forceSweep || garbage < GARBAGE_THRESHOLD;
+  vm->forceSweep = 0;
+  if (!vm->forceCompact && sweepOnly) {
+    event->kind = GC_KIND_SWEEP;
+    remapTrace(vm, copiedAddress);
+
+    gcPhaseBegin(event, GC_PHASE_SWEEP, vm->counters);
+    sweep(vm);
+    sweepLargeObjects(vm);
+    gcPhaseEnd(event, GC_PHASE_SWEEP, vm->counters);
+
+    return vm->markedBytes;
+  }
+
+  event->kind = GC_KIND_COMPACT;
+  vm->forceCompact = 0;
+
+  // Compaction leaves all of the free space in one piece at the end of the
+  // heap, so the old free cells go away.
+  clearFreeLists(vm);
+
+  // Determine where they will end up.
+  gcPhaseBegin(event, GC_PHASE_CALCULATE, vm->counters);
+  void* end = calculateNewLocations(vm);
+  gcPhaseEnd(event, GC_PHASE_CALCULATE, vm->counters);
+
+  remapTrace(vm, compactedAddress);
+
+  // Fix the references to them.
+  gcPhaseBegin(event, GC_PHASE_UPDATE, vm->counters);
+  updateAllObjectPointers(vm);
+  gcPhaseEnd(event, GC_PHASE_UPDATE, vm->counters);
+
+  // Compact the memory.
+  gcPhaseBegin(event, GC_PHASE_COMPACT, vm->counters);
+  compact(vm);
+  gcPhaseEnd(event, GC_PHASE_COMPACT, vm->counters);
+
+  // Free the unreachable large objects.
+  gcPhaseBegin(event, GC_PHASE_SWEEP, vm->counters);
+  sweepLargeObjects(vm);
+  gcPhaseEnd(event, GC_PHASE_SWEEP, vm->counters);
+
+  // Update the end of the heap to the new post-compaction end.
+  vm->next = end;
+  vm->limit = vm->heap + vm->heapSize;
+
+  return vm->next - vm->heap;
+}
+
+// Returns the most bytes that can be in use before allocation fails: the hard
+// limit, less the reserve unless it's open.
+static inline size_t hardTarget(VM* vm) {
+  if (vm->hardLimit == 0) return SIZE_MAX;
+  if (vm->reserveOpen || vm->hardLimit < HEAP_RESERVE) return vm->hardLimit;
+  return vm->hardLimit - HEAP_RESERVE;
+}
+
+// Works out how many bytes can be allocated before the next collection has to
+// be triggered for the limits. Below the soft limit, that's when it's
+// reached. Above it, it's when the live bytes have grown by
+// SOFT_LIMIT_GROWTH. Either way, it's never past the hard limit.
+static void updateBudget(VM* vm) {
+  size_t target = hardTarget(vm);
+  if (vm->softLimit != 0) {
+    size_t soft = vm->liveBytes + (size_t)(vm->liveBytes * SOFT_LIMIT_GROWTH);
+    if (soft < vm->softLimit) soft = vm->softLimit;
+    if (soft < target) target = soft;
+  }
+
+  vm->budget = target > vm->liveBytes ? target - vm->liveBytes : 0;
+}
+
+// Returns non-zero if [size] more bytes can be allocated without a collection
+// for the limits.
+static inline int withinBudget(VM* vm, size_t size) {
+  return vm->allocatedBytes + size <= vm->budget;
+}
+
+// Returns non-zero if [size] more bytes can be allocated without going over
+// the hard limit.
+static inline int withinHardLimit(VM* vm, size_t size) {
+  return vm->liveBytes + vm->allocatedBytes + size <= hardTarget(vm);
+}
+
+// Limits how many bytes the VM can have in use, including large objects. Zero
+// means no limit.
+//
+// Once more than [softLimit] bytes are in use, a collection is triggered,
+// even if there's room left in the heap. If more than that is still live
+// afterwards, the next one comes when it has grown by SOFT_LIMIT_GROWTH.
+//
+// An allocation that would put more than [hardLimit] less HEAP_RESERVE bytes
+// in use fails and returns NULL, and so does one that doesn't fit in the heap
+// at all. The first failure at the hard limit opens up the reserve, so that
+// the code handling the failure can still allocate, until a collection frees
+// enough to close it again. That only works if the hard limit is below what
+// the heap can hold.
+void setHeapLimits(VM* vm, size_t softLimit, size_t hardLimit) {
+  vm->softLimit = softLimit;
+  vm->hardLimit = hardLimit;
+  vm->reserveOpen = 0;
+  updateBudget(vm);
+}
+
+// Has [handler] called whenever an allocation fails, with the size that
+// didn't fit, before NULL is returned.
+void setOutOfMemoryHandler(VM* vm, void (*handler)(VM* vm, size_t size)) {
+  vm->outOfMemory = handler;
+}
+
+// Opens the reserve, if there's a hard limit, and calls the out of memory
+// handler. Returns NULL for the allocation to return.
+static Object* allocationFailed(VM* vm, size_t size) {
+  if (vm->hardLimit != 0 && !vm->reserveOpen) {
+    vm->reserveOpen = 1;
+    updateBudget(vm);
+  }
+
+  if (vm->outOfMemory) vm->outOfMemory(vm, size);
+  return NULL;
+}
+
+// Free memory for all unused objects, and log an event describing the
+// collection.
+void gc(VM* vm) {
+  GCEvent event;
+  memset(&event, 0, sizeof(event));
+  event.sequence = ++vm->collections;
+  event.startNs = gcNow();
+  event.heapSizeBefore = vm->heapSize + vm->largeSize;
+  event.usedBytesBefore = vm->liveBytes + vm->allocatedBytes;
+  event.objectsBefore = vm->liveObjects + vm->allocatedObjects;
+
+  GC_PROBE3(gc__start, event.sequence, vm->collector, event.usedBytesBefore);
+
+  vm->markedObjects = 0;
+  gcCensusReset(&vm->census, vm->heapSize);
+
+  size_t liveSize;
+  switch (vm->collector) {
+    case COLLECTOR_MARK_REGION:
+      liveSize = collectRegions(vm, &event);
+      break;
+
+    case COLLECTOR_SEMISPACE:
+      liveSize = collectSemispace(vm, &event);
+      break;
+
+    default:
+      liveSize = collectLisp2(vm, &event);
+      break;
+  }
+
+  event.endNs = gcNow();
+  gcStatsRecordCollection(&vm->stats, event.endNs - event.startNs,
+                          liveSize + vm->largeSize,
+                          vm->heapSize + vm->largeSize, vm->allocatedBytes);
+  gcTimelineRecord(&vm->pauses, event.startNs, event.endNs);
+
+  vm->liveBytes = liveSize + vm->largeSize;
+  vm->liveObjects = vm->markedObjects;
+  vm->allocatedBytes = 0;
+  vm->allocatedObjects = 0;
+
+  // Close the reserve once there's room for it again.
+  if (vm->reserveOpen && vm->liveBytes + 2 * HEAP_RESERVE <= vm->hardLimit) {
+    vm->reserveOpen = 0;
+  }
+  updateBudget(vm);
+
+  event.heapSizeAfter = vm->heapSize + vm->largeSize;
+  event.liveBytes = vm->liveBytes;
+  event.liveObjects = vm->liveObjects;
+  event.freedBytes = event.usedBytesBefore - event.liveBytes;
+  event.freedObjects = event.objectsBefore - event.liveObjects;
+  gcPredictorRecord(&vm->predictor, &event);
+  gcLogPush(&vm->events, &event);
+
+  GC_PROBE4(gc__end, event.sequence, event.liveBytes, event.freedBytes,
+            event.endNs - event.startNs);
+}
+
+// Tells the VM that the mutator is idle until [deadlineNs], a time from
+// gcNow(), so that it can collect now rather than in the middle of later work.
+//
+// It only collects if the heap is full enough, by gcIdleShouldCollect(), and
+// only if the collection is predicted to finish before the deadline, judging
+// by how long earlier ones took for the bytes that were live and in use. A
+// LISP2 heap is compacted if there's time, or else just swept if there's
+// time for that. Returns what it did.
+GCIdleAction vmIdleNotification(VM* vm, uint64_t deadlineNs) {
+  uint64_t now = gcNow();
+  if (deadlineNs <= now) return GC_IDLE_NONE;
+
+  size_t capacity = vm->collector == COLLECTOR_SEMISPACE ? vm->heapSize / 2
+                                                         : vm->heapSize;
+  size_t usedBytes = vm->liveBytes + vm->allocatedBytes;
+  if (!gcIdleShouldCollect(vm->liveBytes, usedBytes,
+                           capacity + vm->largeSize)) {
+    return GC_IDLE_NONE;
+  }
+
+  GCKind full = GC_KIND_COMPACT;
+  if (vm->collector == COLLECTOR_MARK_REGION) full = GC_KIND_MARK_REGION;
+  if (vm->collector == COLLECTOR_SEMISPACE) full = GC_KIND_SEMISPACE;
+
+  uint64_t budget = deadlineNs - now;
+  if (gcPredictPause(&vm->predictor, full, vm->liveBytes,
+                     usedBytes) <= budget) {
+    if (vm->collector == COLLECTOR_LISP2) vm->forceCompact = 1;
+    gc(vm);
+    return GC_IDLE_FULL;
+  }
+
+  if (vm->collector == COLLECTOR_LISP2 &&
+      gcPredictPause(&vm->predictor, GC_KIND_SWEEP, vm->liveBytes,
+                     usedBytes) <= budget) {
+    vm->forceSweep = 1;
+    gc(vm);
+    return GC_IDLE_PARTIAL;
+  }
+
+  return GC_IDLE_NONE;
+}
+
+// Tries to find another chunk of memory to bump allocate [size] bytes from
+// without collecting. Returns zero if there isn't one.
+int refill(VM* vm, size_t size) {
+  // The LISP2 and semi-space heaps are one contiguous chunk, so there's
+  // nowhere else to look.
+  if (vm->collector != COLLECTOR_MARK_REGION) return 0;
+
+  return findHole(vm, size);
+}
+
+// Allocates [size] bytes for a new object of [type] in the heap without
+// collecting. Returns NULL if there isn't room.
+Object* tryAllocate(VM* vm, ObjectType type, size_t size) {
+  Object* object = NULL;
+
+  // After a LISP2 sweep, [limit] is pulled in so that the garbage on the free
+  // lists gets reused before the free space at the end of the heap. Once there
+  // isn't a cell that fits, go back to bump allocating.
+  if (vm->next + size > vm->limit && vm->collector == COLLECTOR_LISP2) {
+    object = allocateFromFreeLists(vm, size);
+    if (!object) vm->limit = vm->heap + vm->heapSize;
+  }
+
+  if (!object) {
+    if (vm->next + size > vm->limit && !refill(vm, size)) return NULL;
+
+    object = (Object*)vm->next;
+    vm->next += size;
+  }
+
+  vm->allocatedBytes += size;
+  vm->allocatedObjects++;
+
+  object->header = (uint64_t)type << HEADER_TYPE_SHIFT;
+
+  if (vm->profile && gcProfileCount(vm->profile, size)) {
+    gcProfileSample(vm->profile, object, size);
+  }
+
+  return object;
+}
+
+// The slow path of allocate(), for when there isn't room left before [limit],
+// the limits need checking, or allocations are being sampled. Tries the free
+// lists or the next run of free lines, and collects if there's still no room.
+// Returns NULL if it doesn't fit. It's kept out of line so the fast path stays
+// small enough to inline everywhere.
+__attribute__((noinline, cold))
+Object* allocateSlow(VM* vm, ObjectType type, size_t size) {
+  if (withinBudget(vm, size)) {
+    Object* object = tryAllocate(vm, type, size);
+    if (object) return object;
+  }
+
+  GC_PROBE2(alloc__slow, type, size);
+  gc(vm);
+  if (!withinHardLimit(vm, size)) return allocationFailed(vm, size);
+  Object* object = tryAllocate(vm, type, size);
+
+  // Sweeping may have left plenty of free memory, but not in one piece big
+  // enough. If so, compacting will bring it together.
+  if (!object && vm->collector == COLLECTOR_LISP2) {
+    vm->forceCompact = 1;
+    gc(vm);
+    object = tryAllocate(vm, type, size);
+  }
+
+  // If there still isn't room after collection, we can't fit it.
+  if (!object) return allocationFailed(vm, size);
+  return object;
+}
+
+// Allocates [size] bytes for a new object of [type] in the heap, collecting
+// first if there isn't room. Returns NULL if it still doesn't fit.
+//
+// This is the fast path: it only bumps [next], and leaves everything else to
+// allocateSlow().
+static inline Object* allocate(VM* vm, ObjectType type, size_t size) {
+  void* next = vm->next;
+  if (__builtin_expect(next + size > vm->limit || !withinBudget(vm, size) ||
+                       vm->profile != NULL, 0)) {
+    return allocateSlow(vm, type, size);
+  }
+
+  vm->next = next + size;
+  vm->allocatedBytes += size;
+  vm->allocatedObjects++;
+
+  Object* object = (Object*)next;
+  object->header = (uint64_t)type << HEADER_TYPE_SHIFT;
+  return object;
+}
+
+// Allocates [size] bytes for a new object of [type] in its own mapping in the
+// large object space, collecting first if the space is full. Returns NULL if
+// it still doesn't fit.
+Object* allocateLarge(VM* vm, ObjectType type, size_t size) {
+  size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  size_t mappedSize = (sizeof(LargeObject) + size + pageSize - 1) &
+                      ~(pageSize - 1);
+
+  if (vm->largeSize + mappedSize > LARGE_SPACE_SIZE ||
+      !withinBudget(vm, mappedSize)) {
+    GC_PROBE2(alloc__slow, type, mappedSize);
+    gc(vm);
+
+    // If there still isn't room after collection, we can't fit it.
+    if (vm->largeSize + mappedSize > LARGE_SPACE_SIZE ||
+        !withinHardLimit(vm, mappedSize)) {
+      return allocationFailed(vm, mappedSize);
+    }
+  }
+
+  LargeObject* large = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (large == MAP_FAILED) return allocationFailed(vm, mappedSize);
+
+  large->next = vm->largeObjects;
+  large->mappedSize = mappedSize;
+  vm->largeObjects = large;
+  vm->largeSize += mappedSize;
+  vm->allocatedBytes += mappedSize;
+  vm->allocatedObjects++;
+
+  Object* object = (Object*)(large + 1);
+  object->header = (uint64_t)type << HEADER_TYPE_SHIFT;
+
+  if (vm->profile && gcProfileCount(vm->profile, mappedSize)) {
+    gcProfileSample(vm->profile, object, mappedSize);
+  }
+
+  return object;
+}
+
+// Copies the VM's collection statistics into [stats]. This is cheap and never
+// collects, so it can be polled as often as needed.
+void getGCStats(VM* vm, GCStats* stats) {
+  *stats = vm->stats;
+
+  // Allocations since the last collection haven't been added in yet.
+  stats->bytesAllocated += vm->allocatedBytes;
+}
+
+// Returns the minimum mutator utilization of the VM so far for windows of
+// [windowNs]: the smallest fraction of any window that long that wasn't spent
+// paused for collection.
+double getGCMMU(VM* vm, uint64_t windowNs) {
+  return gcTimelineMMU(&vm->pauses, windowNs, gcNow());
+}
+
+// Writes a JSON report of the VM's pause percentiles and its MMU curve from
+// 1ms to 1s windows to [file].
+void writeGCReport(VM* vm, FILE* file) {
+  gcWriteReport(file, &vm->pauses, &vm->stats, gcNow());
+}
+
+// Has the VM write its GC report to the file at [path] when it's freed.
+void setGCReportPath(VM* vm, const char* path) {
+  vm->reportPath = path;
+}
+
+// Copies what the last collection found in the heap into [census]. The type
+// counts come from every collector. Only LISP2 walks the heap linearly, so
+// the regions, dead spans and distances moved are only filled in by it.
+void getGCCensus(VM* vm, GCCensus* census) {
+  *census = vm->census;
+}
+
+// Writes the last collection's census to [file] as a line of JSON.
+void writeGCCensus(VM* vm, FILE* file) {
+  gcCensusWriteJSON(file, &vm->census, typeNames, 4);
+}
+
+// Starts capturing hardware performance counters around each collection phase
+// and recording them in the collection events. Returns the bitmask of
+// GCCounters that are available, which is zero if none are, in which case
+// collection carries on without them.
+uint32_t enableGCCounters(VM* vm) {
+  if (vm->counters) return vm->counters->available;
+
+  GCPerfCounters* counters = malloc(sizeof(GCPerfCounters));
+  if (gcPerfOpen(counters) == 0) {
+    free(counters);
+    return 0;
+  }
+
+  vm->counters = counters;
+  return counters->available;
+}
+
+// Starts sampling allocations, about one every [interval] bytes. If
+// [captureStacks] is non-zero, each sample is attributed to the native stack
+// that allocated it. Otherwise, it's attributed to the site last passed to
+// setAllocationSite().
+void startAllocationProfile(VM* vm, size_t interval, int captureStacks) {
+  if (!vm->profile) vm->profile = malloc(sizeof(GCProfile));
+  else gcProfileFree(vm->profile);
+
+  gcProfileInit(vm->profile, interval, captureStacks);
+}
+
+// Attributes sampled allocations from now on to [site], an ID chosen by the
+// caller, like the bytecode offset of the allocating instruction.
+void setAllocationSite(VM* vm, uint64_t site) {
+  if (vm->profile) vm->profile->currentSite = site;
+}
+
+// Writes the allocation profile to [file] as folded stacks with [metric]
+// estimated for each site. Comparing the bytes allocated to the bytes that
+// survived a collection shows which sites churn the heap and which retain
+// memory.
+void writeAllocationProfile(VM* vm, FILE* file, GCProfileMetric metric) {
+  if (vm->profile) gcProfileWrite(vm->profile, file, metric);
+}
+
+// Writes a snapshot of every object reachable from the stack to [file]. See
+// gcsnapshot.h for the format.
+//
+// This doesn't collect or move anything. Objects are marked as they're
+// reached, so it can't be called during a collection.
+void writeHeapSnapshot(VM* vm, FILE* file) {
+  // The stack, then the registered roots that point to something.
+  Object** roots = malloc((vm->stackSize + vm->rootCount + 1) *
+                          sizeof(Object*));
+  size_t rootCount = 0;
+  for (size_t i = 0; i < vm->stackSize; i++) {
+    roots[rootCount++] = getStack(vm, i);
+  }
+  for (size_t i = 0; i < vm->rootCount; i++) {
+    if (*vm->roots[i]) roots[rootCount++] = *vm->roots[i];
+  }
+
+  uint64_t* addresses = malloc((rootCount + 1) * sizeof(uint64_t));
+  for (size_t i = 0; i < rootCount; i++) {
+    addresses[i] = (uint64_t)(uintptr_t)roots[i];
+  }
+  gcSnapshotWriteHeader(file, typeNames, 4, addresses, rootCount);
+  free(addresses);
+
+  // The objects that have been reached, in order. This doubles as the queue of
+  // objects whose records haven't been written yet.
+  size_t count = 0;
+  size_t capacity = rootCount + 256;
+  Object** reached = malloc(capacity * sizeof(Object*));
+  uint64_t* edges = NULL;
+  size_t edgeCapacity = 0;
+
+  // Seed the worklist with the roots.
+  for (size_t i = 0; i < rootCount; i++) {
+    Object* root = roots[i];
+    if (isMarked(root)) continue;
+
+    root->header |= HEADER_MARK_BIT;
+    reached[count++] = root;
+  }
+
+  for (size_t written = 0; written < count; written++) {
+    Object* object = reached[written];
+
+    GCSnapshotObject record;
+    record.address = (uint64_t)(uintptr_t)object;
+    record.type = objectType(object);
+    record.size = objectSize(object);
+    record.edgeCount = 0;
+
+    size_t fields = 0;
+    Object** field = NULL;
+    Object* pairFields[2];
+    switch (objectType(object)) {
+      case OBJ_INT:
+      case OBJ_FREE:
+        break;
+
+      case OBJ_PAIR:
+        pairFields[0] = object->head;
+        pairFields[1] = object->tail;
+        fields = 2;
+        field = pairFields;
+        break;
+
+      case OBJ_ARRAY:
+        fields = object->length;
+        field = object->elements;
+        break;
+    }
+
+    if (fields > edgeCapacity) {
+      edgeCapacity = fields;
+      edges = realloc(edges, edgeCapacity * sizeof(uint64_t));
+    }
+
+    for (size_t i = 0; i < fields; i++) {
+      Object* target = field[i];
+      if (!target) continue;
+
+      edges[record.edgeCount++] = (uint64_t)(uintptr_t)target;
+      if (isMarked(target)) continue;
+
+      target->header |= HEADER_MARK_BIT;
+      if (count == capacity) {
+        capacity *= 2;
+        reached = realloc(reached, capacity * sizeof(Object*));
+      }
+      reached[count++] = target;
+    }
+
+    record.edges = edges;
+    gcSnapshotWriteObject(file, &record);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    reached[i]->header &= ~HEADER_MARK_BIT;
+  }
+
+  free(edges);
+  free(reached);
+  free(roots);
+}
+
+// Create a new object. Returns NULL if there's no room for it.
+//
+// This does *not* root the object, so it's important that a GC does not happen
+// between calling this and adding a reference to the object in a field or on
+// the stack.
+Object* newObject(VM* vm, ObjectType type) {
+  Object* object = allocate(vm, type, sizeof(Object));
+  if (!object) return NULL;
+  if (vm->trace && !vm->trace->replaying) gcTraceNew(vm->trace, object, type);
+  return object;
+}
+
+// Creates [count] new objects of [type] next to each other in the heap, and
+// returns the first. The rest follow it, so the last is at [first + count -
+// 1]. Room for all of them is reserved at once, collecting first if need be,
+// so building a structure out of them needs no more checks.
+//
+// Like newObject(), this does *not* root the objects, and they must all be
+// initialized before anything else is allocated. Returns NULL if [count] is
+// zero or more than ALLOC_MANY_MAX, or if they don't fit.
+Object* vmAllocMany(VM* vm, ObjectType type, size_t count) {
+  if (count == 0 || count > ALLOC_MANY_MAX) return NULL;
+  if (type != OBJ_INT && type != OBJ_PAIR) return NULL;
+
+  Object* first = allocate(vm, type, count * sizeof(Object));
+  if (!first) return NULL;
+  vm->allocatedObjects += count - 1;
+  for (size_t i = 1; i < count; i++) {
+    first[i].header = (uint64_t)type << HEADER_TYPE_SHIFT;
+  }
+
+  if (vm->trace && !vm->trace->replaying) {
+    gcTraceNewMany(vm->trace, first, type, count, sizeof(Object));
+  }
+  return first;
+}
+
+// Create a new array with [length] elements, all NULL. Arrays big enough go in
+// the large object space. Returns NULL if there's no room for it.
+//
+// Like newObject(), this does *not* root the array.
+Object* newArray(VM* vm, size_t length) {
+  size_t size = arraySize(length);
+
+  Object* array;
+  if (size >= LARGE_OBJECT_MIN) {
+    array = allocateLarge(vm, OBJ_ARRAY, size);
+  } else {
+    array = allocate(vm, OBJ_ARRAY, size);
+  }
+  if (!array) return NULL;
+
+  array->length = length;
+  memset(array->elements, 0, length * sizeof(Object*));
+
+  if (vm->trace && !vm->trace->replaying) {
+    gcTraceNewArray(vm->trace, array, length);
+  }
+  return array;
+}
+
+// Creates a new int object and pushes it onto the stack. Returns it, or NULL,
+// leaving the stack alone, if there's no room for it.
+Object* pushInt(VM* vm, int intValue) {
+  Object* object = newObject(vm, OBJ_INT);
+  if (!object) return NULL;
+  object->value = intValue;
+  if (vm->trace && !vm->trace->replaying) {
+    gcTraceInt(vm->trace, object, (uint32_t)intValue);
+  }
+
+  push(vm, object);
+  return object;
+}
+
+// Creates a new pair object. The field values for the pair are popped from the
+// stack, then the resulting pair is pushed. Returns NULL, leaving the stack
+// alone, if there's no room for it.
+Object* pushPair(VM* vm) {
+  // Create the pair before popping the fields. This ensures the fields don't
+  // get collected if creating the pair triggers a GC.
+  Object* object = newObject(vm, OBJ_PAIR);
+  if (!object) return NULL;
+
+  object->tail = pop(vm);
+  object->head = pop(vm);
+  if (vm->trace && !vm->trace->replaying) {
+    gcTraceSet(vm->trace, object, 1, object->tail);
+    gcTraceSet(vm->trace, object, 0, object->head);
+  }
+
+  push(vm, object);
+  return object;
+}
+
+// Creates a new array of [length] NULL elements and pushes it onto the stack.
+// Returns NULL, leaving the stack alone, if there's no room for it.
+Object* pushArray(VM* vm, size_t length) {
+  Object* array = newArray(vm, length);
+  if (!array) return NULL;
+  push(vm, array);
+  return array;
+}
+
+// Stores [value] in field [index] of [object]: 0 for a pair's head and 1 for
+// its tail, or the element at [index] of an array. Going through here, instead
+// of writing the field directly, lets the write be traced.
+void setField(VM* vm, Object* object, size_t index, Object* value) {
+  if (objectType(object) == OBJ_ARRAY) {
+    object->elements[index] = value;
+  } else if (index == 0) {
+    object->head = value;
+  } else {
+    object->tail = value;
+  }
+
+  if (vm->trace && !vm->trace->replaying) {
+    gcTraceSet(vm->trace, object, index, value);
+  }
+}
+
+// Stores [value] in [slot] of the stack, which must already be in use.
+void setStack(VM* vm, size_t slot, Object* value) {
+  *stackSlot(vm, slot) = value;
+  if (vm->trace && !vm->trace->replaying) gcTraceStore(vm->trace, slot, value);
+}
+
+// Pushes a list of the [count] ints in [values], built with vmAllocMany().
+// Like the lists built with pushPair(), it's chained through its pairs' heads,
+// holds the ints in their tails, and ends at an int, which is -1. The first
+// pair holds [values[0]]. Returns NULL, leaving the stack alone, if the list
+// doesn't fit.
+Object* pushList(VM* vm, const int* values, size_t count) {
+  if (!pushInt(vm, -1)) return NULL;
+  size_t top = vm->stackSize - 1;
+  int tracing = vm->trace && !vm->trace->replaying;
+
+  // Build it back to front, a chunk at a time, keeping the part that's done on
+  // the stack while the next chunk is allocated.
+  size_t end = count;
+  while (end > 0) {
+    size_t length = end < ALLOC_MANY_MAX ? end : ALLOC_MANY_MAX;
+    size_t start = end - length;
+
+    // Link up the pairs first, with their tails pointing at the rest of the
+    // list until the ints are allocated, and root them while that happens.
+    Object* pairs = vmAllocMany(vm, OBJ_PAIR, length);
+    if (!pairs) break;
+    Object* rest = getStack(vm, top);
+    for (size_t i = length; i > 0; i--) {
+      Object* pair = &pairs[i - 1];
+      pair->head = i == length ? rest : &pairs[i];
+      pair->tail = rest;
+      if (tracing) {
+        gcTraceSet(vm->trace, pair, 0, pair->head);
+        gcTraceSet(vm->trace, pair, 1, pair->tail);
+      }
+    }
+    push(vm, pairs);
+
+    // Allocating the ints may have moved the pairs, so follow the links.
+    Object* ints = vmAllocMany(vm, OBJ_INT, length);
+    if (!ints) break;
+    Object* pair = getStack(vm, vm->stackSize - 1);
+    for (size_t i = 0; i < length; i++) {
+      ints[i].value = values[start + i];
+      pair->tail = &ints[i];
+      if (tracing) {
+        gcTraceInt(vm->trace, &ints[i], (uint32_t)ints[i].value);
+        gcTraceSet(vm->trace, pair, 1, pair->tail);
+      }
+      pair = pair->head;
+    }
+
+    setStack(vm, top, pop(vm));
+    end = start;
+  }
+
+  // If a chunk didn't fit, drop what's been built so far.
+  if (end > 0) {
+    while (vm->stackSize > top) pop(vm);
+    return NULL;
+  }
+  return getStack(vm, top);
+}
+
+// Starts recording every allocation, push, pop and field write to a trace at
+// [path], so it can be replayed later with replayTrace(). Since the trace
+// only knows about objects allocated while recording, this must be called
+// before anything is allocated. Returns zero if the trace can't be written.
+int startTraceRecording(VM* vm, const char* path) {
+  GCTrace* trace = malloc(sizeof(GCTrace));
+  if (!gcTraceRecord(trace, path)) {
+    free(trace);
+    return 0;
+  }
+
+  vm->trace = trace;
+  return 1;
+}
+
+// Stops recording or replaying a trace, and finishes writing it.
+void stopTrace(VM* vm) {
+  if (!vm->trace) return;
+
+  gcTraceClose(vm->trace);
+  free(vm->trace);
+  vm->trace = NULL;
+}
+
+// Replays the trace at [path] on [vm], which should be new. Returns the number
+// of ops replayed, or -1 if the trace couldn't be read or refers to an object
+// that has already been collected.
+long replayTrace(VM* vm, const char* path) {
+  GCTrace* trace = malloc(sizeof(GCTrace));
+  if (!gcTraceReplay(trace, path)) {
+    free(trace);
+    return -1;
+  }
+  vm->trace = trace;
+
+  long ops = 0;
+  GCTraceRecord record;
+  while (gcTraceNext(trace, &record)) {
+    Object* object = gcTraceObject(trace, record.object);
+    Object* value = gcTraceObject(trace, record.value);
+
+    switch (record.op) {
+      case GC_TRACE_NEW:
+        if (record.type != OBJ_INT && record.type != OBJ_PAIR) {
+          ops = -1;
+          break;
+        }
+
+        // Clear the fields in case a collection sees it before they're set.
+        object = newObject(vm, (ObjectType)record.type);
+        if (!object) {
+          ops = -1;
+          break;
+        }
+        object->head = NULL;
+        object->tail = NULL;
+        gcTraceAllocated(trace, object);
+        break;
+
+      case GC_TRACE_NEW_MANY:
+        object = vmAllocMany(vm, (ObjectType)record.type, record.length);
+        if (!object) {
+          ops = -1;
+          break;
+        }
+
+        for (uint64_t i = 0; i < record.length; i++) {
+          object[i].head = NULL;
+          object[i].tail = NULL;
+          gcTraceAllocated(trace, &object[i]);
+        }
+        break;
+
+      case GC_TRACE_NEW_ARRAY:
+        object = newArray(vm, record.length);
+        if (!object) ops = -1;
+        else gcTraceAllocated(trace, object);
+        break;
+
+      case GC_TRACE_PUSH:
+        if (record.value && !value) ops = -1;
+        else push(vm, value);
+        break;
+
+      case GC_TRACE_POP:
+        if (vm->stackSize == 0) ops = -1;
+        else pop(vm);
+        break;
+
+      case GC_TRACE_SET:
+        if (!object || (record.value && !value)) ops = -1;
+        else setField(vm, object, record.field, value);
+        break;
+
+      case GC_TRACE_INT:
+        if (!object) ops = -1;
+        else object->value = (int)record.value;
+        break;
+
+      case GC_TRACE_STORE:
+        if (record.field >= (uint64_t)vm->stackSize) ops = -1;
+        else setStack(vm, (size_t)record.field, value);
+        break;
+    }
+
+    if (ops < 0) break;
+    ops++;
+  }
+
+  stopTrace(vm);
+  return ops;
+}
+
+// Prints [object].
+void objectPrint(Object* object) {
+  switch (objectType(object)) {
+    case OBJ_INT:
+      printf("%d", object->value);
+      break;
+
+    case OBJ_PAIR:
+      printf("(");
+      objectPrint(object->head);
+      printf(", ");
+      objectPrint(object->tail);
+      printf(")");
+      break;
+
+    case OBJ_ARRAY:
+      printf("[");
+      for (size_t i = 0; i < object->length; i++) {
+        if (i > 0) printf(", ");
+        if (object->elements[i]) {
+          objectPrint(object->elements[i]);
+        } else {
+          printf("nil");
+        }
+      }
+      printf("]");
+      break;
+
+    case OBJ_FREE:
+      printf("<free>");
       break;
   }
 }
 
 // Deallocates all memory used by [vm].
 void freeVM(VM *vm) {
-  free(vm->heap);
+  if (vm->reportPath) {
+    FILE* file = fopen(vm->reportPath, "w");
+    if (file) {
+      writeGCReport(vm, file);
+      fclose(file);
+    }
+  }
+
+  gcTimelineFree(&vm->pauses);
+  gcLogStopWriter(&vm->events);
+  if (vm->counters) {
+    gcPerfClose(vm->counters);
+    free(vm->counters);
+  }
+  if (vm->profile) {
+    gcProfileFree(vm->profile);
+    free(vm->profile);
+  }
+  stopTrace(vm);
+
+  while (vm->largeObjects) {
+    LargeObject* large = vm->largeObjects;
+    vm->largeObjects = large->next;
+    munmap(large, large->mappedSize);
+  }
+
+  free(vm->lineMarks);
+  free(vm->blockStates);
+  for (size_t i = 0; i < vm->segmentCount; i++) free(vm->segments[i]);
+  free(vm->segments);
+  free(vm->roots);
+  free(vm->marked);
+  free(vm->grey);
+  free(vm->greySlots);
+  if (vm->hugePages) gcPagesUnmap(vm->heap, vm->heapSize);
+  else free(vm->heap);
   free(vm);
 }
 
-void test1() {
-  printf("Test 1: Objects on stack are preserved.\n");
+void test1() {
+  printf("Test 1: Objects on stack are preserved.\n");
+  VM* vm = newVM();
+  pushInt(vm, 1);
+  pushInt(vm, 2);
+
+  gc(vm);
+  assertLive(vm, 2);
+  freeVM(vm);
+}
+
+void test2() {
+  printf("Test 2: Unreached objects are collected.\n");
+  VM* vm = newVM();
+  pushInt(vm, 1);
+  pushInt(vm, 2);
+  pop(vm);
+  pop(vm);
+
+  gc(vm);
+  assertLive(vm, 0);
+  freeVM(vm);
+}
+
+void test3() {
+  printf("Test 3: Reach nested objects.\n");
+  VM* vm = newVM();
+  pushInt(vm, 1);
+  pushInt(vm, 2);
+  pushPair(vm);
+  pushInt(vm, 3);
+  pushInt(vm, 4);
+  pushPair(vm);
+  pushPair(vm);
+
+  gc(vm);
+  assertLive(vm, 7);
+  freeVM(vm);
+}
+
+void test4() {
+  printf("Test 4: Handle cycles.\n");
+  VM* vm = newVM();
+  pushInt(vm, 1);
+  pushInt(vm, 2);
+  Object* a = pushPair(vm);
+  pushInt(vm, 3);
+  pushInt(vm, 4);
+  Object* b = pushPair(vm);
+
+  setField(vm, a, 1, b);
+  setField(vm, b, 1, a);
+
+  gc(vm);
+  assertLive(vm, 4);
+  freeVM(vm);
+}
+
+void test5() {
+  printf("Test 5: Large objects are not moved.\n");
+  VM* vm = newVM();
+
+  // Leave some garbage in the heap so that the small objects slide down.
+  pushInt(vm, 0);
+  pop(vm);
+
+  Object* small = pushArray(vm, 1);
+  pushInt(vm, 1);
+  small->elements[0] = pop(vm);
+
+  Object* large = pushArray(vm, LARGE_OBJECT_MIN / sizeof(Object*));
+  large->elements[0] = small;
+  pushInt(vm, 2);
+  large->elements[1] = pop(vm);
+
+  gc(vm);
+  assertLive(vm, 3);
+  assertLargeLive(vm, 1);
+
+  if (getStack(vm, 1) != large ||
+      large->elements[0] != getStack(vm, 0) ||
+      large->elements[1]->value != 2 ||
+      getStack(vm, 0)->elements[0]->value != 1) {
+    printf("Large object was moved or its fields were not updated.\n");
+    exit(1);
+  }
+
+  freeVM(vm);
+}
+
+void test6() {
+  printf("Test 6: Unreached large objects are unmapped.\n");
+  VM* vm = newVM();
+  pushArray(vm, LARGE_OBJECT_MIN);
+  pushArray(vm, LARGE_OBJECT_MIN);
+  pop(vm);
+
+  gc(vm);
+  assertLargeLive(vm, 1);
+
+  pop(vm);
+  gc(vm);
+  assertLargeLive(vm, 0);
+  freeVM(vm);
+}
+
+void test7() {
+  printf("Test 7: Mark-region collects garbage and handles cycles.\n");
+  VM* vm = newVMWithCollector(COLLECTOR_MARK_REGION);
+  pushInt(vm, 1);
+  pushInt(vm, 2);
+  Object* a = pushPair(vm);
+  pushInt(vm, 3);
+  pushInt(vm, 4);
+  Object* b = pushPair(vm);
+  pushInt(vm, 5);
+  pop(vm);
+
+  a->tail = b;
+  b->tail = a;
+
+  gc(vm);
+  assertLive(vm, 4);
+
+  // The freed lines get reused.
+  pushInt(vm, 6);
+  gc(vm);
+  assertLive(vm, 5);
+  freeVM(vm);
+}
+
+void test8() {
+  printf("Test 8: Mark-region evacuates sparse blocks.\n");
+  VM* vm = newVMWithCollector(COLLECTOR_MARK_REGION);
+
+  // Fill most of a block with ints, then drop all but a few of them.
+  Object* array = pushArray(vm, 1000);
+  for (int i = 0; i < 1000; i++) {
+    pushInt(vm, i);
+    array->elements[i] = pop(vm);
+  }
+
+  for (int i = 0; i < 1000; i++) {
+    if (i % 100 != 0) array->elements[i] = NULL;
+  }
+
+  // The first collection finds the block is sparse, and the second evacuates
+  // it.
+  gc(vm);
+  gc(vm);
+  assertLive(vm, 11);
+
+  array = getStack(vm, 0);
+  if (blockIndex(vm, array) == 0) {
+    printf("Sparse block was not evacuated.\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < 1000; i += 100) {
+    if (array->elements[i]->value != i) {
+      printf("Evacuated element %d has the wrong value.\n", i);
+      exit(1);
+    }
+  }
+
+  freeVM(vm);
+}
+
+void test9() {
+  printf("Test 9: Semi-space copies live objects and handles cycles.\n");
+  VM* vm = newVMWithCollector(COLLECTOR_SEMISPACE);
+  pushInt(vm, 0);
+  pop(vm);
+
+  pushInt(vm, 1);
+  pushInt(vm, 2);
+  Object* a = pushPair(vm);
+  pushInt(vm, 3);
+  pushInt(vm, 4);
+  Object* b = pushPair(vm);
+
+  a->tail = b;
+  b->tail = a;
+
+  // A large object that refers back into the heap.
+  Object* large = pushArray(vm, LARGE_OBJECT_MIN);
+  large->elements[0] = a;
+
+  gc(vm);
+  assertLive(vm, 4);
+  assertLargeLive(vm, 1);
+
+  a = getStack(vm, 0);
+  b = getStack(vm, 1);
+  if (a->tail != b || b->tail != a || a->head->value != 1 ||
+      getStack(vm, 2) != large || large->elements[0] != a) {
+    printf("Semi-space copy did not preserve the object graph.\n");
+    exit(1);
+  }
+
+  // Collect again so the objects get copied back into the first half.
+  gc(vm);
+  assertLive(vm, 4);
+  freeVM(vm);
+}
+
+void test10() {
+  printf("Test 10: Heaps with little garbage are swept, not compacted.\n");
+  VM* vm = newVM();
+  for (int i = 0; i < 10; i++) pushInt(vm, i);
+
+  // Drop one int from the middle.
+  Object* dead = getStack(vm, 5);
+  Object* last = getStack(vm, 9);
+  setStack(vm, 5, getStack(vm, 4));
+
+  gc(vm);
+  assertLive(vm, 9);
+  if (getStack(vm, 9) != last) {
+    printf("Live object moved.\n");
+    exit(1);
+  }
+
+  // The next allocation reuses the hole.
+  pushInt(vm, 10);
+  if (getStack(vm, 10) != dead) {
+    printf("Free cell was not reused.\n");
+    exit(1);
+  }
+
+  freeVM(vm);
+}
+
+void test11() {
+  printf("Test 11: Compact when no free cell is big enough.\n");
+  VM* vm = newVM();
+
+  // Fill almost all of the heap with a list of ints, linked through the heads.
+  int length = HEAP_SIZE / (2 * sizeof(Object)) - 10;
+  pushInt(vm, -1);
+  for (int i = 0; i < length; i++) {
+    pushInt(vm, i);
+    pushPair(vm);
+  }
+
+  // Unlink every fifth element, leaving lots of small holes.
+  Object* previous = getStack(vm, 0);
+  Object* pair = previous->head;
+  for (int i = length - 2; i >= 0; i--) {
+    if (i % 5 == 0) {
+      previous->head = pair->head;
+    } else {
+      previous = pair;
+    }
+    pair = pair->head;
+  }
+
+  // There isn't room at the end of the heap, and sweeping won't make a free
+  // cell this big, so this has to compact.
+  pushArray(vm, 100);
+  assertLive(vm, 2 * (length - length / 5) + 2);
+
+  // Make sure the list survived intact.
+  pair = getStack(vm, 0);
+  for (int i = length - 1; i >= 0; i--) {
+    if (i % 5 == 0 && i != length - 1) continue;
+    if (pair->tail->value != i) {
+      printf("List element %d was lost.\n", i);
+      exit(1);
+    }
+    pair = pair->head;
+  }
+
+  freeVM(vm);
+}
+
+void test12() {
+  printf("Test 12: Collections are logged with per-phase timings.\n");
+  VM* vm = newVM();
+  for (int i = 0; i < 4; i++) pushInt(vm, i);
+  pop(vm);
+  pop(vm);
+  pop(vm);
+
+  gc(vm);
+
+  GCEvent event;
+  if (!gcLogRecent(&vm->events, 0, &event) || event.sequence != 1 ||
+      event.kind != GC_KIND_COMPACT || event.liveObjects != 1 ||
+      event.freedObjects != 3 || event.freedBytes != 3 * sizeof(Object)) {
+    printf("Collection event has the wrong counts.\n");
+    exit(1);
+  }
+
+  uint64_t last = event.startNs;
+  GCPhase phases[] = {
+    GC_PHASE_MARK, GC_PHASE_CALCULATE, GC_PHASE_UPDATE, GC_PHASE_COMPACT
+  };
+  for (int i = 0; i < 4; i++) {
+    if (event.phaseStartNs[phases[i]] < last ||
+        event.phaseEndNs[phases[i]] < event.phaseStartNs[phases[i]]) {
+      printf("Phase %s has out of order timestamps.\n",
+             gcPhaseName(phases[i]));
+      exit(1);
+    }
+    last = event.phaseEndNs[phases[i]];
+  }
+
+  // Stream events to a file. The writer starts with the one already logged.
+  char path[] = "/tmp/lisp2-events-XXXXXX";
+  close(mkstemp(path));
+  gcLogStartWriter(&vm->events, path, GC_LOG_JSON);
+  for (int i = 0; i < 3; i++) gc(vm);
+  gcLogStopWriter(&vm->events);
+
+  FILE* file = fopen(path, "r");
+  int lines = 0;
+  for (int c = fgetc(file); c != EOF; c = fgetc(file)) {
+    if (c == '\n') lines++;
+  }
+  fclose(file);
+  unlink(path);
+
+  if (lines != 4) {
+    printf("Expected 4 logged events, but found %d.\n", lines);
+    exit(1);
+  }
+
+  printf("PASS: Logged %d events.\n", lines);
+  freeVM(vm);
+}
+
+void test13() {
+  printf("Test 13: Statistics track allocation and pauses.\n");
+  VM* vm = newVM();
+
+  GCStats stats;
+  getGCStats(vm, &stats);
+  if (stats.collections != 0 || stats.bytesAllocated != 0) {
+    printf("New VM has non-zero statistics.\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < 10; i++) pushInt(vm, i);
+  gc(vm);
+  for (int i = 0; i < 10; i++) pop(vm);
+  gc(vm);
+  pushInt(vm, 10);
+
+  getGCStats(vm, &stats);
+  if (stats.collections != 2 || stats.bytesAllocated != 11 * sizeof(Object) ||
+      stats.peakLiveBytes != 10 * sizeof(Object) ||
+      stats.maxPauseNs > stats.totalPauseNs ||
+      gcHistogramPercentile(&stats.pauses, 50) >
+          gcHistogramPercentile(&stats.pauses, 100)) {
+    printf("Statistics are wrong.\n");
+    exit(1);
+  }
+
+  // Percentiles should be within the histogram's precision.
+  GCHistogram histogram;
+  memset(&histogram, 0, sizeof(histogram));
+  for (int i = 1; i <= 100000; i++) gcHistogramRecord(&histogram, i);
+
+  uint64_t median = gcHistogramPercentile(&histogram, 50);
+  uint64_t p99 = gcHistogramPercentile(&histogram, 99);
+  if (median < 50000 || median > 50000 + 50000 / 32 ||
+      p99 < 99000 || p99 > 99000 + 99000 / 32) {
+    printf("Histogram percentiles are off: p50 %llu, p99 %llu.\n",
+           (unsigned long long)median, (unsigned long long)p99);
+    exit(1);
+  }
+
+  printf("PASS: %llu collections, %llu bytes allocated.\n",
+         (unsigned long long)stats.collections,
+         (unsigned long long)stats.bytesAllocated);
+  freeVM(vm);
+}
+
+void test14() {
+  printf("Test 14: Hardware counters are optional.\n");
+  VM* vm = newVM();
+  uint32_t available = enableGCCounters(vm);
+
+  for (int i = 0; i < 200; i++) pushInt(vm, i);
+  gc(vm);
+
+  GCEvent event;
+  gcLogRecent(&vm->events, 0, &event);
+  if (event.countersAvailable != available) {
+    printf("Collection event has the wrong counters.\n");
+    exit(1);
+  }
+
+  if ((available & (1u << GC_COUNTER_INSTRUCTIONS)) &&
+      event.phaseCounters[GC_PHASE_MARK][GC_COUNTER_INSTRUCTIONS] == 0) {
+    printf("Marking counted no instructions.\n");
+    exit(1);
+  }
+
+  if (available) {
+    printf("PASS: Captured counters:");
+    for (int i = 0; i < GC_COUNTER_COUNT; i++) {
+      if (available & (1u << i)) printf(" %s", gcCounterName(i));
+    }
+    printf(".\n");
+  } else {
+    printf("PASS: No counters available, collected without them.\n");
+  }
+
+  freeVM(vm);
+}
+
+void test15() {
+  printf("Test 15: Minimum mutator utilization.\n");
+
+  // 100ms with a 2ms pause at 10ms and a 5ms pause at 50ms.
+  uint64_t ms = 1000000;
+  GCTimeline timeline;
+  gcTimelineInit(&timeline, 0);
+  gcTimelineRecord(&timeline, 10 * ms, 12 * ms);
+  gcTimelineRecord(&timeline, 50 * ms, 55 * ms);
+
+  struct { uint64_t window; double mmu; } expected[] = {
+    {1 * ms, 0.0}, {10 * ms, 0.5}, {50 * ms, 0.86}, {100 * ms, 0.93},
+    {1000 * ms, 0.93}
+  };
+
+  for (int i = 0; i < 5; i++) {
+    double mmu = gcTimelineMMU(&timeline, expected[i].window, 100 * ms);
+    if (mmu < expected[i].mmu - 0.0001 || mmu > expected[i].mmu + 0.0001) {
+      printf("Expected MMU %.2f for a %llums window, but got %.4f.\n",
+             expected[i].mmu, (unsigned long long)(expected[i].window / ms),
+             mmu);
+      exit(1);
+    }
+  }
+  gcTimelineFree(&timeline);
+
+  // A 50ms pause at the start of 100s of 1ms pauses every 10ms. The timeline
+  // only keeps the last couple of seconds, but still remembers the long one.
+  gcTimelineInit(&timeline, 0);
+  gcTimelineRecord(&timeline, 100 * ms, 150 * ms);
+  for (uint64_t time = 200 * ms; time < 100000 * ms; time += 10 * ms) {
+    gcTimelineRecord(&timeline, time, time + ms);
+  }
+
+  double longWindow = gcTimelineMMU(&timeline, 50 * ms, 100000 * ms);
+  double shortWindow = gcTimelineMMU(&timeline, 10 * ms, 100000 * ms);
+  if (timeline.count > 1000 || longWindow != 0.0 || shortWindow != 0.0) {
+    printf("Expected a bounded timeline with MMU 0, but kept %zu pauses and "
+           "got %.4f and %.4f.\n", timeline.count, longWindow, shortWindow);
+    exit(1);
+  }
+
+  // The worst second holds the long pause and 90 short ones.
+  double second = gcTimelineMMU(&timeline, 1000 * ms, 100000 * ms);
+  if (second < 0.86 - 0.0001 || second > 0.86 + 0.0001) {
+    printf("Expected MMU 0.86 for a 1s window, but got %.4f.\n", second);
+    exit(1);
+  }
+  gcTimelineFree(&timeline);
+
+  // MMU isn't monotonic in the window size, but it is always a fraction.
+  VM* vm = newVM();
+  for (int i = 0; i < 100; i++) {
+    pushInt(vm, i);
+    gc(vm);
+  }
+
+  double mmu = 0;
+  for (int i = 0; i < GC_MMU_WINDOWS; i++) {
+    mmu = getGCMMU(vm, gcMMUWindowsNs[i]);
+    if (mmu < 0 || mmu > 1) {
+      printf("MMU %.4f is out of range.\n", mmu);
+      exit(1);
+    }
+  }
+
+  printf("PASS: MMU at 1s is %.3f.\n", mmu);
+  freeVM(vm);
+}
+
+// Returns the profiled site for [id] in [vm], or NULL if it has no samples.
+GCProfileSite* findProfileSite(VM* vm, uint64_t id) {
+  for (size_t i = 0; i < vm->profile->siteCount; i++) {
+    if (vm->profile->sites[i].id == id) return &vm->profile->sites[i];
+  }
+  return NULL;
+}
+
+void test16() {
+  printf("Test 16: Sampled allocations are attributed to sites.\n");
+  VM* vm = newVM();
+  startAllocationProfile(vm, 256, 0);
+
+  // Site 1 allocates objects that are kept.
+  setAllocationSite(vm, 1);
+  pushArray(vm, 100);
+  for (int i = 0; i < 100; i++) {
+    Object* object = newObject(vm, OBJ_INT);
+    getStack(vm, 0)->elements[i] = object;
+  }
+
+  // Site 2 allocates only garbage.
+  setAllocationSite(vm, 2);
+  for (int i = 0; i < 1000; i++) {
+    pushInt(vm, i);
+    pop(vm);
+  }
+
+  gc(vm);
+
+  GCProfileSite* kept = findProfileSite(vm, 1);
+  GCProfileSite* churned = findProfileSite(vm, 2);
+  if (!kept || !churned || kept->survivedBytes == 0 ||
+      churned->allocatedBytes == 0 || churned->survivedBytes != 0) {
+    printf("Samples were attributed to the wrong sites.\n");
+    exit(1);
+  }
+
+  // Restarting the profile below frees the sites, so keep what's reported.
+  double keptBytes = kept->survivedBytes;
+  double churnedBytes = churned->allocatedBytes;
+
+  char path[] = "/tmp/lisp2-profile-XXXXXX";
+  close(mkstemp(path));
+  FILE* file = fopen(path, "w");
+  writeAllocationProfile(vm, file, GC_PROFILE_SURVIVED_BYTES);
+  fclose(file);
+
+  char line[256];
+  int keptLines = 0;
+  int churnedLines = 0;
+  file = fopen(path, "r");
+  while (fgets(line, sizeof(line), file)) {
+    if (strncmp(line, "site:1 ", 7) == 0) keptLines++;
+    if (strncmp(line, "site:2 ", 7) == 0) churnedLines++;
+  }
+  fclose(file);
+
+  if (keptLines != 1 || churnedLines != 0) {
+    printf("Profile has the wrong survivors.\n");
+    exit(1);
+  }
+
+  // Captured stacks are written outermost frame first.
+  startAllocationProfile(vm, 64, 1);
+  for (int i = 0; i < 100; i++) {
+    pushInt(vm, i);
+    pop(vm);
+  }
+
+  file = fopen(path, "w");
+  writeAllocationProfile(vm, file, GC_PROFILE_ALLOCATED_BYTES);
+  fclose(file);
+
+  file = fopen(path, "r");
+  int stacks = 0;
+  while (fgets(line, sizeof(line), file)) {
+    if (strchr(line, ';')) stacks++;
+  }
+  fclose(file);
+  unlink(path);
+
+  if (stacks == 0) {
+    printf("Profile has no captured stacks.\n");
+    exit(1);
+  }
+
+  printf("PASS: Site 1 kept %.0f bytes, site 2 churned %.0f bytes.\n",
+         keptBytes, churnedBytes);
+  freeVM(vm);
+}
+
+void test17() {
+  printf("Test 17: Heap snapshots contain the live graph.\n");
+  VM* vm = newVM();
+
+  // A list of three ints, an array holding the list twice, and some garbage.
+  pushInt(vm, 1);
+  pushInt(vm, 2);
+  pushInt(vm, 3);
+  pushPair(vm);
+  pushPair(vm);
+  pushArray(vm, 3);
+  getStack(vm, 1)->elements[0] = getStack(vm, 0);
+  getStack(vm, 1)->elements[2] = getStack(vm, 0);
+  pushInt(vm, 4);
+  pop(vm);
+
+  char path[] = "/tmp/lisp2-snapshot-XXXXXX";
+  close(mkstemp(path));
+  FILE* file = fopen(path, "wb");
+  writeHeapSnapshot(vm, file);
+  fclose(file);
+
+  int roots = 0;
+  int objects = 0;
+  int edges = 0;
+  GCSnapshot snapshot;
+  GCSnapshotObject object;
+  file = fopen(path, "rb");
+  if (gcSnapshotOpen(&snapshot, file, NULL, NULL)) {
+    roots = (int)snapshot.rootCount;
+    while (gcSnapshotNext(&snapshot, &object)) {
+      objects++;
+      edges += object.edgeCount;
+    }
+  }
+  gcSnapshotClose(&snapshot);
+  fclose(file);
+  unlink(path);
+
+  if (roots != 2 || objects != 6 || edges != 6) {
+    printf("Snapshot has %d roots, %d objects and %d edges.\n",
+           roots, objects, edges);
+    exit(1);
+  }
+
+  // Taking the snapshot must not leave anything marked.
+  gc(vm);
+  assertLive(vm, 6);
+  freeVM(vm);
+}
+
+void test18() {
+  printf("Test 18: Collections take a census of the heap.\n");
   VM* vm = newVM();
-  pushInt(vm, 1);
-  pushInt(vm, 2);
 
+  // Interleave live ints with runs of one and two dead ones, then a pair.
+  for (int i = 0; i < 10; i++) {
+    pushInt(vm, i);
+    for (int j = 0; j < i % 2 + 1; j++) {
+      pushInt(vm, j);
+      pop(vm);
+    }
+  }
+  pushInt(vm, 10);
+  pushInt(vm, 11);
+  pushPair(vm);
+
+  vm->forceCompact = 1;
   gc(vm);
-  assertLive(vm, 2);
+
+  GCCensus census;
+  getGCCensus(vm, &census);
+
+  uint64_t live = 0;
+  uint64_t dead = 0;
+  for (int i = 0; i < GC_CENSUS_REGIONS; i++) {
+    live += census.regionLive[i];
+    dead += census.regionDead[i];
+  }
+
+  if (census.objects[OBJ_INT] != 12 || census.objects[OBJ_PAIR] != 1 ||
+      live != 13 * sizeof(Object) || dead != 15 * sizeof(Object) ||
+      census.spanCount != 10 || census.largestSpan != 2 * sizeof(Object) ||
+      census.movedObjects != 12 ||
+      census.maxDistance != 15 * sizeof(Object)) {
+    printf("Census has the wrong counts.\n");
+    exit(1);
+  }
+
+  printf("PASS: ");
+  writeGCCensus(vm, stdout);
   freeVM(vm);
 }
 
-void test2() {
-  printf("Test 2: Unreached objects are collected.\n");
+// Builds a list of pairs whose tails are either ints or other pairs in the
+// list, with garbage allocated in between so that collections move it.
+void buildTracedList(VM* vm) {
+  pushInt(vm, 0);
+  for (int i = 1; i <= 2000; i++) {
+    pushInt(vm, i);
+    pushPair(vm);
+
+    for (int j = 0; j < 20; j++) {
+      pushInt(vm, -i);
+      pop(vm);
+    }
+
+    // Every so often, point this node's tail back at an older one.
+    if (i % 7 == 0) {
+      Object* node = getStack(vm, 0);
+      Object* older = node;
+      for (int j = 0; j < i % 13 && objectType(older->head) == OBJ_PAIR; j++) {
+        older = older->head;
+      }
+      setField(vm, node, 1, older);
+    }
+  }
+}
+
+// Adds up the ints in the tails of the list built by buildTracedList().
+long sumTracedList(Object* list) {
+  long sum = 0;
+  for (; objectType(list) == OBJ_PAIR; list = list->head) {
+    if (objectType(list->tail) == OBJ_INT) sum += list->tail->value;
+  }
+  return sum;
+}
+
+void test19() {
+  printf("Test 19: Traces replay the same heap under every collector.\n");
+  char path[] = "/tmp/lisp2-trace-XXXXXX";
+  close(mkstemp(path));
+
   VM* vm = newVM();
-  pushInt(vm, 1);
-  pushInt(vm, 2);
-  pop(vm);
+  startTraceRecording(vm, path);
+  buildTracedList(vm);
+  long expected = sumTracedList(getStack(vm, 0));
+  uint64_t collections = vm->collections;
+  freeVM(vm);
+
+  for (int i = 0; i < COLLECTOR_COUNT; i++) {
+    vm = newVMWithCollector(collectors[i].collector);
+    long ops = replayTrace(vm, path);
+    if (ops <= 0 || vm->stackSize != 1 ||
+        sumTracedList(getStack(vm, 0)) != expected) {
+      printf("Replay under collector %s did not match.\n", collectors[i].name);
+      exit(1);
+    }
+
+    if (collections == 0 ||
+        (collectors[i].collector == COLLECTOR_LISP2 &&
+         vm->collections != collections)) {
+      printf("Replay collected %llu times instead of %llu.\n",
+             (unsigned long long)vm->collections,
+             (unsigned long long)collections);
+      exit(1);
+    }
+    freeVM(vm);
+  }
+
+  unlink(path);
+  printf("PASS: Replayed the trace under each collector.\n");
+}
+
+void test20() {
+  printf("Test 20: Heaps can be bigger than HEAP_SIZE.\n");
+  for (int i = 0; i < COLLECTOR_COUNT; i++) {
+    VM* vm = newVMWithHeapSize(collectors[i].collector, 4 * HEAP_SIZE + 1);
+    if (vm->heapSize < 4 * HEAP_SIZE + 1 ||
+        (collectors[i].collector == COLLECTOR_MARK_REGION &&
+         vm->heapSize != (size_t)vm->heapBlocks * BLOCK_SIZE)) {
+      printf("Heap size %zu was not rounded up.\n", vm->heapSize);
+      exit(1);
+    }
+
+    // More live objects than a default heap could hold, even counting both
+    // halves of a semi-space one.
+    pushInt(vm, 0);
+    long length = 3 * HEAP_SIZE / (4 * sizeof(Object));
+    long expected = 0;
+    for (long n = 0; n < length; n++) {
+      pushInt(vm, (int)n);
+      pushPair(vm);
+      expected += n;
+    }
+    gc(vm);
+
+    long sum = 0;
+    for (Object* node = getStack(vm, 0); objectType(node) == OBJ_PAIR;
+         node = node->head) {
+      sum += node->tail->value;
+    }
+
+    GCStats stats;
+    getGCStats(vm, &stats);
+    if (sum != expected || stats.peakHeapBytes != vm->heapSize) {
+      printf("Collector %s lost objects in a large heap.\n",
+             collectors[i].name);
+      exit(1);
+    }
+    freeVM(vm);
+  }
+
+  printf("PASS: Each collector used a heap four times the default size.\n");
+}
+
+void test21() {
+  printf("Test 21: Handles survive stack growth and collections.\n");
+  VM* vm = newVM();
+
+  // Some garbage at the bottom of the heap, so compaction moves everything.
+  pushInt(vm, -1);
   pop(vm);
 
+  HandleScope outer = openHandleScope(vm);
+  pushInt(vm, 42);
+  Handle answer = newHandle(vm, pop(vm));
+  Object* before = *answer;
+
+  // Enough roots to take many segments.
+  HandleScope inner = openHandleScope(vm);
+  int roots = 40 * STACK_SEGMENT_SIZE;
+  for (int i = 0; i < roots; i++) pushInt(vm, i);
+
+  vm->forceCompact = 1;
+  gc(vm);
+  for (int i = 0; i < roots; i++) {
+    if (getStack(vm, i + 1)->value != i) {
+      printf("Root %d was not preserved.\n", i);
+      exit(1);
+    }
+  }
+
+  if (*answer == before || (*answer)->value != 42) {
+    printf("Handle was not updated when its object moved.\n");
+    exit(1);
+  }
+
+  closeHandleScope(vm, inner);
+  gc(vm);
+  assertLive(vm, 1);
+
+  closeHandleScope(vm, outer);
   gc(vm);
   assertLive(vm, 0);
   freeVM(vm);
 }
 
-void test3() {
-  printf("Test 3: Reach nested objects.\n");
-  VM* vm = newVM();
-  pushInt(vm, 1);
-  pushInt(vm, 2);
-  pushPair(vm);
-  pushInt(vm, 3);
-  pushInt(vm, 4);
-  pushPair(vm);
-  pushPair(vm);
+void test22() {
+  printf("Test 22: Registered roots are kept alive and updated.\n");
+  for (int i = 0; i < COLLECTOR_COUNT; i++) {
+    VM* vm = newVMWithCollector(collectors[i].collector);
+    Object* global = NULL;
+    Object* unset = NULL;
+    vmAddRoot(vm, &global);
+    vmAddRoot(vm, &unset);
+
+    // Garbage below the rooted pair, so that it moves.
+    pushInt(vm, -1);
+    pop(vm);
+    pushInt(vm, 1);
+    pushInt(vm, 2);
+    global = pushPair(vm);
+    pop(vm);
+
+    Object* before = global;
+    vm->forceCompact = 1;
+    gc(vm);
+    if (unset != NULL || global->head->value != 1 ||
+        global->tail->value != 2 ||
+        (collectors[i].collector != COLLECTOR_MARK_REGION &&
+         global == before)) {
+      printf("Collector %s did not update a registered root.\n",
+             collectors[i].name);
+      exit(1);
+    }
+
+    vmRemoveRoot(vm, &global);
+    vmRemoveRoot(vm, &unset);
+    gc(vm);
+    if (vm->rootCount != 0 || vm->liveObjects != 0) {
+      printf("Collector %s kept a removed root alive.\n", collectors[i].name);
+      exit(1);
+    }
+    freeVM(vm);
+  }
+
+  printf("PASS: Registered roots were updated and then released.\n");
+}
+
+// Returns whether [list] holds the [count] ints in [values], in order, and
+// then ends at the int -1.
+static int isPushedList(Object* list, const int* values, size_t count) {
+  for (size_t i = 0; i < count; i++, list = list->head) {
+    if (objectType(list) != OBJ_PAIR || list->tail->value != values[i]) {
+      return 0;
+    }
+  }
+  return objectType(list) == OBJ_INT && list->value == -1;
+}
+
+void test23() {
+  printf("Test 23: Lists built with bulk allocation survive collection.\n");
+  int values[5000];
+  for (int i = 0; i < 5000; i++) values[i] = i * 7 - 3;
+
+  char path[] = "/tmp/lisp2-trace-XXXXXX";
+  close(mkstemp(path));
+
+  for (int i = 0; i < COLLECTOR_COUNT; i++) {
+    VM* vm = newVMWithCollector(collectors[i].collector);
+    if (i == 0) startTraceRecording(vm, path);
+
+    // Fill most of the heap with garbage, so that building the list collects.
+    for (int j = 0; j < 40000; j++) {
+      pushInt(vm, j);
+      pop(vm);
+    }
+
+    Object* list = pushList(vm, values, 5000);
+    if (!isPushedList(list, values, 5000) || vm->collections == 0) {
+      printf("Collector %s built the wrong list.\n", collectors[i].name);
+      exit(1);
+    }
+
+    gc(vm);
+    if (!isPushedList(getStack(vm, 0), values, 5000) ||
+        vm->liveObjects != 2 * 5000 + 1) {
+      printf("Collector %s lost part of the list.\n", collectors[i].name);
+      exit(1);
+    }
+    freeVM(vm);
+  }
+
+  for (int i = 0; i < COLLECTOR_COUNT; i++) {
+    VM* vm = newVMWithCollector(collectors[i].collector);
+    if (replayTrace(vm, path) <= 0 || vm->stackSize != 1 ||
+        !isPushedList(getStack(vm, 0), values, 5000)) {
+      printf("Replaying the list under collector %s did not match.\n",
+             collectors[i].name);
+      exit(1);
+    }
+    freeVM(vm);
+  }
+
+  unlink(path);
+  printf("PASS: Bulk-allocated lists were built, collected and replayed.\n");
+}
+
+// Allocates garbage until three quarters of the room the last collection left
+// free in [vm]'s heap is used up.
+static void fillWithGarbage(VM* vm) {
+  size_t capacity = vm->collector == COLLECTOR_SEMISPACE ? vm->heapSize / 2
+                                                         : vm->heapSize;
+  size_t count = (capacity - vm->liveBytes) * 3 / 4 / sizeof(Object);
+  for (size_t i = 0; i < count; i++) {
+    pushInt(vm, (int)i);
+    pop(vm);
+  }
+}
+
+void test24() {
+  printf("Test 24: Idle notifications collect when there's time.\n");
+  for (int i = 0; i < COLLECTOR_COUNT; i++) {
+    VM* vm = newVMWithCollector(collectors[i].collector);
+    pushInt(vm, -1);
+    for (int j = 0; j < 1000; j++) {
+      pushInt(vm, j);
+      pushPair(vm);
+    }
+    gc(vm);
+    fillWithGarbage(vm);
+
+    uint64_t collections = vm->collections;
+    if (vmIdleNotification(vm, gcNow()) != GC_IDLE_NONE ||
+        vm->collections != collections) {
+      printf("Collector %s collected after the deadline.\n",
+             collectors[i].name);
+      exit(1);
+    }
+
+    if (vmIdleNotification(vm, gcNow() + 1000000000) != GC_IDLE_FULL ||
+        vm->collections != collections + 1 || vm->allocatedBytes != 0) {
+      printf("Collector %s did not collect while idle.\n", collectors[i].name);
+      exit(1);
+    }
 
+    if (vmIdleNotification(vm, gcNow() + 1000000000) != GC_IDLE_NONE) {
+      printf("Collector %s collected an empty heap while idle.\n",
+             collectors[i].name);
+      exit(1);
+    }
+    freeVM(vm);
+  }
+
+  // With too little time to compact, a LISP2 heap is only swept.
+  VM* vm = newVMWithCollector(COLLECTOR_LISP2);
+  pushInt(vm, -1);
+  vm->forceCompact = 1;
   gc(vm);
-  assertLive(vm, 7);
+  fillWithGarbage(vm);
+  for (int phase = 0; phase < GC_PHASE_COUNT; phase++) {
+    vm->predictor.nsPerByte[GC_KIND_COMPACT][phase] = 1000000;
+  }
+
+  GCEvent event;
+  if (vmIdleNotification(vm, gcNow() + 1000000000) != GC_IDLE_PARTIAL ||
+      !gcLogRecent(&vm->events, 0, &event) || event.kind != GC_KIND_SWEEP) {
+    printf("Did not sweep when there wasn't time to compact.\n");
+    exit(1);
+  }
   freeVM(vm);
+
+  printf("PASS: Idle notifications collected only before the deadline.\n");
 }
 
-void test4() {
-  printf("Test 4: Handle cycles.\n");
+static int outOfMemoryCalls = 0;
+
+static void countOutOfMemory(VM* vm, size_t size) {
+  outOfMemoryCalls++;
+}
+
+void test25() {
+  printf("Test 25: Allocation fails gracefully at the hard limit.\n");
+  for (int i = 0; i < COLLECTOR_COUNT; i++) {
+    VM* vm = newVMWithCollector(collectors[i].collector);
+    setHeapLimits(vm, 0, 200 * 1024);
+    setOutOfMemoryHandler(vm, countOutOfMemory);
+    outOfMemoryCalls = 0;
+
+    // Grow a list until it doesn't fit.
+    pushInt(vm, -1);
+    int length = 0;
+    while (pushInt(vm, length)) {
+      if (!pushPair(vm)) {
+        pop(vm);
+        break;
+      }
+      length++;
+    }
+
+    if (outOfMemoryCalls != 1 || !vm->reserveOpen || vm->stackSize != 1 ||
+        length < 3000 || vm->liveBytes + vm->allocatedBytes > 200 * 1024) {
+      printf("Collector %s did not stop at the hard limit.\n",
+             collectors[i].name);
+      exit(1);
+    }
+
+    // Cleanup code can still allocate in the reserve.
+    for (int j = 0; j < 100; j++) {
+      if (!pushInt(vm, j)) {
+        printf("Collector %s could not allocate in the reserve.\n",
+               collectors[i].name);
+        exit(1);
+      }
+    }
+
+    // Dropping the list closes the reserve again.
+    while (vm->stackSize > 0) pop(vm);
+    gc(vm);
+    if (vm->reserveOpen || !pushList(vm, (int[]){ 1, 2, 3 }, 3)) {
+      printf("Collector %s did not recover after freeing memory.\n",
+             collectors[i].name);
+      exit(1);
+    }
+    freeVM(vm);
+  }
+
+  // Going over the soft limit collects before the heap is full.
+  VM* vm = newVMWithCollector(COLLECTOR_LISP2);
+  setHeapLimits(vm, 100 * 1024, 0);
+  for (int i = 0; i < 12800; i++) {
+    pushInt(vm, i);
+    pop(vm);
+  }
+  if (vm->collections < 2) {
+    printf("Did not collect at the soft limit.\n");
+    exit(1);
+  }
+  freeVM(vm);
+
+  printf("PASS: Allocation failed at the limit and recovered.\n");
+}
+
+void test26() {
+  printf("Test 26: Huge-page heaps are aligned and collect as before.\n");
+  for (int i = 0; i < COLLECTOR_COUNT; i++) {
+    VM* vm = newVMWithCollector(collectors[i].collector);
+    if (!enableHugePages(vm) ||
+        (uintptr_t)vm->heap % GC_HUGE_PAGE_SIZE != 0) {
+      printf("Collector %s could not map the heap in huge pages.\n",
+             collectors[i].name);
+      exit(1);
+    }
+
+    for (int j = 0; j < 1000; j++) pushInt(vm, j);
+    for (int j = 0; j < 100000; j++) {
+      pushInt(vm, j);
+      pop(vm);
+    }
+
+    long sum = 0;
+    for (int j = 0; j < 1000; j++) sum += getStack(vm, j)->value;
+    if (vm->collections == 0 || sum != 1000 * 999 / 2) {
+      printf("Collector %s lost objects in a huge-page heap.\n",
+             collectors[i].name);
+      exit(1);
+    }
+    freeVM(vm);
+  }
+
+  // It's too late once something has been allocated.
   VM* vm = newVM();
   pushInt(vm, 1);
-  pushInt(vm, 2);
-  Object* a = pushPair(vm);
-  pushInt(vm, 3);
-  pushInt(vm, 4);
-  Object* b = pushPair(vm);
+  if (enableHugePages(vm)) {
+    printf("Moved a heap that had objects in it.\n");
+    exit(1);
+  }
+  freeVM(vm);
 
-  a->tail = b;
-  b->tail = a;
+  printf("PASS: Huge-page heaps are aligned and kept their objects.\n");
+}
 
-  gc(vm);
-  assertLive(vm, 4);
+void test27() {
+  printf("Test 27: Long lists don't overflow the C stack when marked.\n");
+  int length = 1000000;
+  for (int i = 0; i < COLLECTOR_COUNT; i++) {
+    VM* vm = newVMWithHeapSize(collectors[i].collector,
+                               (size_t)length * 6 * sizeof(Object));
+    pushInt(vm, -1);
+    for (int j = 0; j < length; j++) {
+      pushInt(vm, j);
+      pushPair(vm);
+    }
+
+    gc(vm);
+    gc(vm);
+
+    long sum = 0;
+    int count = 0;
+    for (Object* node = getStack(vm, 0); objectType(node) == OBJ_PAIR;
+         node = node->head) {
+      sum += node->tail->value;
+      count++;
+    }
+    if (count != length || sum != (long)length * (length - 1) / 2) {
+      printf("Collector %s lost part of a long list.\n", collectors[i].name);
+      exit(1);
+    }
+    freeVM(vm);
+  }
+
+  printf("PASS: Marked lists of %d pairs.\n", length);
+}
+
+// Returns the current time in seconds from a monotonic clock.
+double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Keeps a long-lived list alive while churning through short-lived pairs, and
+// returns how long that took.
+double churn(Collector collector) {
+  VM* vm = newVMWithCollector(collector);
+  double start = now();
+
+  // The long-lived list.
+  pushInt(vm, 0);
+  for (int i = 0; i < 5000; i++) {
+    pushInt(vm, i);
+    pushPair(vm);
+  }
+
+  for (int i = 0; i < 200000; i++) {
+    pushInt(vm, i);
+    pushInt(vm, i);
+    pushPair(vm);
+    pop(vm);
+  }
+
+  double elapsed = now() - start;
   freeVM(vm);
+  return elapsed;
+}
+
+// Runs the same workload under each collector.
+void collectorTest() {
+  printf("Collector Comparison.\n");
+  double lisp2 = churn(COLLECTOR_LISP2);
+  double markRegion = churn(COLLECTOR_MARK_REGION);
+  double semispace = churn(COLLECTOR_SEMISPACE);
+  printf("LISP2 %.3fs, mark-region %.3fs, semi-space %.3fs.\n",
+         lisp2, markRegion, semispace);
 }
 
-void perfTest() {
-  printf("Performance Test.\n");
+// Measures how many bytes of heap each live pair costs, and compares it to the
+// old object layout, which stored the type and the forwarding pointer in
+// separate fields.
+void footprintTest() {
+  printf("Footprint Test.\n");
+
+  // The object layout before type, mark and forwarding state were packed into
+  // a single header word.
+  typedef struct {
+    ObjectType type;
+    void* moveTo;
+    union {
+      int value;
+      struct {
+        void* head;
+        void* tail;
+      };
+    };
+  } UnpackedObject;
+
+  // Build a list of pairs, each of whose heads is an int.
   VM* vm = newVM();
+  int pairs = 1000;
+  pushInt(vm, 0);
+  for (int i = 0; i < pairs; i++) {
+    pushInt(vm, i);
+    Object* pair = pushPair(vm);
+
+    // Swap the head and tail so that the list grows through the tail.
+    Object* head = pair->head;
+    pair->head = pair->tail;
+    pair->tail = head;
+  }
 
-  for (int i = 0; i < 100000; i++) {
-    for (int j = 0; j < 20; j++) {
-      pushInt(vm, i);
+  gc(vm);
+
+  // Each pair keeps itself and its int alive. Attribute the final int that
+  // ends the list to the pairs too.
+  double packed = (double)(vm->next - vm->heap) / pairs;
+  double unpacked = (double)(sizeof(UnpackedObject) * (2 * pairs + 1)) / pairs;
+  printf("%.1f bytes per live pair (was %.1f).\n", packed, unpacked);
+  freeVM(vm);
+}
+
+// The benchmark suite needs the VM API above.
+#include "gcbench.h"
+
+// Builds a list of [objects] / 2 pairs, each with an int in its tail, with an
+// unreachable int allocated before each pair, in a heap just big enough to
+// hold them without collecting. Then compacts it and writes a line of JSON
+// with how long each LISP2 phase took, in total and per GB of heap it
+// collected. Returns zero if the list didn't survive.
+static int scaleRun(size_t objects) {
+  size_t nodes = objects / 2;
+  VM* vm = newVMWithHeapSize(COLLECTOR_LISP2,
+                             (nodes * 3 + 1) * sizeof(Object));
+
+  pushInt(vm, 0);
+  for (size_t i = 0; i < nodes; i++) {
+    pushInt(vm, (int)i);
+    pop(vm);
+    pushInt(vm, (int)i);
+    pushPair(vm);
+  }
+
+  vm->forceCompact = 1;
+  gc(vm);
+  GCEvent event;
+  gcLogRecent(&vm->events, 0, &event);
+
+  uint64_t sum = 0;
+  for (Object* node = getStack(vm, 0); objectType(node) == OBJ_PAIR;
+       node = node->head) {
+    sum += node->tail->value;
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  double gigabytes = event.usedBytesBefore / 1e9;
+  printf("{\"objects\":%zu,\"heap_bytes\":%zu,\"used_bytes\":%llu,"
+         "\"live_bytes\":%llu,\"pause_ns\":%llu,", objects, vm->heapSize,
+         (unsigned long long)event.usedBytesBefore,
+         (unsigned long long)event.liveBytes,
+         (unsigned long long)(event.endNs - event.startNs));
+
+  GCPhase phases[] = {
+    GC_PHASE_MARK, GC_PHASE_CALCULATE, GC_PHASE_UPDATE, GC_PHASE_COMPACT
+  };
+  for (int i = 0; i < 4; i++) {
+    uint64_t ns = gcPhaseNs(&event, phases[i]);
+    printf("\"%s_ns\":%llu,\"%s_ns_per_gb\":%.0f,", gcPhaseName(phases[i]),
+           (unsigned long long)ns, gcPhaseName(phases[i]), ns / gigabytes);
+  }
+  printf("\"ns_per_object\":%.2f,\"peak_rss_kb\":%ld}\n",
+         (double)(event.endNs - event.startNs) / objects, usage.ru_maxrss);
+
+  int survived = vm->collections == 1 &&
+                 sum == (uint64_t)nodes * (nodes - 1) / 2;
+  freeVM(vm);
+  return survived;
+}
+
+// Runs scaleRun() for 10^4 objects and every power of ten above it up to
+// [maxObjects], each in its own process. Sizes whose heap wouldn't fit in the
+// memory that's free are skipped. Returns zero if any run failed.
+static int scaleBenchmark(size_t maxObjects) {
+  size_t available = (size_t)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+
+  for (size_t objects = 10000; objects <= maxObjects; objects *= 10) {
+    size_t heapBytes = (objects / 2 * 3 + 1) * sizeof(Object);
+    if (heapBytes > available / 10 * 9) {
+      printf("{\"objects\":%zu,\"heap_bytes\":%zu,\"skipped\":"
+             "\"only %zu bytes free\"}\n", objects, heapBytes, available);
+      continue;
     }
 
-    for (int k = 0; k < 20; k++) {
-      pop(vm);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) exit(scaleRun(objects) ? 0 : 1);
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "Scaling run with %zu objects failed.\n", objects);
+      return 0;
     }
   }
-  freeVM(vm);
+
+  return 1;
 }
 
+// Runs the tests, or one of these commands:
+//
+//     bench                         Runs the benchmark suite under each
+//                                   collector and prints the results as JSON.
+//     alloc                         Times allocation under each collector and
+//                                   prints the results as JSON.
+//     huge                          Times collections of a scattered heap
+//                                   with and without huge pages under each
+//                                   collector and prints the results as JSON.
+//     record <benchmark> <trace>    Records a trace of a benchmark.
+//     replay <trace> [collector]    Replays a trace under one collector, or
+//                                   each of them, and prints the results.
+//     scale [objects]               Times each LISP2 phase compacting live
+//                                   graphs from 10^4 objects up to 10^9, or
+//                                   [objects], and prints the results as JSON.
+//     sweep <benchmark> [collector] Runs a benchmark under one collector, or
+//                                   each of them, with heaps from 1.1 to 6
+//                                   times its live size, and prints the
+//                                   results as CSV.
 int main(int argc, const char * argv[]) {
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    for (int i = 0; i < COLLECTOR_COUNT; i++) {
+      runBenchmarks("lisp2", collectors[i].name, collectors[i].create);
+    }
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "alloc") == 0) {
+    for (int i = 0; i < COLLECTOR_COUNT; i++) {
+      allocBenchmark("lisp2", collectors[i].name, collectors[i].create);
+    }
+    for (int i = 0; i < COLLECTOR_COUNT; i++) {
+      listBenchmark("lisp2", collectors[i].name, collectors[i].create);
+    }
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "idle") == 0) {
+    for (int i = 0; i < COLLECTOR_COUNT; i++) {
+      idleBenchmark("lisp2", collectors[i].name, collectors[i].create);
+    }
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "huge") == 0) {
+    for (int i = 0; i < COLLECTOR_COUNT; i++) {
+      hugePageBenchmark("lisp2", collectors[i].name,
+                        collectors[i].createSized);
+    }
+    return 0;
+  }
+
+  if (argc == 4 && strcmp(argv[1], "record") == 0) {
+    if (recordBenchmark(argv[2], argv[3], newLisp2VM)) return 0;
+    fprintf(stderr, "Could not record %s to %s.\n", argv[2], argv[3]);
+    return 1;
+  }
+
+  if (argc >= 3 && strcmp(argv[1], "replay") == 0) {
+    for (int i = 0; i < COLLECTOR_COUNT; i++) {
+      if (argc > 3 && strcmp(argv[3], collectors[i].name) != 0) continue;
+      if (!replayBenchmark("lisp2", collectors[i].name, argv[2],
+                           collectors[i].create)) {
+        fprintf(stderr, "Could not replay %s.\n", argv[2]);
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "scale") == 0) {
+    size_t maxObjects = argc > 2 ? strtoull(argv[2], NULL, 10) : 1000000000;
+    return scaleBenchmark(maxObjects) ? 0 : 1;
+  }
+
+  if (argc >= 3 && strcmp(argv[1], "sweep") == 0) {
+    writeSweepHeader();
+    for (int i = 0; i < COLLECTOR_COUNT; i++) {
+      if (argc > 3 && strcmp(argv[3], collectors[i].name) != 0) continue;
+      if (!sweepBenchmark("lisp2", collectors[i].name, argv[2],
+                          collectors[i].create, collectors[i].createSized)) {
+        fprintf(stderr, "No benchmark named %s.\n", argv[2]);
+        return 1;
+      }
+    }
+    return 0;
+  }
+
   test1();
   test2();
   test3();
   test4();
-  perfTest();
+  test5();
+  test6();
+  test7();
+  test8();
+  test9();
+  test10();
+  test11();
+  test12();
+  test13();
+  test14();
+  test15();
+  test16();
+  test17();
+  test18();
+  test19();
+  test20();
+  test21();
+  test22();
+  test23();
+  test24();
+  test25();
+  test26();
+  test27();
+  footprintTest();
+  collectorTest();
   
   return 0;
 }